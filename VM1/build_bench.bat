@@ -0,0 +1,11 @@
+call "shared.bat"
+
+set src_vm1=src\vm1\
+set src_bench=src\bench\
+set bin_bench=bin\bench\
+
+cd %bin_bench%
+
+gcc -std=c99 -O2 ..\..\%src_bench%vm1_bench.c ..\..\%src_vm1%vm1.c ..\..\%src_vm1%vm1_jit.c ..\..\%src_vm1%vm1_profile.c ..\..\%src_vm1%vm1_map.c ..\..\%src_vm1%vm1_image.c ..\..\%src_vm1%vm1_aot.c ..\..\%src_vm1%vm1_snapshot.c ..\..\%src_vm1%vm1_lanes.c ..\..\%src_shared%str.c ..\..\%src_shared%vbc.c -lpsapi -o vm1_bench.exe
+
+pause
\ No newline at end of file
@@ -5,6 +5,6 @@ set bin_vm1=bin\vm1\
 
 cd %bin_vm1%
 
-gcc -std=c99 ..\..\%src_vm1%vm1.c -o vm1.exe
+gcc -std=c99 -O2 ..\..\%src_vm1%vm1_main.c ..\..\%src_vm1%vm1.c ..\..\%src_vm1%vm1_jit.c ..\..\%src_vm1%vm1_batch.c ..\..\%src_vm1%vm1_profile.c ..\..\%src_vm1%vm1_map.c ..\..\%src_vm1%vm1_image.c ..\..\%src_vm1%vm1_aot.c ..\..\%src_vm1%vm1_snapshot.c ..\..\%src_vm1%vm1_lanes.c ..\..\%src_shared%str.c ..\..\%src_shared%vbc.c -o vm1.exe
 
 pause
\ No newline at end of file
@@ -5,6 +5,6 @@ set bin_vm1_asm=bin\vm1_asm\
 
 cd %bin_vm1_asm%
 
-gcc -std=c99 ..\..\%src_vm1_asm%vm1_asm.c ..\..\%src_shared%str.c -o vm1_asm.exe
+gcc -std=c99 ..\..\%src_vm1_asm%vm1_asm.c ..\..\%src_shared%str.c ..\..\%src_shared%vbc.c -o vm1_asm.exe
 
 pause
\ No newline at end of file
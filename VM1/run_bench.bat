@@ -0,0 +1,3 @@
+bin\bench\vm1_bench.exe -repeat 5 -csv bench\results.csv -asm bin\vm1_asm\vm1_asm.exe bench\arith.vm1.vbc bench\memory.vm1.vbc bench\output.vm1.vbc bench\branches.vm1.vbc bench\words.vm1.vbc bench\arith.vm1 bench\memory.vm1 bench\output.vm1 bench\branches.vm1 bench\words.vm1
+
+pause
\ No newline at end of file
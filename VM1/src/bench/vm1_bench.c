@@ -0,0 +1,663 @@
+#ifndef _WIN32
+#define _XOPEN_SOURCE 700 // clock_gettime(), getrusage()
+#endif
+
+#include <stdio.h>    // printf(), fopen(), fread(), fwrite(), fprintf(), snprintf(), remove()
+#include <stdlib.h>   // malloc(), free(), qsort(), system(), strtoul()
+#include <string.h>   // strlen(), strrchr()
+#include <limits.h>   // ULONG_MAX
+#include <math.h>     // sqrt()
+#include <inttypes.h> // PRIu64
+
+#ifdef _WIN32
+#include <windows.h> // QueryPerformanceCounter()
+#include <psapi.h>   // GetProcessMemoryInfo()
+#define NULL_DEVICE "nul"
+#else
+#include <time.h>         // clock_gettime()
+#include <sys/resource.h> // getrusage()
+#define NULL_DEVICE "/dev/null"
+#endif
+
+#include "..\shared\shared_macros.h" // PROJECT_NAME, VM_VERSION, TRUE, FALSE
+#include "..\shared\str.h"           // str_equals()
+
+#include "..\vm1\vm1.h"
+
+// Benchmarks the virtual machine and the assembler, see
+// vm1_doc.txt. Every benchmark is run a number of times, and the
+// statistics of the wall times are printed, and written to a CSV
+// file when one is given.
+
+#define DEFAULT_REPEAT 5
+
+// Instructions of the generated assembler program. Location
+// pointers are 16 bits, so calls only go to the ones in about the
+// first 64K of the output, however long the program is.
+#define DEFAULT_GENERATED_LINES 16000
+#define GENERATED_CALLED_BYTES 60000
+#define GENERATED_FILE_NAME "vm1_bench_generated.vm1"
+
+// Sources are assembled from a copy with this name, so that the
+// program files next to them stay as they are
+#define ASSEMBLED_FILE_NAME "vm1_bench_assembled.vm1"
+
+// Forks of a program run together by the lanes benchmark
+#define LANE_FORKS 16
+
+#define CSV_HEADER "benchmark,engine,runs,work,unit,median_s,min_s,mean_s,stddev_s,per_second,peak_rss_kb\n"
+
+typedef struct
+{
+    const char *name;
+    int dispatch;
+    int use_jit;
+
+    // Runs with an instruction budget that never runs out, which
+    // selects the counting interpreter
+    int counting;
+} bench_engine;
+
+const bench_engine engines[] = {
+    {"switch", VM1_DISPATCH_SWITCH, FALSE, FALSE},
+    {"threaded", VM1_DISPATCH_THREADED, FALSE, FALSE},
+    {"jit", VM1_DISPATCH_SWITCH, TRUE, FALSE},
+    {"counting", VM1_DISPATCH_SWITCH, FALSE, TRUE}};
+
+#define ENGINE_COUNT (sizeof(engines) / sizeof(engines[0]))
+
+// Rows of every program: the engines, lanes and load
+const char *const program_rows[] = {"switch", "threaded", "jit", "counting", "lanes", "load"};
+
+#define PROGRAM_ROW_COUNT (sizeof(program_rows) / sizeof(program_rows[0]))
+
+typedef struct
+{
+    double median;
+    double min;
+    double mean;
+    double stddev;
+} bench_stats;
+
+unsigned long repeat = DEFAULT_REPEAT;
+const char *csv_name = NULL;
+FILE *csv = NULL;
+
+// Every row is run by vm1_bench started again from this path with
+// -row, in a process of its own, so the peak resident set size of a
+// row isn't that of the rows before it
+const char *bench_path = NULL;
+const char *assembler = NULL;
+
+// Measuring
+
+// Returns the time from a monotonic clock in seconds.
+double now_seconds()
+{
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+
+    return (double)counter.QuadPart / frequency.QuadPart;
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + now.tv_nsec / 1e9;
+#endif
+}
+
+// Returns the peak resident set size in kilobytes of this process,
+// or of the child processes waited for so far when children is
+// nonzero. 0 when it isn't known.
+unsigned long peak_rss_kb(int children)
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+
+    if (children || !GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return 0;
+
+    return (unsigned long)(counters.PeakWorkingSetSize / 1024);
+#else
+    struct rusage usage;
+
+    if (getrusage(children ? RUSAGE_CHILDREN : RUSAGE_SELF, &usage) != 0)
+        return 0;
+
+    // Kilobytes on Linux
+    return (unsigned long)usage.ru_maxrss;
+#endif
+}
+
+int compare_times(const void *time1, const void *time2)
+{
+    double first = *(const double *)time1, second = *(const double *)time2;
+
+    return first < second ? -1 : first > second;
+}
+
+// Sorts the times and returns their statistics.
+bench_stats statistics(double *times, unsigned long count)
+{
+    bench_stats stats = {0};
+    double sum = 0.0, squares = 0.0;
+
+    qsort(times, count, sizeof(double), compare_times);
+
+    for (unsigned long i = 0; i < count; i++)
+        sum += times[i];
+
+    stats.mean = sum / count;
+    stats.min = times[0];
+    stats.median = count % 2 ? times[count / 2] : (times[count / 2 - 1] + times[count / 2]) / 2;
+
+    for (unsigned long i = 0; i < count; i++)
+        squares += (times[i] - stats.mean) * (times[i] - stats.mean);
+
+    stats.stddev = count > 1 ? sqrt(squares / (count - 1)) : 0.0;
+
+    return stats;
+}
+
+// Prints one result line, and writes it to the CSV file.
+void report(const char *benchmark, const char *engine, uint64_t work, const char *unit,
+            bench_stats stats, unsigned long rss)
+{
+    double per_second = stats.median > 0.0 ? work / stats.median : 0.0;
+
+    printf("  %-28s %-9s %12" PRIu64 " %-5s median %9.6f s  min %9.6f s  mean %9.6f s  stddev %9.6f s  %10.3f M %s/s  %8lu KB\n",
+           benchmark, engine, work, unit, stats.median, stats.min, stats.mean, stats.stddev,
+           per_second / 1e6, unit, rss);
+
+    if (csv != NULL)
+        fprintf(csv, "%s,%s,%lu,%" PRIu64 ",%s,%.6f,%.6f,%.6f,%.6f,%.0f,%lu\n",
+                benchmark, engine, repeat, work, unit, stats.median, stats.min, stats.mean, stats.stddev,
+                per_second, rss);
+}
+
+// Returns the file name without the directories.
+const char *base_name(const char *path)
+{
+    const char *slash = strrchr(path, '/'), *backslash = strrchr(path, '\\');
+
+    if (backslash != NULL && (slash == NULL || backslash > slash))
+        slash = backslash;
+
+    return slash != NULL ? slash + 1 : path;
+}
+
+// Reads the whole file. Returns NULL if it can't be read.
+unsigned char *read_file(const char *file_name, unsigned long *length)
+{
+    FILE *file = fopen(file_name, "rb");
+
+    if (file == NULL)
+        return NULL;
+
+    fseek(file, 0x0, SEEK_END);
+    *length = ftell(file);
+    fseek(file, 0x0, SEEK_SET);
+
+    unsigned char *content = malloc(*length + 1);
+
+    if (content != NULL && *length > 0 && fread(content, *length, 1, file) != 1)
+    {
+        free(content);
+        content = NULL;
+    }
+
+    fclose(file);
+    return content;
+}
+
+// Writes length bytes of content to the file. Returns 0 if it
+// can't be written.
+int write_file(const char *file_name, const unsigned char *content, unsigned long length)
+{
+    FILE *file = fopen(file_name, "wb");
+
+    if (file == NULL)
+        return FALSE;
+
+    int failed = length > 0 && fwrite(content, length, 1, file) != 1;
+
+    return fclose(file) == 0 && !failed;
+}
+
+// Virtual machine
+
+// Output is thrown away, so the benchmark measures formatting and
+// buffering instead of the terminal.
+void discard_output(void *data, const char *text, unsigned long length)
+{
+    (void)text;
+
+    *(unsigned long *)data += length;
+}
+
+// Prints the error of a row that couldn't be run.
+void report_failure(const char *benchmark, const char *engine, const char *error)
+{
+    printf("  %-28s %-9s %s\n", benchmark, engine, error);
+}
+
+// Runs the program repeat times with the engine, loading it again
+// before every run.
+void bench_engine_row(vm1_state *vm, const char *file_name, const bench_engine *engine, uint64_t instructions, double *times)
+{
+    if (vm1_set_dispatch(vm, engine->dispatch) != VM1_OK || vm1_set_jit(vm, engine->use_jit) != VM1_OK)
+    {
+        printf("  %-28s %-9s not supported by this build\n", base_name(file_name), engine->name);
+        return;
+    }
+
+    vm1_set_budget(vm, engine->counting ? ULONG_MAX : 0, 0);
+
+    // Loading again every time, since programs can write over
+    // their memory. Only running is timed.
+    unsigned long r;
+
+    for (r = 0; r < repeat; r++)
+    {
+        if (vm1_load_file(vm, file_name) != VM1_OK)
+            break;
+
+        double start = now_seconds();
+        int status = vm1_run(vm);
+        times[r] = now_seconds() - start;
+
+        if (status != VM1_OK)
+            break;
+    }
+
+    if (r < repeat)
+    {
+        report_failure(base_name(file_name), engine->name, vm1_get_error(vm));
+        return;
+    }
+
+    report(base_name(file_name), engine->name, instructions, "ins", statistics(times, repeat), peak_rss_kb(FALSE));
+}
+
+// Forks of the loaded program run as lanes of each other, so the
+// work is that many times the instructions.
+void bench_lanes_row(vm1_state *vm, const char *file_name, uint64_t instructions, double *times)
+{
+    vm1_state *lanes[LANE_FORKS];
+    const char *error = NULL;
+
+    for (unsigned long r = 0; r < repeat && error == NULL; r++)
+    {
+        int forks = 0;
+
+        if (vm1_load_file(vm, file_name) != VM1_OK)
+            error = vm1_get_error(vm);
+
+        while (error == NULL && forks < LANE_FORKS && (lanes[forks] = vm1_fork(vm)) != NULL)
+            forks++;
+
+        if (error == NULL && forks < LANE_FORKS)
+            error = "Couldn't fork the program";
+
+        if (error == NULL)
+        {
+            double start = now_seconds();
+            int status = vm1_run_lanes(lanes, LANE_FORKS, NULL);
+            times[r] = now_seconds() - start;
+
+            // Every lane runs the same program
+            if (status != VM1_OK)
+                error = vm1_get_error(lanes[0]);
+        }
+
+        // Before the lanes with the error are gone
+        if (error != NULL)
+            report_failure(base_name(file_name), "lanes", error);
+
+        for (int lane = 0; lane < forks; lane++)
+            vm1_destroy(lanes[lane]);
+    }
+
+    if (error == NULL)
+        report(base_name(file_name), "lanes", instructions * LANE_FORKS, "ins", statistics(times, repeat), peak_rss_kb(FALSE));
+}
+
+// Loads the program on its own, from the file like vm1 does it.
+void bench_load_row(vm1_state *vm, const char *file_name, double *times)
+{
+    unsigned long memory_len = 0;
+
+    for (unsigned long r = 0; r < repeat; r++)
+    {
+        double start = now_seconds();
+        int status = vm1_load_file(vm, file_name);
+        times[r] = now_seconds() - start;
+
+        if (status != VM1_OK)
+        {
+            report_failure(base_name(file_name), "load", vm1_get_error(vm));
+            return;
+        }
+    }
+
+    vm1_get_memory(vm, &memory_len);
+    report(base_name(file_name), "load", memory_len, "bytes", statistics(times, repeat), peak_rss_kb(FALSE));
+}
+
+// Runs a single row of the program, one of program_rows. This is
+// what vm1_bench does when it's started with -row.
+void bench_program_row(const char *file_name, const char *row, uint64_t instructions)
+{
+    unsigned long output_len = 0;
+    vm1_state *vm = vm1_create();
+    double *times = malloc(sizeof(double) * repeat);
+
+    if (vm == NULL || times == NULL)
+    {
+        printf("%s ERROR! Out of memory\n", PROJECT_NAME);
+        exit(EXIT_FAILURE);
+    }
+
+    vm1_set_output(vm, discard_output, &output_len);
+
+    for (unsigned long e = 0; e < ENGINE_COUNT; e++)
+        if (str_equals((char *)row, (char *)engines[e].name))
+            bench_engine_row(vm, file_name, &engines[e], instructions, times);
+
+    if (str_equals((char *)row, "lanes"))
+        bench_lanes_row(vm, file_name, instructions, times);
+    else if (str_equals((char *)row, "load"))
+        bench_load_row(vm, file_name, times);
+
+    vm1_destroy(vm);
+    free(times);
+}
+
+// Starts vm1_bench again to run a single row of the benchmark of
+// the file. work is the instruction count of a program.
+void run_row(const char *file_name, const char *benchmark, const char *row, uint64_t work)
+{
+    char command[4096], options[2048] = "";
+    unsigned long length = 0;
+
+    if (csv_name != NULL)
+        length += snprintf(options + length, sizeof(options) - length, " -csv \"%s\"", csv_name);
+
+    if (assembler != NULL && length < sizeof(options))
+        snprintf(options + length, sizeof(options) - length, " -asm \"%s\"", assembler);
+
+    snprintf(command, sizeof(command), "\"%s\" -repeat %lu%s -row %s -work %" PRIu64 " \"%s\"",
+             bench_path, repeat, options, row, work, file_name);
+
+    // Rows of the new process come after the ones so far
+    fflush(stdout);
+
+    if (csv != NULL)
+        fflush(csv);
+
+    if (system(command) != 0)
+        printf("  %-28s %-9s failed\n", benchmark, row);
+}
+
+// Runs the program once with profiling to count its instructions,
+// then every row of it.
+void bench_program(const char *file_name)
+{
+    unsigned long output_len = 0;
+    vm1_state *vm = vm1_create();
+
+    if (vm == NULL)
+    {
+        printf("%s ERROR! Out of memory\n", PROJECT_NAME);
+        exit(EXIT_FAILURE);
+    }
+
+    vm1_set_output(vm, discard_output, &output_len);
+    vm1_set_profile(vm, TRUE);
+
+    if (vm1_load_file(vm, file_name) != VM1_OK || vm1_run(vm) != VM1_OK)
+    {
+        printf("  %-28s %s\n", base_name(file_name), vm1_get_error(vm));
+        vm1_destroy(vm);
+        return;
+    }
+
+    uint64_t instructions = vm1_get_instruction_count(vm);
+
+    vm1_destroy(vm);
+
+    for (unsigned long row = 0; row < PROGRAM_ROW_COUNT; row++)
+        run_row(file_name, base_name(file_name), program_rows[row], instructions);
+}
+
+// Assembler
+
+// Writes a program of about lines instructions for the assembler,
+// with long and short keywords, comments, location pointers every
+// few lines and calls to them before and after. It's never run, so
+// it doesn't have to make sense. Returns 0 if it can't be written.
+int generate_program(const char *file_name, unsigned long lines)
+{
+    static const char *const registers[] = {"rg1", "rg2", "rg3", "register4"};
+    static const char *const alu[] = {"add", "sub", "MULTIPLY", "div", "rem", "is_less_than", "ieq", "imq"};
+    FILE *file = fopen(file_name, "w");
+
+    if (file == NULL)
+        return FALSE;
+
+    // Same program on every run
+    unsigned long seed = 1, bytes = 0, labels = 0, called_labels = 0;
+
+    fprintf(file, "# Generated by vm1_bench\n\n");
+
+    for (unsigned long line = 0; line < lines; line++)
+    {
+        seed = seed * 1103515245 + 12345;
+        unsigned long random = (seed >> 16) & 0x7FFF;
+
+        if (line % 8 == 0)
+        {
+            fprintf(file, "\n>location_%lu\n", labels++);
+
+            if (bytes < GENERATED_CALLED_BYTES)
+                called_labels = labels;
+        }
+
+        switch (random % 6)
+        {
+        case 0:
+            fprintf(file, "    set_register_value %s double_int:%lu # value\n", registers[random % 4], random);
+            bytes += 4;
+            break;
+        case 1:
+            fprintf(file, "    srv %s dx:%04lx\n", registers[random % 4], random);
+            bytes += 4;
+            break;
+        case 2:
+        case 3:
+            fprintf(file, "    %s %s %s\n", alu[random % 8], registers[random % 4], registers[(random >> 2) % 4]);
+            bytes += 3;
+            break;
+        case 4:
+            // Calls to earlier and later location pointers, and past
+            // the first 64K only to earlier ones that are still in it
+            if (bytes < GENERATED_CALLED_BYTES)
+                fprintf(file, "    positive_branch lth\n    :location_%lu\n", (random % (labels + 4)));
+            else
+                fprintf(file, "    positive_branch lth\n    :location_%lu\n", (random % called_labels));
+            bytes += 4;
+            break;
+        case 5:
+            fprintf(file, "    out %s si:2\n", registers[random % 4]);
+            bytes += 3;
+            break;
+        }
+    }
+
+    // Every call needs its location pointer
+    for (unsigned long i = labels; i < labels + 4; i++)
+        fprintf(file, ">location_%lu\n", i);
+
+    fprintf(file, "\nend\n");
+
+    int failed = ferror(file);
+
+    return fclose(file) == 0 && !failed;
+}
+
+// Runs the assembler on a copy of the file repeat times. Wall time
+// includes starting the process, so small files mostly measure that.
+void bench_assembler(const char *file_name, const char *benchmark)
+{
+    unsigned long input_len = 0;
+    unsigned char *input = read_file(file_name, &input_len);
+    double *times = malloc(sizeof(double) * repeat);
+
+    if (input == NULL || times == NULL)
+    {
+        printf("  %-28s couldn't read the file\n", benchmark);
+        free(input);
+        free(times);
+        return;
+    }
+
+    int copied = write_file(ASSEMBLED_FILE_NAME, input, input_len);
+
+    free(input);
+
+    if (!copied)
+    {
+        printf("  %-28s couldn't write %s\n", benchmark, ASSEMBLED_FILE_NAME);
+        remove(ASSEMBLED_FILE_NAME);
+        free(times);
+        return;
+    }
+
+    // The assembler waits for a key at the end
+    char command[4096];
+    snprintf(command, sizeof(command), "\"%s\" \"%s\" < %s > %s", assembler, ASSEMBLED_FILE_NAME, NULL_DEVICE, NULL_DEVICE);
+
+    unsigned long r;
+
+    for (r = 0; r < repeat; r++)
+    {
+        double start = now_seconds();
+        int status = system(command);
+        times[r] = now_seconds() - start;
+
+        if (status != 0)
+        {
+            printf("  %-28s %-9s failed\n", benchmark, "vm1_asm");
+            break;
+        }
+    }
+
+    if (r == repeat)
+        report(benchmark, "vm1_asm", input_len, "bytes", statistics(times, repeat), peak_rss_kb(TRUE));
+
+    remove(ASSEMBLED_FILE_NAME);
+    remove(ASSEMBLED_FILE_NAME ".vbc");
+    free(times);
+}
+
+// Program
+int main(int argc, const char *argv[])
+{
+    const char *row = NULL;
+    uint64_t work = 0;
+    unsigned long generated_lines = DEFAULT_GENERATED_LINES;
+
+    const char **files = malloc(sizeof(char *) * argc);
+    int files_len = 0;
+
+    if (files == NULL)
+        return EXIT_FAILURE;
+
+    // Options are given before the files
+    for (int i = 1; i < argc; i++)
+    {
+        if (str_equals((char *)argv[i], "-repeat") && i + 1 < argc)
+            repeat = strtoul(argv[++i], NULL, 10);
+        else if (str_equals((char *)argv[i], "-csv") && i + 1 < argc)
+            csv_name = argv[++i];
+        else if (str_equals((char *)argv[i], "-asm") && i + 1 < argc)
+            assembler = argv[++i];
+        else if (str_equals((char *)argv[i], "-lines") && i + 1 < argc)
+            generated_lines = strtoul(argv[++i], NULL, 10);
+        else if (str_equals((char *)argv[i], "-row") && i + 1 < argc)
+            row = argv[++i];
+        else if (str_equals((char *)argv[i], "-work") && i + 1 < argc)
+            work = strtoull(argv[++i], NULL, 10);
+        else
+            files[files_len++] = argv[i];
+    }
+
+    if (repeat == 0)
+        repeat = 1;
+
+    bench_path = argv[0];
+
+    // Rows add to the file of the process that started them
+    if (csv_name != NULL)
+    {
+        csv = fopen(csv_name, row != NULL ? "a" : "w");
+
+        if (csv == NULL)
+        {
+            printf("%s ERROR! Couldn't write %s\n", PROJECT_NAME, csv_name);
+            return EXIT_FAILURE;
+        }
+
+        if (row == NULL)
+            fprintf(csv, CSV_HEADER);
+    }
+
+    if (row != NULL && files_len == 1)
+    {
+        if (str_equals((char *)row, "vm1_asm"))
+            bench_assembler(files[0], str_equals((char *)files[0], GENERATED_FILE_NAME) ? "generated" : base_name(files[0]));
+        else
+            bench_program_row(files[0], row, work);
+
+        if (csv != NULL)
+            fclose(csv);
+
+        free(files);
+        return 0;
+    }
+
+    printf("%s %s bench, %lu runs each\n\n", PROJECT_NAME, VM_VERSION, repeat);
+
+    // Programs are run, sources are assembled
+    for (int i = 0; i < files_len; i++)
+    {
+        unsigned long length = strlen(files[i]);
+
+        if (length > 4 && str_equals((char *)files[i] + length - 4, ".vbc"))
+            bench_program(files[i]);
+        else if (assembler != NULL)
+            run_row(files[i], base_name(files[i]), "vm1_asm", 0);
+        else
+            printf("  %-28s needs -asm to be assembled\n", base_name(files[i]));
+    }
+
+    if (assembler != NULL && generated_lines > 0)
+    {
+        if (generate_program(GENERATED_FILE_NAME, generated_lines))
+            run_row(GENERATED_FILE_NAME, "generated", "vm1_asm", 0);
+        else
+            printf("  %-28s couldn't write %s\n", "generated", GENERATED_FILE_NAME);
+
+        remove(GENERATED_FILE_NAME);
+    }
+
+    if (csv != NULL)
+        fclose(csv);
+
+    free(files);
+    return 0;
+}
@@ -33,7 +33,7 @@ char *str_new(char *str)
 {
     int str_len = str_length(str);
 
-    char *new = (char*) malloc(sizeof(char) * str_len);
+    char *new = (char*) malloc(sizeof(char) * (str_len + 1));
 
     for(int i = 0; i < str_len; i++)
         new[i] = str[i];
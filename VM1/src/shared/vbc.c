@@ -0,0 +1,120 @@
+#include <string.h> // memcmp()
+
+#include "vbc.h"
+
+uint16_t vbc_get16(const unsigned char *from)
+{
+    return from[0] | from[1] << 8;
+}
+
+uint32_t vbc_get32(const unsigned char *from)
+{
+    return from[0] | from[1] << 8 | (uint32_t)from[2] << 16 | (uint32_t)from[3] << 24;
+}
+
+void vbc_put16(unsigned char *to, uint16_t value)
+{
+    to[0] = value;
+    to[1] = value >> 8;
+}
+
+void vbc_put32(unsigned char *to, uint32_t value)
+{
+    to[0] = value;
+    to[1] = value >> 8;
+    to[2] = value >> 16;
+    to[3] = value >> 24;
+}
+
+// CRC-32 of zip and PNG, four bits at a time. The table is constant,
+// so there's nothing to set up before threads can use it.
+uint32_t vbc_crc32(const unsigned char *data, unsigned long length)
+{
+    static const uint32_t table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+
+    uint32_t crc = 0xFFFFFFFF;
+
+    for (unsigned long i = 0; i < length; i++)
+    {
+        crc = table[(crc ^ data[i]) & 0xF] ^ crc >> 4;
+        crc = table[(crc ^ data[i] >> 4) & 0xF] ^ crc >> 4;
+    }
+
+    return crc ^ 0xFFFFFFFF;
+}
+
+int vbc_is_container(const unsigned char *file, unsigned long length)
+{
+    return length >= VBC_MAGIC_LEN && memcmp(file, VBC_MAGIC, VBC_MAGIC_LEN) == 0;
+}
+
+// Length of the section in the file, header included.
+unsigned long vbc_section_size(uint32_t type, uint32_t length)
+{
+    return VBC_SECTION_HEADER_LEN + (type == VBC_BSS ? 0 : (unsigned long)length);
+}
+
+const char *vbc_check(const unsigned char *file, unsigned long length, vbc_header *header)
+{
+    if (!vbc_is_container(file, length) || length < VBC_HEADER_LEN)
+        return "Not a program file";
+
+    header->version = vbc_get16(file + 4);
+    header->memory_len = vbc_get32(file + 8);
+    header->entry = vbc_get32(file + 12);
+    header->checksum = vbc_get32(file + 16);
+
+    unsigned long header_len = vbc_get16(file + 6);
+
+    if (header->version != VBC_VERSION)
+        return "Unsupported program file version";
+
+    if (header_len < VBC_HEADER_LEN || header_len > length)
+        return "Broken program file header";
+
+    if (vbc_crc32(file + header_len, length - header_len) != header->checksum)
+        return "Program file checksum doesn't match";
+
+    if (header->entry >= header->memory_len && header->memory_len > 0)
+        return "Entry point is past the end of memory";
+
+    for (unsigned long offset = header_len; offset < length;)
+    {
+        if (length - offset < VBC_SECTION_HEADER_LEN)
+            return "Section header runs past the end of the file";
+
+        uint32_t type = vbc_get32(file + offset);
+        uint32_t loc = vbc_get32(file + offset + 4);
+        uint32_t section_len = vbc_get32(file + offset + 8);
+
+        if (vbc_section_size(type, section_len) > length - offset)
+            return "Section runs past the end of the file";
+
+        if ((type == VBC_CODE || type == VBC_DATA || type == VBC_BSS) &&
+            (loc > header->memory_len || section_len > header->memory_len - loc))
+            return "Section runs past the end of memory";
+
+        offset += vbc_section_size(type, section_len);
+    }
+
+    return NULL;
+}
+
+int vbc_next_section(const unsigned char *file, unsigned long length, unsigned long *offset, vbc_section *section)
+{
+    if (*offset == 0)
+        *offset = vbc_get16(file + 6);
+
+    if (*offset >= length)
+        return 0;
+
+    section->type = vbc_get32(file + *offset);
+    section->loc = vbc_get32(file + *offset + 4);
+    section->length = vbc_get32(file + *offset + 8);
+    section->content = section->type == VBC_BSS ? NULL : file + *offset + VBC_SECTION_HEADER_LEN;
+
+    *offset += vbc_section_size(section->type, section->length);
+    return 1;
+}
@@ -0,0 +1,82 @@
+#ifndef VBC_H
+#define VBC_H
+
+#include <stdint.h> // uint16_t, uint32_t
+
+// Program files written by the assembler, and read by vm1.
+// Numbers are little endian.
+//
+//   Header, VBC_HEADER_LEN bytes
+//     0   magic, VBC_MAGIC
+//     4   16bit version, VBC_VERSION
+//     6   16bit header length
+//     8   32bit memory length
+//     12  32bit entry point
+//     16  32bit CRC-32 of everything after the header
+//
+//   Sections until the end of the file
+//     0   32bit type
+//     4   32bit memory location
+//     8   32bit length
+//     12  content, length bytes, none for VBC_BSS
+//
+// Files that don't start with the magic are programs as is, like
+// the assembler wrote them before the container.
+
+#define VBC_MAGIC "VBC\x1A"
+#define VBC_MAGIC_LEN 4
+#define VBC_VERSION 1
+
+#define VBC_HEADER_LEN 20
+#define VBC_SECTION_HEADER_LEN 12
+
+// Sections that fill a page of memory start as far from the start of
+// a page in the file as in memory, so vm1 can map the page
+#define VBC_PAGE_SIZE 4096
+
+// Section types. Unknown types are skipped.
+enum
+{
+    VBC_CODE = 1, // Bytes that are executed, copied to memory
+    VBC_DATA,     // Bytes that aren't, copied to memory
+    VBC_BSS,      // Memory that starts as zero, no content
+    VBC_MAP,      // Source map, see vm1_map.h
+    VBC_PAD       // Zeros before a section that has to be aligned
+};
+
+typedef struct
+{
+    uint16_t version;
+    uint32_t memory_len;
+    uint32_t entry;
+    uint32_t checksum;
+} vbc_header;
+
+typedef struct
+{
+    uint32_t type;
+    uint32_t loc;
+    uint32_t length;
+    const unsigned char *content; // NULL for VBC_BSS
+} vbc_section;
+
+uint16_t vbc_get16(const unsigned char *from);
+uint32_t vbc_get32(const unsigned char *from);
+void vbc_put16(unsigned char *to, uint16_t value);
+void vbc_put32(unsigned char *to, uint32_t value);
+
+uint32_t vbc_crc32(const unsigned char *data, unsigned long length);
+
+// Returns 1 if the file starts with the container magic.
+int vbc_is_container(const unsigned char *file, unsigned long length);
+
+// Reads the header and checks the version, the checksum and that
+// every section fits in the file and the memory. Returns what's
+// wrong with the file, or NULL when nothing is.
+const char *vbc_check(const unsigned char *file, unsigned long length, vbc_header *header);
+
+// Reads the section in offset of a checked file, and moves offset
+// to the next one. Start from 0. Returns 0 after the last section.
+int vbc_next_section(const unsigned char *file, unsigned long length, unsigned long *offset, vbc_section *section);
+
+#endif
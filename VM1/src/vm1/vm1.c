@@ -1,478 +1,2253 @@
+// Needed for clock_gettime()
+#define _POSIX_C_SOURCE 199309L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
-#include <math.h>
+#include <string.h>
+#include <setjmp.h>
+
+#ifdef _WIN32
+#include <windows.h> // QueryPerformanceCounter()
+#include <io.h>      // _write()
+#else
+#include <time.h>   // clock_gettime()
+#include <unistd.h> // write()
+#endif
 
 #include "..\shared\shared_macros.h"
+#include "..\shared\vbc.h"
 
-// Utility
+#include "vm1_internal.h"
+#include "vm1_jit.h"
+#include "vm1_profile.h"
+#include "vm1_map.h"
+#include "vm1_image.h"
+#include "vm1_aot.h"
+#include "vm1_snapshot.h"
+#include "vm1_lanes.h"
 
-void print_binary_16bit(uint16_t decimalNum)
+// Errors
+
+// Adds text to the error messages. Messages that don't fit are cut.
+static void error_append(vm1_state *vm, const char *text)
 {
-    for (int32_t i = 15; i >= 0; i--)
-        printf("%d", (decimalNum >> i) & 1);
+    while (*text != '\0' && vm->error_len + 1 < VM1_ERROR_LEN)
+        vm->error[vm->error_len++] = *text++;
+
+    vm->error[vm->error_len] = '\0';
 }
 
-void error(char *message)
+void vm1_error(vm1_state *vm, char *message)
 {
-    printf("%s ERROR! %s", PROJECT_NAME, message);
-    getchar();
-    exit(EXIT_FAILURE);
+    error_append(vm, message);
+    longjmp(vm->error_jump, 1);
 }
 
-// Virtual machine
+// Adds the source line of the instruction in loc, when a source
+// map is loaded.
+static void error_append_source(vm1_state *vm, unsigned long loc)
+{
+    char text[256];
 
-// Program counter
-long index = 0;
+    if (vm1_map_describe(vm->map, loc, text, sizeof(text)) == 0)
+        return;
 
-// Memory
-unsigned char *memory;
-unsigned long memory_len;
+    error_append(vm, " (");
+    error_append(vm, text);
+    error_append(vm, ")");
+}
 
-// Registers
-enum
+// Like vm1_error(), for a problem with the instruction in loc.
+void vm1_error_at(vm1_state *vm, unsigned long loc, char *message)
 {
-    R_GENERAL1,
-    R_GENERAL2,
-    R_GENERAL3,
-    R_GENERAL4,
-    R_COUNT
-};
+    char text[16];
 
-uint16_t registers[R_COUNT];
+    snprintf(text, sizeof(text), "0x%04lX: ", loc);
+    error_append(vm, text);
+    error_append(vm, message);
+    error_append_source(vm, loc);
+    longjmp(vm->error_jump, 1);
+}
 
-// Used for checking wether the register exists or not.
-void reg_access(uint16_t reg)
+static void error_clear(vm1_state *vm)
 {
-    if (reg >= R_COUNT)
-        error("Non existing register");
+    vm->error_len = 0;
+    vm->error[0] = '\0';
 }
 
-// Instruction set
-enum
-{
-    I_END,
-    I_JUMP,
-    I_POSITIVE_BRANCH,
-    I_NEGATIVE_BRANCH,
-    I_ADDITION,
-    I_SUBTRACTION,
-    I_MULTIPLICATION,
-    I_DIVISION,
-    I_REMAINDER,
-    I_SET_REG_VAL,
-    I_SET_REG_REG,
-    I_SET_REG_MEM,
-    I_SET_MEM_REG,
-    I_IS_EQUAL,
-    I_IS_LESS_THAN,
-    I_IS_MORE_THAN,
-    I_IS_LESS_OR_EQUAL_TO,
-    I_IS_MORE_OR_EQUAL_TO,
-    I_OUT
-};
+// Time
 
-// Flags
-enum
+// Instructions between clock readings of a time slice, power of two
+#define TIME_CHECK_INTERVAL 1024
+
+// Returns the time from a monotonic clock in microseconds.
+static uint64_t now_microseconds()
 {
-    F_ZERO,
-    F_POSITIVE,
-    F_NEGATIVE,
-    F_EQUAL,
-    F_LESS_THAN,
-    F_MORE_THAN,
-    F_LESS_OR_EQUAL_TO,
-    F_MORE_OR_EQUAL_TO,
-    F_COUNT
-};
+#ifdef _WIN32
+    LARGE_INTEGER counter, frequency;
+
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart * 1000000 +
+                      counter.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart);
+#else
+    struct timespec now;
 
-unsigned char flags[F_COUNT];
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#endif
+}
+
+// Flags
 
 // Sets every flag to zero.
-void reset_flags()
+static void reset_flags(vm1_state *vm)
 {
-    for (char i = 0; i < F_COUNT; i++)
-        flags[i] = 0;
+    vm->flag_op = F_COUNT;
 }
 
 // Returns flag in given index.
-// Returns error if flag doesn't exist.
-unsigned char get_flag(unsigned char flag)
+// Flag operands are checked by the verifier, so flag always exists.
+unsigned char vm1_flag_get(vm1_state *vm, unsigned char flag)
 {
-    if (flag < F_COUNT)
-        return flags[flag];
-    else
-        error("Non existing flag");
+    // F_NEGATIVE is never set from a result. Registers are
+    // unsigned, so every value that isn't zero is positive.
+    if (vm->flag_op == FLAGS_FROM_RESULT)
+        return flag == F_ZERO ? vm->flag_result == 0 : flag == F_POSITIVE && vm->flag_result > 0;
+
+    return flag == vm->flag_op && vm->flag_result != 0;
 }
 
-// Returns the value from the memory where program counter
-// points to, and increments the program counter.
-// Returns 8bit value.
-unsigned char get_value_8bit()
+// Sets flag, and clears every other flag.
+void vm1_flag_set(vm1_state *vm, unsigned char flag)
 {
-    if (index < memory_len)
-        return memory[index++];
-    else
-        error("End of memory");
+    vm->flag_op = flag;
+    vm->flag_result = 1;
 }
 
-// Returns the value from two sequential memory locations.
-// Returns 16 bit value.
-uint16_t get_value_16bit()
+static void update_flags(vm1_state *vm, uint16_t reg)
 {
-    uint16_t value = get_value_8bit();
-    value += get_value_8bit() << 8;
-
-    return value;
+    vm->flag_op = FLAGS_FROM_RESULT;
+    vm->flag_result = vm->registers[reg];
 }
 
-uint16_t update_flags(uint16_t reg)
+// Pre-decoding
+
+// Length of every instruction in bytes, op code included.
+// Zero for unsupported op codes.
+static const unsigned char op_length[256] = {
+    [I_END] = 1,
+    [I_JUMP] = 3,
+    [I_POSITIVE_BRANCH] = 4,
+    [I_NEGATIVE_BRANCH] = 4,
+
+    [I_ADDITION] = 3,
+    [I_SUBTRACTION] = 3,
+    [I_MULTIPLICATION] = 3,
+    [I_DIVISION] = 3,
+    [I_REMAINDER] = 3,
+
+    [I_SET_REG_VAL] = 4,
+    [I_SET_REG_REG] = 3,
+    [I_SET_REG_MEM] = 3,
+    [I_SET_MEM_REG] = 4,
+
+    [I_IS_EQUAL] = 3,
+    [I_IS_LESS_THAN] = 3,
+    [I_IS_MORE_THAN] = 3,
+    [I_IS_LESS_OR_EQUAL_TO] = 3,
+    [I_IS_MORE_OR_EQUAL_TO] = 3,
+
+    [I_OUT] = 3,
+
+    [I_LOAD_DOUBLE] = 5,
+    [I_STORE_DOUBLE] = 5,
+    [I_LOAD_QUAD] = 5,
+    [I_STORE_QUAD] = 5};
+
+// Allocates memory that starts at the beginning of a cache line.
+// Pointer to the actual allocation is stored right before it.
+static void *malloc_aligned(size_t size)
 {
-    reset_flags();
+    void *block = malloc(size + CACHE_LINE + sizeof(void *));
 
-    if (registers[reg] > 0)
-        flags[F_POSITIVE] = 1;
-    else if (registers[reg] == 0)
-        flags[F_ZERO] = 1;
-    else if (registers[reg] >> 15 == 1)
-        flags[F_NEGATIVE] = 1;
-}
+    if (block == NULL)
+        return NULL;
 
-// Op code functions
+    uintptr_t aligned = ((uintptr_t)block + sizeof(void *) + CACHE_LINE - 1) & ~(uintptr_t)(CACHE_LINE - 1);
+    ((void **)aligned)[-1] = block;
 
-void i_jump() { index = get_value_16bit(); }
+    return (void *)aligned;
+}
 
-void i_positive_branch()
+static void free_aligned(void *ptr)
 {
-    char flag = get_value_8bit();
-    uint16_t loc = get_value_16bit();
-
-    if (get_flag(flag) == 1)
-        index = loc;
+    if (ptr != NULL)
+        free(((void **)ptr)[-1]);
 }
 
-void i_negative_branch()
+// Returns 16bit value from two sequential memory locations.
+static uint16_t read_16bit(vm1_state *vm, unsigned long loc)
 {
-    char flag = get_value_8bit();
-    uint16_t loc = get_value_16bit();
+    return vm->memory[loc] + (vm->memory[loc + 1] << 8);
+}
 
-    if (get_flag(flag) == 0)
-        index = loc;
+// Used for checking wether the memory location exists or not.
+// ins is the instruction making the access.
+static void mem_access(vm1_state *vm, instruction *ins, unsigned long loc)
+{
+    if (loc >= vm->memory_len)
+        vm1_error_at(vm, ins->loc, "Memory access out of bounds");
 }
 
-void i_addition()
+// Returns 1 if the instruction in loc is supported and fits in
+// the memory.
+static int is_complete(vm1_state *vm, unsigned long loc)
 {
-    char reg1 = get_value_8bit(), reg2 = get_value_8bit();
-    reg_access(reg1);
-    reg_access(reg2);
+    unsigned char op = vm->memory[loc];
 
-    registers[reg1] += registers[reg2];
-    update_flags(reg1);
+    return op_length[op] != 0 && loc + op_length[op] <= vm->memory_len;
 }
 
-void i_subtraction()
+// Returns the memory location where execution continues after
+// the instruction in loc, when it doesn't jump anywhere.
+// Returns loc if it never continues to the next instruction.
+static unsigned long fall_through(vm1_state *vm, unsigned long loc)
 {
-    char reg1 = get_value_8bit(), reg2 = get_value_8bit();
-    reg_access(reg1);
-    reg_access(reg2);
+    unsigned char op = vm->memory[loc];
 
-    registers[reg1] -= registers[reg2];
-    update_flags(reg1);
+    if (!is_complete(vm, loc) || op == I_END || op == I_JUMP)
+        return loc;
+
+    return loc + op_length[op];
 }
 
-void i_multiplication()
+// Returns the memory location a jump or a branch in loc goes to.
+// Returns loc for every other instruction.
+static unsigned long jump_target(vm1_state *vm, unsigned long loc)
 {
-    char reg1 = get_value_8bit(), reg2 = get_value_8bit();
-    reg_access(reg1);
-    reg_access(reg2);
+    if (!is_complete(vm, loc))
+        return loc;
+
+    switch (vm->memory[loc])
+    {
+    case I_JUMP:
+        return read_16bit(vm, loc + 1);
+    case I_POSITIVE_BRANCH:
+    case I_NEGATIVE_BRANCH:
+        return read_16bit(vm, loc + 2);
+    }
 
-    registers[reg1] *= registers[reg2];
-    update_flags(reg1);
+    return loc;
 }
 
-void i_division()
-{
-    char reg1 = get_value_8bit(), reg2 = get_value_8bit();
-    reg_access(reg1);
-    reg_access(reg2);
+// Verification
+
+// Marks an instruction with problems in the starts of verify(),
+// which are otherwise 1
+#define TRAP_START 2
 
-    registers[reg1] /= registers[reg2];
-    update_flags(reg1);
+// Adds a problem found from the instruction in loc. The message
+// can contain one %lX or %lu for value.
+static void verify_error(vm1_state *vm, unsigned long loc, char *message, unsigned long value)
+{
+    char text[128];
+
+    snprintf(text, sizeof(text), "0x%04lX: ", loc);
+    error_append(vm, text);
+    snprintf(text, sizeof(text), message, value);
+    error_append(vm, text);
+    error_append_source(vm, loc);
+    error_append(vm, "\n");
 }
 
-void i_remainder()
+static int verify_register(vm1_state *vm, unsigned long loc, unsigned char reg)
 {
-    char reg1 = get_value_8bit(), reg2 = get_value_8bit();
-    reg_access(reg1);
-    reg_access(reg2);
+    if (reg < R_COUNT)
+        return 0;
 
-    registers[reg1] %= registers[reg2];
-    update_flags(reg1);
+    verify_error(vm, loc, "Non existing register %lu", reg);
+    return 1;
 }
 
-void i_set_reg_val()
+// Checks the instruction in loc: the op code is supported,
+// registers and flags exist, memory locations and jump targets are
+// inside the memory, and it doesn't start inside the instruction in
+// covered_from, which reaches until covered_until.
+// Returns the number of problems found.
+static unsigned long verify_instruction(vm1_state *vm, unsigned long loc, unsigned long covered_from, unsigned long covered_until)
 {
-    char reg = get_value_8bit();
-    uint16_t val = get_value_16bit();
+    unsigned long problems = 0;
+    unsigned char op = vm->memory[loc];
 
-    reg_access(reg);
-    registers[reg] = val;
+    if (loc < covered_until)
+    {
+        verify_error(vm, loc, "Instruction starts inside the instruction at 0x%04lX", covered_from);
+        problems++;
+    }
 
-    update_flags(reg);
-}
+    if (op_length[op] == 0)
+    {
+        verify_error(vm, loc, "Unsupported operation 0x%02lX", op);
+        return problems + 1;
+    }
 
-void i_set_reg_reg()
-{
-    char reg1 = get_value_8bit(), reg2 = get_value_8bit();
-    reg_access(reg1);
-    reg_access(reg2);
+    if (!is_complete(vm, loc))
+    {
+        verify_error(vm, loc, "Instruction runs past the end of memory", 0);
+        return problems + 1;
+    }
 
-    registers[reg1] = registers[reg2];
+    switch (op)
+    {
+    case I_END:
+    case I_JUMP:
+        break;
 
-    update_flags(reg1);
-}
+    case I_POSITIVE_BRANCH:
+    case I_NEGATIVE_BRANCH:
+        if (vm->memory[loc + 1] >= F_COUNT)
+        {
+            verify_error(vm, loc, "Non existing flag %lu", vm->memory[loc + 1]);
+            problems++;
+        }
+        break;
 
-void i_set_reg_mem()
-{
-    char
-        reg = get_value_8bit(),
-        mem = get_value_8bit();
+    case I_SET_REG_VAL:
+        problems += verify_register(vm, loc, vm->memory[loc + 1]);
+        break;
 
-    reg_access(reg);
-    reg_access(mem);
+    case I_SET_MEM_REG:
+        if (read_16bit(vm, loc + 1) >= vm->memory_len)
+        {
+            verify_error(vm, loc, "Memory location 0x%04lX is past the end of memory", read_16bit(vm, loc + 1));
+            problems++;
+        }
+        problems += verify_register(vm, loc, vm->memory[loc + 3]);
+        break;
 
-    registers[reg] = (uint16_t)memory[registers[mem]];
+    case I_OUT:
+        problems += verify_register(vm, loc, vm->memory[loc + 1]);
+        break;
 
-    update_flags(reg);
-}
+    case I_LOAD_QUAD:
+    case I_STORE_QUAD:
+        // 32bit values take the register after the first one too
+        if (vm->memory[loc + 1] == R_COUNT - 1)
+        {
+            verify_error(vm, loc, "Register %lu is the last one and can't hold a 32bit value", vm->memory[loc + 1]);
+            problems++;
+        }
+        problems += verify_register(vm, loc, vm->memory[loc + 1]);
+        problems += verify_register(vm, loc, vm->memory[loc + 2]);
+        break;
+
+    default:
+        problems += verify_register(vm, loc, vm->memory[loc + 1]);
+        problems += verify_register(vm, loc, vm->memory[loc + 2]);
+        break;
+    }
 
-void i_set_mem_reg()
-{
-    uint16_t mem = get_value_16bit();
-    char reg = get_value_8bit();
+    if (jump_target(vm, loc) != loc && jump_target(vm, loc) >= vm->memory_len)
+    {
+        verify_error(vm, loc, "Jump target 0x%04lX is past the end of memory", jump_target(vm, loc));
+        problems++;
+    }
 
-    reg_access(reg);
-    memory[mem] = registers[reg];
+    if (fall_through(vm, loc) == vm->memory_len)
+    {
+        verify_error(vm, loc, "Execution runs past the end of memory", 0);
+        problems++;
+    }
 
-    update_flags(reg);
+    return problems;
 }
 
-void i_is_equal()
+// Makes the instruction in loc the one that reaches furthest, if it
+// reaches further than covered_until.
+static void cover(vm1_state *vm, unsigned long loc, unsigned long *covered_from, unsigned long *covered_until)
 {
-    char reg1 = get_value_8bit(), reg2 = get_value_8bit();
-    reg_access(reg1);
-    reg_access(reg2);
-
-    reset_flags();
-    if (registers[reg1] == registers[reg2])
-        flags[F_EQUAL] = 1;
+    if (is_complete(vm, loc) && loc + op_length[vm->memory[loc]] > *covered_until)
+    {
+        *covered_from = loc;
+        *covered_until = loc + op_length[vm->memory[loc]];
+    }
 }
 
-void i_is_less_than()
+// Checks every instruction that starts in a location marked in
+// starts with verify_instruction(), and that no instruction starts
+// in the middle of another one. With traps set the problems aren't
+// reported, and the location of every instruction with problems is
+// marked with TRAP_START in starts instead.
+// Returns the number of problems found.
+static unsigned long verify(vm1_state *vm, unsigned char *starts, int traps)
 {
-    char reg1 = get_value_8bit(), reg2 = get_value_8bit();
-    reg_access(reg1);
-    reg_access(reg2);
+    unsigned long problems = 0;
+
+    // Memory area of the instruction that reaches furthest so far
+    unsigned long covered_from = 0, covered_until = 0;
+
+    for (unsigned long loc = 0; loc < vm->memory_len; loc++)
+    {
+        if (!starts[loc])
+            continue;
 
-    reset_flags();
-    if (registers[reg1] < registers[reg2])
-        flags[F_LESS_THAN] = 1;
+        unsigned long error_len = vm->error_len;
+        unsigned long found = verify_instruction(vm, loc, covered_from, covered_until);
+
+        if (found > 0 && traps)
+        {
+            starts[loc] = TRAP_START;
+
+            vm->error_len = error_len;
+            vm->error[error_len] = '\0';
+        }
+
+        problems += found;
+        cover(vm, loc, &covered_from, &covered_until);
+    }
+
+    return problems;
 }
 
-void i_is_more_than()
+// Runs an instruction that was marked with TRAP_START, and stops
+// with its problems, found again the same way verify() found them.
+static void trap(vm1_state *vm, instruction *ins)
 {
-    char reg1 = get_value_8bit(), reg2 = get_value_8bit();
-    reg_access(reg1);
-    reg_access(reg2);
+    unsigned long covered_from = 0, covered_until = 0;
+
+    for (unsigned long loc = 0; loc < ins->loc; loc++)
+        if (vm->instruction_at[loc] != NO_INSTRUCTION)
+            cover(vm, loc, &covered_from, &covered_until);
 
-    reset_flags();
-    if (registers[reg1] > registers[reg2])
-        flags[F_MORE_THAN] = 1;
+    verify_instruction(vm, ins->loc, covered_from, covered_until);
+    vm1_error(vm, "Changed code failed verification");
 }
 
-void i_is_less_or_equal_to()
+// Superinstructions
+
+// Replaces instruction pairs that often follow each other with
+// superinstructions. Pairs are only fused when the second
+// instruction directly follows the first one in memory.
+static void fuse(vm1_state *vm)
 {
-    char reg1 = get_value_8bit(), reg2 = get_value_8bit();
-    reg_access(reg1);
-    reg_access(reg2);
+    for (uint32_t i = 0; i + 1 < vm->instruction_count; i++)
+    {
+        instruction *first = &vm->instructions[i], *second = &vm->instructions[i + 1];
+
+        if (second->loc != first->loc + first->length)
+            continue;
+
+        switch (first->op)
+        {
+        case I_IS_EQUAL:
+        case I_IS_LESS_THAN:
+        case I_IS_MORE_THAN:
+        case I_IS_LESS_OR_EQUAL_TO:
+        case I_IS_MORE_OR_EQUAL_TO:
+            // Compare and flag enums are in the same order
+            if ((second->op == I_POSITIVE_BRANCH || second->op == I_NEGATIVE_BRANCH) &&
+                second->reg1 == F_EQUAL + (first->op - I_IS_EQUAL))
+            {
+                first->op = S_IS_EQUAL_BRANCH + (first->op - I_IS_EQUAL);
+                first->value = second->op == I_POSITIVE_BRANCH;
+                first->target = second->target;
+            }
+            break;
+
+        case I_SET_REG_VAL:
+            if ((second->op == I_ADDITION || second->op == I_SUBTRACTION) &&
+                second->reg2 == first->reg1)
+            {
+                first->op = second->op == I_ADDITION ? S_ADD_VAL : S_SUB_VAL;
+                first->reg2 = second->reg1;
+            }
+            else if (second->op == I_OUT && second->reg1 == first->reg1)
+            {
+                first->op = S_OUT_VAL;
+                first->reg2 = second->reg2;
+            }
+            break;
+        }
+    }
+}
 
-    reset_flags();
-    if (registers[reg1] <= registers[reg2])
-        flags[F_LESS_OR_EQUAL_TO] = 1;
+// Adds add to the reference count in refs, which other threads can
+// change at the same time, and returns the new count.
+static long refs_add(long *refs, long add)
+{
+#ifdef _WIN32
+    return InterlockedExchangeAdd(refs, add) + add;
+#else
+    return __atomic_add_fetch(refs, add, __ATOMIC_ACQ_REL);
+#endif
 }
 
-void i_is_more_or_equal_to()
+// Frees the decoded program, or leaves it to the forks that still
+// share it.
+static void free_decoded(vm1_state *vm)
 {
-    char reg1 = get_value_8bit(), reg2 = get_value_8bit();
-    reg_access(reg1);
-    reg_access(reg2);
+    if (vm->decoded_refs == NULL || refs_add(vm->decoded_refs, -1) == 0)
+    {
+        free_aligned(vm->instructions);
+        free(vm->instruction_at);
+        free(vm->code_map);
+        free(vm->decoded_refs);
+    }
 
-    reset_flags();
-    if (registers[reg1] >= registers[reg2])
-        flags[F_MORE_OR_EQUAL_TO] = 1;
+    vm->instructions = NULL;
+    vm->instruction_at = NULL;
+    vm->code_map = NULL;
+    vm->decoded_refs = NULL;
 }
 
-void i_out()
+// Pre-decoding
+
+// Decodes every instruction that can be reached from entry. Data
+// is never decoded, so it can be freely mixed with code. The code
+// is verified before decoding, and a program that fails the
+// verification is never run. Replaces the previously decoded
+// program, and returns the instruction index of entry.
+//
+// changed is set when the program wrote over its own code. SMR
+// changes a single byte, so code is often only half way through a
+// change, and instructions that fail the verification are decoded
+// as P_TRAP instead. They only stop the program when they are run.
+static uint32_t predecode(vm1_state *vm, unsigned long entry, int changed)
 {
-    char reg1 = get_value_8bit(), format_i = get_value_8bit();
-    reg_access(reg1);
+    free_decoded(vm);
 
-    char *format = NULL;
-    uint16_t output;
+    vm->instruction_count = 0;
 
-    switch (format_i)
+    vm->instruction_at = malloc(sizeof(uint32_t) * (vm->memory_len + 1));
+    vm->code_map = calloc(vm->memory_len + 1, sizeof(char));
+
+    // Finding where the instructions start by following every
+    // jump, branch and fall through from entry.
+    unsigned char *starts = calloc(vm->memory_len + 1, sizeof(char));
+    unsigned long *pending = malloc(sizeof(unsigned long) * (vm->memory_len + 1));
+    unsigned long pending_len = 0;
+
+    if (vm->instruction_at == NULL || vm->code_map == NULL || starts == NULL || pending == NULL)
     {
-    case 0:
-        print_binary_16bit(registers[reg1]);
-        break; // binary
-    case 1:
-        format = "%x";
-        output = registers[reg1];
-        break; // hex
-    case 2:
-        format = "%d";
-        output = registers[reg1];
-        break; // integer
-    case 3:
-        format = "%c";
-        output = registers[reg1];
-        break; // ascii
+        free(starts);
+        free(pending);
+        vm1_error(vm, "Out of memory");
     }
 
-    if (format != NULL)
-        printf(format, output);
-}
+    if (entry >= vm->memory_len)
+    {
+        free(starts);
+        free(pending);
+        verify_error(vm, entry, "Execution runs past the end of memory", 0);
+        vm1_error(vm, "Program failed verification");
+    }
 
-// Main loop
-void compute()
-{
-    // initializing flags
-    reset_flags();
+    starts[entry] = 1;
+    pending[pending_len++] = entry;
 
-    uint16_t run = 1;
+    while (pending_len > 0)
+    {
+        unsigned long loc = pending[--pending_len];
+        unsigned long next[2] = {fall_through(vm, loc), jump_target(vm, loc)};
 
-    while (run)
+        for (int i = 0; i < 2; i++)
+        {
+            if (next[i] != loc && next[i] < vm->memory_len && !starts[next[i]])
+            {
+                starts[next[i]] = 1;
+                pending[pending_len++] = next[i];
+            }
+        }
+    }
+
+    free(pending);
+
+    if (verify(vm, starts, changed) > 0 && !changed)
+    {
+        free(starts);
+        vm1_error(vm, "Program failed verification");
+    }
+
+    // Giving every instruction its index
+    uint32_t count = 0;
+
+    for (unsigned long loc = 0; loc < vm->memory_len; loc++)
+        vm->instruction_at[loc] = starts[loc] ? count++ : NO_INSTRUCTION;
+
+    vm->instructions = malloc_aligned(sizeof(instruction) * count);
+    vm->instruction_count = count;
+
+    if (vm->instructions == NULL)
+    {
+        free(starts);
+        vm1_error(vm, "Out of memory");
+    }
+
+    instruction *ins = vm->instructions;
+
+    for (unsigned long loc = 0; loc < vm->memory_len; loc++)
     {
-        int16_t op_code = get_value_8bit();
+        if (!starts[loc])
+            continue;
+
+        unsigned char op = vm->memory[loc];
 
-        switch (op_code)
+        ins->op = op;
+        ins->code = op;
+        ins->reg1 = 0;
+        ins->reg2 = 0;
+        ins->length = op_length[op];
+        ins->value = 0;
+        ins->loc = loc;
+        ins->target = NO_INSTRUCTION;
+
+        if (starts[loc] == TRAP_START)
+        {
+            // Covers the bytes of the instruction that are in memory,
+            // so changing any of them decodes it again
+            ins->op = P_TRAP;
+            ins->code = P_TRAP;
+            ins->length = is_complete(vm, loc) ? op_length[op] : 1;
+            op = P_TRAP;
+        }
+
+        switch (op)
         {
-        case I_END:
-            run = 0;
-            break;
         case I_JUMP:
-            i_jump();
-            break;
         case I_POSITIVE_BRANCH:
-            i_positive_branch();
-            break;
         case I_NEGATIVE_BRANCH:
-            i_negative_branch();
-            break;
-
-        case I_ADDITION:
-            i_addition();
-            break;
-        case I_SUBTRACTION:
-            i_subtraction();
-            break;
-        case I_MULTIPLICATION:
-            i_multiplication();
-            break;
-        case I_DIVISION:
-            i_division();
-            break;
-        case I_REMAINDER:
-            i_remainder();
+            if (op != I_JUMP)
+                ins->reg1 = vm->memory[loc + 1];
+            ins->target = vm->instruction_at[jump_target(vm, loc)];
             break;
 
         case I_SET_REG_VAL:
-            i_set_reg_val();
-            break;
-        case I_SET_REG_REG:
-            i_set_reg_reg();
-            break;
-        case I_SET_REG_MEM:
-            i_set_reg_mem();
+            ins->reg1 = vm->memory[loc + 1];
+            ins->value = read_16bit(vm, loc + 2);
             break;
+
         case I_SET_MEM_REG:
-            i_set_mem_reg();
+            ins->value = read_16bit(vm, loc + 1);
+            ins->reg1 = vm->memory[loc + 3];
             break;
 
-        case I_IS_EQUAL:
-            i_is_equal();
-            break;
-        case I_IS_LESS_THAN:
-            i_is_less_than();
-            break;
-        case I_IS_MORE_THAN:
-            i_is_more_than();
-            break;
-        case I_IS_LESS_OR_EQUAL_TO:
-            i_is_less_or_equal_to();
-            break;
-        case I_IS_MORE_OR_EQUAL_TO:
-            i_is_more_or_equal_to();
+        case I_LOAD_DOUBLE:
+        case I_STORE_DOUBLE:
+        case I_LOAD_QUAD:
+        case I_STORE_QUAD:
+            ins->reg1 = vm->memory[loc + 1];
+            ins->reg2 = vm->memory[loc + 2];
+            ins->value = read_16bit(vm, loc + 3);
             break;
 
-        case I_OUT:
-            i_out();
+        case I_END:
+        case P_TRAP:
             break;
 
         default:
-            error("Unsupported operation");
+            ins->reg1 = vm->memory[loc + 1];
+            ins->reg2 = vm->memory[loc + 2];
             break;
         }
+
+        for (unsigned long i = loc; i < loc + ins->length; i++)
+            vm->code_map[i] = 1;
+
+        ins++;
     }
+
+    free(starts);
+
+    fuse(vm);
+
+    return vm->instruction_at[entry];
+}
+
+// Op code functions
+
+static void i_jump(vm1_state *vm, instruction *ins) { vm->index = ins->target; }
+
+static void i_positive_branch(vm1_state *vm, instruction *ins)
+{
+    if (vm1_flag_get(vm, ins->reg1) == 1)
+        vm->index = ins->target;
 }
 
-// Program
-int main(int argc, const char *argv[])
+static void i_negative_branch(vm1_state *vm, instruction *ins)
 {
-    // No input file given, exit
-    if (argc < 2)
-        return 0;
+    if (vm1_flag_get(vm, ins->reg1) == 0)
+        vm->index = ins->target;
+}
+
+static void i_addition(vm1_state *vm, instruction *ins)
+{
+    unsigned char reg1 = ins->reg1, reg2 = ins->reg2;
+
+    vm->registers[reg1] += vm->registers[reg2];
+    update_flags(vm, reg1);
+}
+
+static void i_subtraction(vm1_state *vm, instruction *ins)
+{
+    unsigned char reg1 = ins->reg1, reg2 = ins->reg2;
+
+    vm->registers[reg1] -= vm->registers[reg2];
+    update_flags(vm, reg1);
+}
+
+static void i_multiplication(vm1_state *vm, instruction *ins)
+{
+    unsigned char reg1 = ins->reg1, reg2 = ins->reg2;
+
+    vm->registers[reg1] *= vm->registers[reg2];
+    update_flags(vm, reg1);
+}
+
+static void i_division(vm1_state *vm, instruction *ins)
+{
+    unsigned char reg1 = ins->reg1, reg2 = ins->reg2;
+
+    if (vm->registers[reg2] == 0)
+        vm1_error_at(vm, ins->loc, "Division by zero");
+
+    vm->registers[reg1] /= vm->registers[reg2];
+    update_flags(vm, reg1);
+}
+
+static void i_remainder(vm1_state *vm, instruction *ins)
+{
+    unsigned char reg1 = ins->reg1, reg2 = ins->reg2;
+
+    if (vm->registers[reg2] == 0)
+        vm1_error_at(vm, ins->loc, "Division by zero");
+
+    vm->registers[reg1] %= vm->registers[reg2];
+    update_flags(vm, reg1);
+}
+
+static void i_set_reg_val(vm1_state *vm, instruction *ins)
+{
+    unsigned char reg = ins->reg1;
+
+    vm->registers[reg] = ins->value;
 
-    printf("%s %s\nFile: %s\n", PROJECT_NAME, VM_VERSION, argv[1]);
+    update_flags(vm, reg);
+}
+
+static void i_set_reg_reg(vm1_state *vm, instruction *ins)
+{
+    unsigned char reg1 = ins->reg1, reg2 = ins->reg2;
+
+    vm->registers[reg1] = vm->registers[reg2];
+
+    update_flags(vm, reg1);
+}
+
+static void i_set_reg_mem(vm1_state *vm, instruction *ins)
+{
+    unsigned char
+        reg = ins->reg1,
+        mem = ins->reg2;
+
+    mem_access(vm, ins, vm->registers[mem]);
+
+    vm->registers[reg] = (uint16_t)vm->memory[vm->registers[mem]];
+
+    update_flags(vm, reg);
+}
+
+static void i_set_mem_reg(vm1_state *vm, instruction *ins)
+{
+    uint16_t mem = ins->value;
+    unsigned char reg = ins->reg1;
+
+    vm->memory[mem] = vm->registers[reg];
+
+    update_flags(vm, reg);
+
+    // Program wrote over its own code
+    if (vm->code_map[mem])
+        vm->index = predecode(vm, ins->loc + ins->length, TRUE);
+}
+
+static void i_is_equal(vm1_state *vm, instruction *ins)
+{
+    unsigned char reg1 = ins->reg1, reg2 = ins->reg2;
+
+    vm->flag_op = F_EQUAL;
+    vm->flag_result = vm->registers[reg1] == vm->registers[reg2];
+}
+
+static void i_is_less_than(vm1_state *vm, instruction *ins)
+{
+    unsigned char reg1 = ins->reg1, reg2 = ins->reg2;
+
+    vm->flag_op = F_LESS_THAN;
+    vm->flag_result = vm->registers[reg1] < vm->registers[reg2];
+}
+
+static void i_is_more_than(vm1_state *vm, instruction *ins)
+{
+    unsigned char reg1 = ins->reg1, reg2 = ins->reg2;
+
+    vm->flag_op = F_MORE_THAN;
+    vm->flag_result = vm->registers[reg1] > vm->registers[reg2];
+}
+
+static void i_is_less_or_equal_to(vm1_state *vm, instruction *ins)
+{
+    unsigned char reg1 = ins->reg1, reg2 = ins->reg2;
 
-    // Reading input file
-    FILE *file = fopen(argv[1], "rb");
+    vm->flag_op = F_LESS_OR_EQUAL_TO;
+    vm->flag_result = vm->registers[reg1] <= vm->registers[reg2];
+}
+
+static void i_is_more_or_equal_to(vm1_state *vm, instruction *ins)
+{
+    unsigned char reg1 = ins->reg1, reg2 = ins->reg2;
+
+    vm->flag_op = F_MORE_OR_EQUAL_TO;
+    vm->flag_result = vm->registers[reg1] >= vm->registers[reg2];
+}
+
+// Sends everything in the output buffer to the output.
+void vm1_output_flush(vm1_state *vm)
+{
+    if (vm->output_len > 0)
+        vm->output(vm->output_data, vm->output_buffer, vm->output_len);
+
+    vm->output_len = 0;
+}
+
+void vm1_out(vm1_state *vm, uint16_t value, unsigned char format)
+{
+    char *text = vm->output_buffer + vm->output_len;
+    int length = 0;
+
+    switch (format)
+    {
+    case 0: // binary
+        for (int i = 15; i >= 0; i--)
+            text[length++] = '0' + ((value >> i) & 1);
+        break;
+
+    case 1: // hex
+    case 2: // integer
+    {
+        // Digits are worked out from the last one
+        char digits[5];
+        int count = 0;
+
+        do
+        {
+            if (format == 1)
+            {
+                digits[count++] = "0123456789abcdef"[value & 0xF];
+                value >>= 4;
+            }
+            else
+            {
+                digits[count++] = '0' + value % 10;
+                value /= 10;
+            }
+        } while (value > 0);
+
+        while (count > 0)
+            text[length++] = digits[--count];
+        break;
+    }
+
+    case 3: // ascii
+        text[length++] = (char)value;
+        break;
+    }
 
-    // Counting file size and setting memory length accordingly
-    fseek(file, 0x0, SEEK_END);
-    memory_len = ftell(file);
-    fseek(file, 0x0, SEEK_SET);
+    vm->output_len += length;
 
-    memory = malloc(sizeof(char) * memory_len);
+    // Buffer always has room for one more output after this
+    if (vm->output_len >= vm->output_size)
+        vm1_output_flush(vm);
+}
 
-    fread(memory, sizeof(char) * memory_len, 1, file);
-    fclose(file);
+static void i_out(vm1_state *vm, instruction *ins) { vm1_out(vm, vm->registers[ins->reg1], ins->reg2); }
 
-    printf("Program size: %d bytes\n", memory_len);
+// Returns the memory location of a load or a store: the second
+// register plus the offset, in 16 bits like every other address.
+// Stops with an error when width bytes from there don't fit in the
+// memory.
+static uint16_t offset_access(vm1_state *vm, instruction *ins, unsigned long width)
+{
+    uint16_t mem = vm->registers[ins->reg2] + ins->value;
 
-    // Virtual machine at work
-    compute();
+    if (mem + width > vm->memory_len)
+        vm1_error_at(vm, ins->loc, "Memory access out of bounds");
 
-    // Showing values of registers and flags at exit
-    printf(
-        "\nRegisters [%d,%d,%d,%d] Flags [ZRO %d,POS %d,NEG %d,EQL %d,LTH %d,MTH %d,LQT %d,MQT %d]\n",
+    return mem;
+}
 
-        registers[R_GENERAL1],
-        registers[R_GENERAL2],
-        registers[R_GENERAL3],
-        registers[R_GENERAL4],
+// Sets the flags from the 32bit value in reg and the register after
+// it, like update_flags(). Zero only when both halves are.
+static void update_quad_flags(vm1_state *vm, unsigned char reg)
+{
+    vm->flag_op = FLAGS_FROM_RESULT;
+    vm->flag_result = vm->registers[reg] | vm->registers[reg + 1];
+}
 
-        flags[F_ZERO],
-        flags[F_POSITIVE],
-        flags[F_NEGATIVE],
+// Writes the value of reg to mem, and the register after it to mem
+// + 2 when quad is set. Values are little endian like addresses.
+static void store(vm1_state *vm, instruction *ins, uint16_t mem, int quad)
+{
+    unsigned char reg = ins->reg1;
+    unsigned long width = quad ? 4 : 2;
 
-        flags[F_EQUAL],
-        flags[F_LESS_THAN],
-        flags[F_MORE_THAN],
+    vm->memory[mem] = (unsigned char)vm->registers[reg];
+    vm->memory[mem + 1] = vm->registers[reg] >> 8;
 
-        flags[F_LESS_OR_EQUAL_TO],
-        flags[F_MORE_OR_EQUAL_TO]);
+    if (quad)
+    {
+        vm->memory[mem + 2] = (unsigned char)vm->registers[reg + 1];
+        vm->memory[mem + 3] = vm->registers[reg + 1] >> 8;
+        update_quad_flags(vm, reg);
+    }
+    else
+        update_flags(vm, reg);
 
-    getchar();
-    return 0;
+    // Program wrote over its own code
+    for (unsigned long i = 0; i < width; i++)
+    {
+        if (vm->code_map[mem + i])
+        {
+            vm->index = predecode(vm, ins->loc + ins->length, TRUE);
+            return;
+        }
+    }
+}
+
+static void i_load_double(vm1_state *vm, instruction *ins)
+{
+    uint16_t mem = offset_access(vm, ins, 2);
+
+    vm->registers[ins->reg1] = read_16bit(vm, mem);
+    update_flags(vm, ins->reg1);
+}
+
+static void i_store_double(vm1_state *vm, instruction *ins) { store(vm, ins, offset_access(vm, ins, 2), FALSE); }
+
+static void i_load_quad(vm1_state *vm, instruction *ins)
+{
+    uint16_t mem = offset_access(vm, ins, 4);
+
+    vm->registers[ins->reg1] = read_16bit(vm, mem);
+    vm->registers[ins->reg1 + 1] = read_16bit(vm, mem + 2);
+    update_quad_flags(vm, ins->reg1);
+}
+
+static void i_store_quad(vm1_state *vm, instruction *ins) { store(vm, ins, offset_access(vm, ins, 4), TRUE); }
+
+// Superinstruction functions. Program counter already points to
+// the second instruction, which is skipped.
+
+static void s_compare_branch(vm1_state *vm, instruction *ins, unsigned char flag, uint16_t result)
+{
+    vm->flag_op = flag;
+    vm->flag_result = result;
+
+    if (result == ins->value)
+        vm->index = ins->target;
+    else
+        vm->index++;
+}
+
+static void s_add_val(vm1_state *vm, instruction *ins)
+{
+    vm->registers[ins->reg1] = ins->value;
+    vm->registers[ins->reg2] += vm->registers[ins->reg1];
+    update_flags(vm, ins->reg2);
+    vm->index++;
+}
+
+static void s_sub_val(vm1_state *vm, instruction *ins)
+{
+    vm->registers[ins->reg1] = ins->value;
+    vm->registers[ins->reg2] -= vm->registers[ins->reg1];
+    update_flags(vm, ins->reg2);
+    vm->index++;
+}
+
+static void s_out_val(vm1_state *vm, instruction *ins)
+{
+    vm->registers[ins->reg1] = ins->value;
+    update_flags(vm, ins->reg1);
+    vm1_out(vm, ins->value, ins->reg2);
+    vm->index++;
+}
+
+// Dispatch engines
+
+// Computed goto (labels as values) is a GNU extension. Other
+// compilers only get the switch engine.
+#if defined(__GNUC__)
+#define HAS_THREADED_DISPATCH
+#endif
+
+// Switch engine, every instruction is handled by its own function.
+static void compute_switch(vm1_state *vm)
+{
+    uint16_t run = 1;
+
+    while (run)
+    {
+        instruction *ins = &vm->instructions[vm->index++];
+
+        switch (ins->op)
+        {
+        case I_END:
+            run = 0;
+            break;
+        case I_JUMP:
+            i_jump(vm, ins);
+            break;
+        case I_POSITIVE_BRANCH:
+            i_positive_branch(vm, ins);
+            break;
+        case I_NEGATIVE_BRANCH:
+            i_negative_branch(vm, ins);
+            break;
+
+        case I_ADDITION:
+            i_addition(vm, ins);
+            break;
+        case I_SUBTRACTION:
+            i_subtraction(vm, ins);
+            break;
+        case I_MULTIPLICATION:
+            i_multiplication(vm, ins);
+            break;
+        case I_DIVISION:
+            i_division(vm, ins);
+            break;
+        case I_REMAINDER:
+            i_remainder(vm, ins);
+            break;
+
+        case I_SET_REG_VAL:
+            i_set_reg_val(vm, ins);
+            break;
+        case I_SET_REG_REG:
+            i_set_reg_reg(vm, ins);
+            break;
+        case I_SET_REG_MEM:
+            i_set_reg_mem(vm, ins);
+            break;
+        case I_SET_MEM_REG:
+            i_set_mem_reg(vm, ins);
+            break;
+
+        case I_IS_EQUAL:
+            i_is_equal(vm, ins);
+            break;
+        case I_IS_LESS_THAN:
+            i_is_less_than(vm, ins);
+            break;
+        case I_IS_MORE_THAN:
+            i_is_more_than(vm, ins);
+            break;
+        case I_IS_LESS_OR_EQUAL_TO:
+            i_is_less_or_equal_to(vm, ins);
+            break;
+        case I_IS_MORE_OR_EQUAL_TO:
+            i_is_more_or_equal_to(vm, ins);
+            break;
+
+        case I_OUT:
+            i_out(vm, ins);
+            break;
+
+        case I_LOAD_DOUBLE:
+            i_load_double(vm, ins);
+            break;
+        case I_STORE_DOUBLE:
+            i_store_double(vm, ins);
+            break;
+        case I_LOAD_QUAD:
+            i_load_quad(vm, ins);
+            break;
+        case I_STORE_QUAD:
+            i_store_quad(vm, ins);
+            break;
+
+        case S_IS_EQUAL_BRANCH:
+            s_compare_branch(vm, ins, F_EQUAL, vm->registers[ins->reg1] == vm->registers[ins->reg2]);
+            break;
+        case S_IS_LESS_THAN_BRANCH:
+            s_compare_branch(vm, ins, F_LESS_THAN, vm->registers[ins->reg1] < vm->registers[ins->reg2]);
+            break;
+        case S_IS_MORE_THAN_BRANCH:
+            s_compare_branch(vm, ins, F_MORE_THAN, vm->registers[ins->reg1] > vm->registers[ins->reg2]);
+            break;
+        case S_IS_LESS_OR_EQUAL_TO_BRANCH:
+            s_compare_branch(vm, ins, F_LESS_OR_EQUAL_TO, vm->registers[ins->reg1] <= vm->registers[ins->reg2]);
+            break;
+        case S_IS_MORE_OR_EQUAL_TO_BRANCH:
+            s_compare_branch(vm, ins, F_MORE_OR_EQUAL_TO, vm->registers[ins->reg1] >= vm->registers[ins->reg2]);
+            break;
+
+        case S_ADD_VAL:
+            s_add_val(vm, ins);
+            break;
+        case S_SUB_VAL:
+            s_sub_val(vm, ins);
+            break;
+        case S_OUT_VAL:
+            s_out_val(vm, ins);
+            break;
+
+        case P_TRAP:
+            trap(vm, ins);
+            break;
+
+        default:
+            vm1_error_at(vm, ins->loc, "Unsupported operation");
+            break;
+        }
+    }
+}
+
+#ifdef HAS_THREADED_DISPATCH
+
+// Threaded engine, handler bodies live inside the loop and every
+// handler jumps straight to the next one through the jump table.
+static void compute_threaded(vm1_state *vm)
+{
+    static void *const jump_table[256] = {
+        [0 ... 255] = &&op_unsupported,
+
+        [I_END] = &&op_end,
+        [I_JUMP] = &&op_jump,
+        [I_POSITIVE_BRANCH] = &&op_positive_branch,
+        [I_NEGATIVE_BRANCH] = &&op_negative_branch,
+
+        [I_ADDITION] = &&op_addition,
+        [I_SUBTRACTION] = &&op_subtraction,
+        [I_MULTIPLICATION] = &&op_multiplication,
+        [I_DIVISION] = &&op_division,
+        [I_REMAINDER] = &&op_remainder,
+
+        [I_SET_REG_VAL] = &&op_set_reg_val,
+        [I_SET_REG_REG] = &&op_set_reg_reg,
+        [I_SET_REG_MEM] = &&op_set_reg_mem,
+        [I_SET_MEM_REG] = &&op_set_mem_reg,
+
+        [I_IS_EQUAL] = &&op_is_equal,
+        [I_IS_LESS_THAN] = &&op_is_less_than,
+        [I_IS_MORE_THAN] = &&op_is_more_than,
+        [I_IS_LESS_OR_EQUAL_TO] = &&op_is_less_or_equal_to,
+        [I_IS_MORE_OR_EQUAL_TO] = &&op_is_more_or_equal_to,
+
+        [I_OUT] = &&op_out,
+
+        [I_LOAD_DOUBLE] = &&op_load_double,
+        [I_STORE_DOUBLE] = &&op_store,
+        [I_LOAD_QUAD] = &&op_load_quad,
+        [I_STORE_QUAD] = &&op_store,
+
+        [S_IS_EQUAL_BRANCH] = &&op_is_equal_branch,
+        [S_IS_LESS_THAN_BRANCH] = &&op_is_less_than_branch,
+        [S_IS_MORE_THAN_BRANCH] = &&op_is_more_than_branch,
+        [S_IS_LESS_OR_EQUAL_TO_BRANCH] = &&op_is_less_or_equal_to_branch,
+        [S_IS_MORE_OR_EQUAL_TO_BRANCH] = &&op_is_more_or_equal_to_branch,
+
+        [S_ADD_VAL] = &&op_add_val,
+        [S_SUB_VAL] = &&op_sub_val,
+        [S_OUT_VAL] = &&op_out_val,
+
+        [P_TRAP] = &&op_trap};
+
+    instruction *ins = &vm->instructions[vm->index];
+    unsigned char reg1, reg2;
+
+#define DISPATCH() goto *jump_table[ins->op]
+
+#define NEXT()      \
+    do              \
+    {               \
+        ins++;      \
+        DISPATCH(); \
+    } while (0)
+
+#define JUMP()                            \
+    do                                    \
+    {                                     \
+        ins = &vm->instructions[ins->target]; \
+        DISPATCH();                       \
+    } while (0)
+
+#define REGISTER_OPERANDS() \
+    reg1 = ins->reg1;       \
+    reg2 = ins->reg2
+
+// Superinstructions skip their second instruction
+#define SKIP()      \
+    do              \
+    {               \
+        ins += 2;   \
+        DISPATCH(); \
+    } while (0)
+
+#define COMPARE_BRANCH(flag, condition)                      \
+    REGISTER_OPERANDS();                                     \
+    vm->flag_op = flag;                                          \
+    vm->flag_result = vm->registers[reg1] condition vm->registers[reg2]; \
+    if (vm->flag_result == ins->value)                           \
+        JUMP();                                              \
+    SKIP()
+
+#define COMPARE(flag, condition)                             \
+    REGISTER_OPERANDS();                                     \
+    vm->flag_op = flag;                                          \
+    vm->flag_result = vm->registers[reg1] condition vm->registers[reg2]; \
+    NEXT()
+
+    DISPATCH();
+
+op_end:
+    vm->index = ins - vm->instructions + 1;
+    return;
+
+op_jump:
+    JUMP();
+
+op_positive_branch:
+    if (vm1_flag_get(vm, ins->reg1) == 1)
+        JUMP();
+    NEXT();
+
+op_negative_branch:
+    if (vm1_flag_get(vm, ins->reg1) == 0)
+        JUMP();
+    NEXT();
+
+op_addition:
+    REGISTER_OPERANDS();
+    vm->registers[reg1] += vm->registers[reg2];
+    update_flags(vm, reg1);
+    NEXT();
+
+op_subtraction:
+    REGISTER_OPERANDS();
+    vm->registers[reg1] -= vm->registers[reg2];
+    update_flags(vm, reg1);
+    NEXT();
+
+op_multiplication:
+    REGISTER_OPERANDS();
+    vm->registers[reg1] *= vm->registers[reg2];
+    update_flags(vm, reg1);
+    NEXT();
+
+op_division:
+    REGISTER_OPERANDS();
+    if (vm->registers[reg2] == 0)
+        vm1_error_at(vm, ins->loc, "Division by zero");
+    vm->registers[reg1] /= vm->registers[reg2];
+    update_flags(vm, reg1);
+    NEXT();
+
+op_remainder:
+    REGISTER_OPERANDS();
+    if (vm->registers[reg2] == 0)
+        vm1_error_at(vm, ins->loc, "Division by zero");
+    vm->registers[reg1] %= vm->registers[reg2];
+    update_flags(vm, reg1);
+    NEXT();
+
+op_set_reg_val:
+    reg1 = ins->reg1;
+    vm->registers[reg1] = ins->value;
+    update_flags(vm, reg1);
+    NEXT();
+
+op_set_reg_reg:
+    REGISTER_OPERANDS();
+    vm->registers[reg1] = vm->registers[reg2];
+    update_flags(vm, reg1);
+    NEXT();
+
+op_set_reg_mem:
+    REGISTER_OPERANDS();
+    mem_access(vm, ins, vm->registers[reg2]);
+    vm->registers[reg1] = (uint16_t)vm->memory[vm->registers[reg2]];
+    update_flags(vm, reg1);
+    NEXT();
+
+op_set_mem_reg:
+    // Shares the handler with the switch engine, since writing
+    // over code replaces the whole decoded program.
+    vm->index = ins - vm->instructions + 1;
+    i_set_mem_reg(vm, ins);
+    ins = &vm->instructions[vm->index];
+    DISPATCH();
+
+op_is_equal:
+    COMPARE(F_EQUAL, ==);
+
+op_is_less_than:
+    COMPARE(F_LESS_THAN, <);
+
+op_is_more_than:
+    COMPARE(F_MORE_THAN, >);
+
+op_is_less_or_equal_to:
+    COMPARE(F_LESS_OR_EQUAL_TO, <=);
+
+op_is_more_or_equal_to:
+    COMPARE(F_MORE_OR_EQUAL_TO, >=);
+
+op_out:
+    i_out(vm, ins);
+    NEXT();
+
+op_load_double:
+    i_load_double(vm, ins);
+    NEXT();
+
+op_load_quad:
+    i_load_quad(vm, ins);
+    NEXT();
+
+op_store:
+    // Can write over code, like SMR
+    vm->index = ins - vm->instructions + 1;
+    store(vm, ins, offset_access(vm, ins, ins->op == I_STORE_QUAD ? 4 : 2), ins->op == I_STORE_QUAD);
+    ins = &vm->instructions[vm->index];
+    DISPATCH();
+
+op_is_equal_branch:
+    COMPARE_BRANCH(F_EQUAL, ==);
+
+op_is_less_than_branch:
+    COMPARE_BRANCH(F_LESS_THAN, <);
+
+op_is_more_than_branch:
+    COMPARE_BRANCH(F_MORE_THAN, >);
+
+op_is_less_or_equal_to_branch:
+    COMPARE_BRANCH(F_LESS_OR_EQUAL_TO, <=);
+
+op_is_more_or_equal_to_branch:
+    COMPARE_BRANCH(F_MORE_OR_EQUAL_TO, >=);
+
+op_add_val:
+    reg1 = ins->reg1;
+    reg2 = ins->reg2;
+    vm->registers[reg1] = ins->value;
+    vm->registers[reg2] += vm->registers[reg1];
+    update_flags(vm, reg2);
+    SKIP();
+
+op_sub_val:
+    reg1 = ins->reg1;
+    reg2 = ins->reg2;
+    vm->registers[reg1] = ins->value;
+    vm->registers[reg2] -= vm->registers[reg1];
+    update_flags(vm, reg2);
+    SKIP();
+
+op_out_val:
+    reg1 = ins->reg1;
+    vm->registers[reg1] = ins->value;
+    update_flags(vm, reg1);
+    vm1_out(vm, ins->value, ins->reg2);
+    SKIP();
+
+op_trap:
+    trap(vm, ins);
+
+op_unsupported:
+    vm1_error_at(vm, ins->loc, "Unsupported operation");
+
+#undef DISPATCH
+#undef NEXT
+#undef JUMP
+#undef SKIP
+#undef COMPARE_BRANCH
+#undef REGISTER_OPERANDS
+#undef COMPARE
+}
+
+#endif
+
+// Counting engine, used instead of the others when a run is
+// limited by an instruction budget or a time slice, profiled or
+// traced.
+// Dispatches on the op code in memory, so superinstructions run as
+// the two instructions they were made of, and the program can be
+// stopped after any instruction. Returns VM1_OK at END, and
+// VM1_YIELD when the budget or the time slice ran out.
+static int compute_counting(vm1_state *vm)
+{
+    unsigned long budget = vm->budget, executed = 0;
+    uint64_t deadline = vm->time_slice > 0 ? now_microseconds() + vm->time_slice : 0;
+
+    for (;;)
+    {
+        if (budget > 0 && executed == budget)
+            return VM1_YIELD;
+
+        // Reading the clock is slow compared to an instruction
+        if (deadline > 0 && (executed & (TIME_CHECK_INTERVAL - 1)) == TIME_CHECK_INTERVAL - 1 &&
+            now_microseconds() >= deadline)
+            return VM1_YIELD;
+
+        instruction *ins = &vm->instructions[vm->index++];
+        executed++;
+
+        // Has no op code to count or trace
+        if (ins->code == P_TRAP)
+            trap(vm, ins);
+
+        if (vm->profile != NULL)
+            vm1_profile_count(vm, ins);
+
+        if (vm->trace != NULL)
+            vm1_trace_instruction(vm, ins);
+
+        switch (ins->code)
+        {
+        case I_END:
+            return VM1_OK;
+        case I_JUMP:
+            i_jump(vm, ins);
+            break;
+        case I_POSITIVE_BRANCH:
+            i_positive_branch(vm, ins);
+            break;
+        case I_NEGATIVE_BRANCH:
+            i_negative_branch(vm, ins);
+            break;
+
+        case I_ADDITION:
+            i_addition(vm, ins);
+            break;
+        case I_SUBTRACTION:
+            i_subtraction(vm, ins);
+            break;
+        case I_MULTIPLICATION:
+            i_multiplication(vm, ins);
+            break;
+        case I_DIVISION:
+            i_division(vm, ins);
+            break;
+        case I_REMAINDER:
+            i_remainder(vm, ins);
+            break;
+
+        case I_SET_REG_VAL:
+            i_set_reg_val(vm, ins);
+            break;
+        case I_SET_REG_REG:
+            i_set_reg_reg(vm, ins);
+            break;
+        case I_SET_REG_MEM:
+            i_set_reg_mem(vm, ins);
+            break;
+        case I_SET_MEM_REG:
+            i_set_mem_reg(vm, ins);
+            break;
+
+        case I_IS_EQUAL:
+            i_is_equal(vm, ins);
+            break;
+        case I_IS_LESS_THAN:
+            i_is_less_than(vm, ins);
+            break;
+        case I_IS_MORE_THAN:
+            i_is_more_than(vm, ins);
+            break;
+        case I_IS_LESS_OR_EQUAL_TO:
+            i_is_less_or_equal_to(vm, ins);
+            break;
+        case I_IS_MORE_OR_EQUAL_TO:
+            i_is_more_or_equal_to(vm, ins);
+            break;
+
+        case I_OUT:
+            i_out(vm, ins);
+            break;
+
+        case I_LOAD_DOUBLE:
+            i_load_double(vm, ins);
+            break;
+        case I_STORE_DOUBLE:
+            i_store_double(vm, ins);
+            break;
+        case I_LOAD_QUAD:
+            i_load_quad(vm, ins);
+            break;
+        case I_STORE_QUAD:
+            i_store_quad(vm, ins);
+            break;
+
+        default:
+            vm1_error_at(vm, ins->loc, "Unsupported operation");
+            break;
+        }
+    }
+}
+
+// Main loop. Returns VM1_OK when the program reached END, and
+// VM1_YIELD when it was stopped early and can be resumed.
+static int compute(vm1_state *vm)
+{
+    // The JIT and the other engines never stop before END, and
+    // don't count anything
+    if (vm->budget > 0 || vm->time_slice > 0 || vm->profile != NULL || vm->trace != NULL)
+        return compute_counting(vm);
+
+#ifdef HAS_JIT
+    if (vm->use_jit && !vm1_jit_run(vm))
+        return VM1_OK;
+#endif
+
+#ifdef HAS_THREADED_DISPATCH
+    if (vm->dispatch == VM1_DISPATCH_THREADED)
+    {
+        compute_threaded(vm);
+        return VM1_OK;
+    }
+#endif
+
+    compute_switch(vm);
+    return VM1_OK;
+}
+
+// Forks
+
+// Forgets the memory the last forks were made from, once the memory
+// is about to change. Forks keep their mapped pages.
+static void drop_fork_base(vm1_state *vm)
+{
+    if (vm->has_fork_base)
+        vm1_image_close(&vm->fork_base);
+
+    vm->has_fork_base = FALSE;
+}
+
+// Library
+
+// Default output, stdout
+static void output_stdout(void *data, const char *text, unsigned long length)
+{
+    (void)data;
+
+    fwrite(text, 1, length, stdout);
+}
+
+// Output to a file descriptor, data points to it
+static void output_fd(void *data, const char *text, unsigned long length)
+{
+    int fd = *(int *)data;
+
+    while (length > 0)
+    {
+#ifdef _WIN32
+        int written = _write(fd, text, length);
+#else
+        long written = write(fd, text, length);
+#endif
+
+        if (written <= 0)
+            return;
+
+        text += written;
+        length -= written;
+    }
+}
+
+vm1_state *vm1_create()
+{
+    vm1_state *vm = calloc(1, sizeof(vm1_state));
+
+    if (vm == NULL)
+        return NULL;
+
+    vm->flag_op = F_COUNT;
+
+#ifdef HAS_THREADED_DISPATCH
+    vm->dispatch = VM1_DISPATCH_THREADED;
+#else
+    vm->dispatch = VM1_DISPATCH_SWITCH;
+#endif
+
+    // Nonzero when the program is compiled to machine code before
+    // running. Dispatch engine is used for what the JIT leaves over.
+    vm->use_jit = FALSE;
+
+    vm->output = output_stdout;
+    vm->output_data = NULL;
+
+    vm->output_size = VM1_OUTPUT_BUFFER;
+    vm->output_buffer = malloc(vm->output_size + OUT_MAX_LENGTH);
+
+    if (vm->output_buffer == NULL)
+    {
+        free(vm);
+        return NULL;
+    }
+
+    return vm;
+}
+
+void vm1_destroy(vm1_state *vm)
+{
+    if (vm == NULL)
+        return;
+
+    vm1_output_flush(vm);
+
+    vm1_profile_free(vm->profile);
+    vm1_map_free(vm->map);
+    free(vm->output_buffer);
+    drop_fork_base(vm);
+    vm1_image_free(vm->memory, vm->memory_size);
+    free_decoded(vm);
+    free(vm);
+}
+
+int vm1_set_dispatch(vm1_state *vm, int dispatch)
+{
+    switch (dispatch)
+    {
+    case VM1_DISPATCH_SWITCH:
+        break;
+#ifdef HAS_THREADED_DISPATCH
+    case VM1_DISPATCH_THREADED:
+        break;
+#endif
+    default:
+        return VM1_ERROR;
+    }
+
+    vm->dispatch = dispatch;
+    return VM1_OK;
+}
+
+int vm1_set_jit(vm1_state *vm, int enabled)
+{
+#ifdef HAS_JIT
+    vm->use_jit = enabled != 0;
+    return VM1_OK;
+#else
+    return enabled ? VM1_ERROR : VM1_OK;
+#endif
+}
+
+void vm1_set_budget(vm1_state *vm, unsigned long instructions, unsigned long microseconds)
+{
+    vm->budget = instructions;
+    vm->time_slice = microseconds;
+}
+
+int vm1_set_profile(vm1_state *vm, int enabled)
+{
+    vm->profiling = enabled != 0;
+
+    vm1_profile_free(vm->profile);
+    vm->profile = NULL;
+
+    // Otherwise created when the program is loaded
+    if (vm->profiling && vm->memory != NULL)
+    {
+        vm->profile = vm1_profile_create(vm->memory_len);
+
+        if (vm->profile == NULL)
+            return VM1_ERROR;
+    }
+
+    return VM1_OK;
+}
+
+void vm1_set_trace(vm1_state *vm, FILE *stream)
+{
+    vm->trace = stream;
+}
+
+int vm1_load_map(vm1_state *vm, const char *file_name)
+{
+    vm1_map_free(vm->map);
+    vm->map = NULL;
+    vm->map_embedded = FALSE;
+
+    if (file_name == NULL)
+        return VM1_OK;
+
+    vm->map = vm1_map_read(file_name);
+
+    return vm->map != NULL ? VM1_OK : VM1_ERROR;
+}
+
+void vm1_set_output(vm1_state *vm, vm1_output_function output, void *data)
+{
+    vm1_output_flush(vm);
+
+    vm->output = output != NULL ? output : output_stdout;
+    vm->output_data = data;
+}
+
+void vm1_set_output_fd(vm1_state *vm, int fd)
+{
+    vm1_output_flush(vm);
+
+    vm->output_fd = fd;
+    vm->output = output_fd;
+    vm->output_data = &vm->output_fd;
+}
+
+int vm1_set_output_buffer(vm1_state *vm, unsigned long size)
+{
+    vm1_output_flush(vm);
+
+    char *buffer = realloc(vm->output_buffer, size + OUT_MAX_LENGTH);
+
+    if (buffer == NULL)
+        return VM1_ERROR;
+
+    vm->output_buffer = buffer;
+    vm->output_size = size;
+
+    return VM1_OK;
+}
+
+void vm1_flush(vm1_state *vm)
+{
+    vm1_output_flush(vm);
+}
+
+// Loading
+
+// Frees the memory of the previous program, so a load that fails
+// leaves none.
+static void drop_memory(vm1_state *vm)
+{
+    drop_fork_base(vm);
+    vm1_image_free(vm->memory, vm->memory_size);
+
+    vm->memory = NULL;
+    vm->memory_len = 0;
+    vm->memory_size = 0;
+}
+
+// Replaces the memory with length bytes of zeros, and drops a
+// source map that came with the previous program.
+static void new_memory(vm1_state *vm, unsigned long length)
+{
+    drop_memory(vm);
+
+    vm->memory = vm1_image_alloc(length, &vm->memory_size);
+    vm->memory_len = length;
+
+    if (vm->memory == NULL)
+    {
+        vm->memory_len = 0;
+        vm1_error(vm, "Out of memory");
+    }
+
+    if (vm->map_embedded)
+    {
+        vm1_map_free(vm->map);
+        vm->map = NULL;
+        vm->map_embedded = FALSE;
+    }
+}
+
+// Clears registers and flags, verifies and decodes the program in
+// memory, and starts it from entry.
+static void start_program(vm1_state *vm, unsigned long entry)
+{
+    for (int reg = 0; reg < R_COUNT; reg++)
+        vm->registers[reg] = 0;
+
+    // initializing flags
+    reset_flags(vm);
+
+    if (vm->profiling)
+    {
+        vm1_profile_free(vm->profile);
+        vm->profile = vm1_profile_create(vm->memory_len);
+
+        if (vm->profile == NULL)
+            vm1_error(vm, "Out of memory");
+    }
+
+    vm->index = predecode(vm, entry, FALSE);
+    vm->ended = FALSE;
+}
+
+int vm1_load(vm1_state *vm, const unsigned char *program, unsigned long length)
+{
+    error_clear(vm);
+    vm->ended = TRUE;
+
+    if (setjmp(vm->error_jump))
+        return VM1_ERROR;
+
+    new_memory(vm, length);
+    memcpy(vm->memory, program, length);
+    vm->program_crc = vbc_crc32(program, length);
+    start_program(vm, 0);
+
+    return VM1_OK;
+}
+
+// Copies length bytes from offset in the program file to loc in
+// the memory, or maps them when the file is mapped.
+static void fill_memory(vm1_state *vm, const unsigned char *data, image_file *file,
+                 unsigned long offset, unsigned long loc, unsigned long length)
+{
+    if (file != NULL)
+        vm1_image_fill(vm->memory, vm->memory_size, file, offset, loc, length);
+    else
+        memcpy(vm->memory + loc, data + offset, length);
+}
+
+// Loads a program file from data, which is mapped from file unless
+// file is NULL.
+static int load_program(vm1_state *vm, const unsigned char *data, unsigned long length, image_file *file)
+{
+    error_clear(vm);
+    vm->ended = TRUE;
+
+    if (setjmp(vm->error_jump))
+        return VM1_ERROR;
+
+    drop_memory(vm);
+
+    if (!vbc_is_container(data, length))
+    {
+        new_memory(vm, length);
+        fill_memory(vm, data, file, 0, 0, length);
+        vm->program_crc = vbc_crc32(data, length);
+        start_program(vm, 0);
+
+        return VM1_OK;
+    }
+
+    vbc_header header;
+    const char *problem = vbc_check(data, length, &header);
+
+    if (problem != NULL)
+        vm1_error(vm, (char *)problem);
+
+    // Memory is allocated once, at the declared length, and BSS is
+    // left as the zeros it starts as
+    new_memory(vm, header.memory_len);
+
+    // Header has the checksum of everything after it
+    vm->program_crc = vbc_crc32(data, VBC_HEADER_LEN);
+
+    vbc_section section;
+
+    for (unsigned long offset = 0; vbc_next_section(data, length, &offset, &section);)
+    {
+        if (section.type == VBC_CODE || section.type == VBC_DATA)
+            fill_memory(vm, data, file, section.content - data, section.loc, section.length);
+
+        // A map loaded with vm1_load_map() comes first
+        if (section.type == VBC_MAP && vm->map == NULL)
+        {
+            vm->map = vm1_map_parse((const char *)section.content, section.length);
+            vm->map_embedded = vm->map != NULL;
+        }
+    }
+
+    start_program(vm, header.entry);
+
+    return VM1_OK;
+}
+
+int vm1_load_vbc(vm1_state *vm, const unsigned char *file, unsigned long length)
+{
+    return load_program(vm, file, length, NULL);
+}
+
+int vm1_load_file(vm1_state *vm, const char *file_name)
+{
+    image_file file;
+
+    if (!vm1_image_open(&file, file_name))
+    {
+        drop_memory(vm);
+        vm->ended = TRUE;
+        error_clear(vm);
+        error_append(vm, "Couldn't open the input file");
+        return VM1_ERROR;
+    }
+
+    int status = load_program(vm, file.data, file.length, &file);
+
+    // Mapped pages stay after the file is closed
+    vm1_image_close(&file);
+
+    return status;
+}
+
+int vm1_translate(vm1_state *vm, FILE *file)
+{
+    error_clear(vm);
+
+    if (setjmp(vm->error_jump))
+        return VM1_ERROR;
+
+    if (vm->instructions == NULL)
+        vm1_error(vm, "No program loaded");
+
+    if (vm->ended)
+        vm1_error(vm, "Program has already ended");
+
+    vm1_aot_write(vm, file);
+
+    if (ferror(file))
+        vm1_error(vm, "Couldn't write the C source");
+
+    return VM1_OK;
+}
+
+int vm1_save_snapshot(vm1_state *vm, const char *file_name)
+{
+    error_clear(vm);
+
+    if (setjmp(vm->error_jump))
+        return VM1_ERROR;
+
+    if (vm->instructions == NULL)
+        vm1_error(vm, "No program loaded");
+
+    if (vm->ended)
+        vm1_error(vm, "Program has already ended");
+
+    if (!vm1_snapshot_write(vm, file_name))
+        vm1_error(vm, "Couldn't write the snapshot");
+
+    return VM1_OK;
+}
+
+// Restores the state in a snapshot mapped from file over the
+// loaded program.
+static int restore_snapshot(vm1_state *vm, image_file *file)
+{
+    if (setjmp(vm->error_jump))
+    {
+        vm->ended = TRUE;
+        return VM1_ERROR;
+    }
+
+    if (vm->instructions == NULL)
+        vm1_error(vm, "No program loaded");
+
+    snapshot_header header;
+    const char *problem = vm1_snapshot_check(file->data, file->length, &header);
+
+    if (problem != NULL)
+        vm1_error(vm, (char *)problem);
+
+    if (header.program_crc != vm->program_crc || header.memory_len != vm->memory_len)
+        vm1_error(vm, "Snapshot was taken from another program");
+
+    // Memory is replaced as a whole, and its pages are mapped from
+    // the snapshot like the pages of a program file. The source map
+    // stays, since the program is the same.
+    unsigned long size;
+    unsigned char *memory = vm1_image_alloc(header.memory_len, &size);
+
+    if (memory == NULL)
+        vm1_error(vm, "Out of memory");
+
+    drop_fork_base(vm);
+    vm1_image_free(vm->memory, vm->memory_size);
+
+    vm->memory = memory;
+    vm->memory_size = size;
+    vm->ended = TRUE;
+
+    vm1_image_fill(vm->memory, vm->memory_size, file, header.memory_offset, 0, header.memory_len);
+
+    for (int reg = 0; reg < R_COUNT; reg++)
+        vm->registers[reg] = header.registers[reg];
+
+    vm->flag_op = header.flag_op;
+    vm->flag_result = header.flag_result;
+
+    // Output that was waiting in the buffer comes first
+    for (unsigned long sent = 0; sent < header.output_len;)
+    {
+        unsigned long length = header.output_len - sent;
+
+        if (length > OUT_MAX_LENGTH)
+            length = OUT_MAX_LENGTH;
+
+        memcpy(vm->output_buffer + vm->output_len, header.output + sent, length);
+        vm->output_len += length;
+        sent += length;
+
+        if (vm->output_len >= vm->output_size)
+            vm1_output_flush(vm);
+    }
+
+    if (vm->profiling)
+    {
+        vm1_profile_free(vm->profile);
+        vm->profile = vm1_profile_create(vm->memory_len);
+
+        if (vm->profile == NULL)
+            vm1_error(vm, "Out of memory");
+    }
+
+    // SMR may have changed the code since the program was loaded
+    vm->index = predecode(vm, header.loc, TRUE);
+    vm->ended = FALSE;
+
+    return VM1_OK;
+}
+
+int vm1_load_snapshot(vm1_state *vm, const char *file_name)
+{
+    image_file file;
+
+    error_clear(vm);
+
+    if (!vm1_image_open(&file, file_name))
+    {
+        error_append(vm, "Couldn't open the snapshot");
+        return VM1_ERROR;
+    }
+
+    int status = restore_snapshot(vm, &file);
+
+    // Mapped pages stay after the file is closed
+    vm1_image_close(&file);
+
+    return status;
+}
+
+vm1_state *vm1_fork(vm1_state *vm)
+{
+    error_clear(vm);
+
+    if (vm->instructions == NULL)
+    {
+        error_append(vm, "No program loaded");
+        return NULL;
+    }
+
+    vm1_output_flush(vm);
+
+    vm1_state *fork = vm1_create();
+
+    if (fork == NULL || vm1_set_output_buffer(fork, vm->output_size) != VM1_OK)
+    {
+        vm1_destroy(fork);
+        error_append(vm, "Out of memory");
+        return NULL;
+    }
+
+    fork->dispatch = vm->dispatch;
+    fork->use_jit = vm->use_jit;
+    fork->budget = vm->budget;
+    fork->time_slice = vm->time_slice;
+    fork->profiling = vm->profiling;
+
+    if (vm->output == output_fd)
+        vm1_set_output_fd(fork, vm->output_fd);
+    else
+        vm1_set_output(fork, vm->output, vm->output_data);
+
+    // Memory is written to a shared file once, and mapped back over
+    // this virtual machine and every fork copy-on-write. Until this
+    // one runs again, further forks map the same file.
+    if (vm->memory_size > 0 && !vm->has_fork_base &&
+        vm1_image_share(&vm->fork_base, vm->memory, vm->memory_len))
+    {
+        vm->has_fork_base = TRUE;
+        vm1_image_fill(vm->memory, vm->memory_size, &vm->fork_base, 0, 0, vm->memory_len);
+    }
+
+    fork->memory = vm1_image_alloc(vm->memory_len, &fork->memory_size);
+    fork->memory_len = vm->memory_len;
+
+    // Decoded program is shared as is, it never changes after
+    // decoding
+    if (vm->decoded_refs == NULL)
+    {
+        vm->decoded_refs = malloc(sizeof(long));
+
+        if (vm->decoded_refs != NULL)
+            *vm->decoded_refs = 1;
+    }
+
+    if (fork->memory == NULL || vm->decoded_refs == NULL ||
+        (vm->profiling && (fork->profile = vm1_profile_create(vm->memory_len)) == NULL))
+    {
+        vm1_destroy(fork);
+        error_append(vm, "Out of memory");
+        return NULL;
+    }
+
+    if (vm->has_fork_base)
+        vm1_image_fill(fork->memory, fork->memory_size, &vm->fork_base, 0, 0, vm->memory_len);
+    else
+        memcpy(fork->memory, vm->memory, vm->memory_len);
+
+    refs_add(vm->decoded_refs, 1);
+
+    fork->instructions = vm->instructions;
+    fork->instruction_count = vm->instruction_count;
+    fork->instruction_at = vm->instruction_at;
+    fork->code_map = vm->code_map;
+    fork->decoded_refs = vm->decoded_refs;
+
+    for (int reg = 0; reg < R_COUNT; reg++)
+        fork->registers[reg] = vm->registers[reg];
+
+    fork->flag_op = vm->flag_op;
+    fork->flag_result = vm->flag_result;
+    fork->program_crc = vm->program_crc;
+    fork->index = vm->index;
+    fork->ended = vm->ended;
+
+    return fork;
+}
+
+int vm1_run(vm1_state *vm)
+{
+    error_clear(vm);
+
+    if (setjmp(vm->error_jump))
+    {
+        vm1_output_flush(vm);
+        vm->ended = TRUE;
+        return VM1_ERROR;
+    }
+
+    if (vm->instructions == NULL)
+        vm1_error(vm, "No program loaded");
+
+    if (vm->ended)
+        vm1_error(vm, "Program has already ended");
+
+    // Forks made from here on see what this run writes
+    drop_fork_base(vm);
+
+    int status = compute(vm);
+
+    // Host gets everything the program has written so far, whether
+    // it reached END or ran out of budget
+    vm1_output_flush(vm);
+
+    if (status == VM1_OK)
+        vm->ended = TRUE;
+
+    return status;
+}
+
+#ifdef HAS_LANES
+// Returns 1 if vm1_run() would run the program with one of the
+// engines lanes stand in for, not the counting one.
+static int lanes_can_run(vm1_state *vm)
+{
+    return vm->instructions != NULL && !vm->ended && vm->budget == 0 && vm->time_slice == 0 &&
+           vm->profile == NULL && vm->trace == NULL;
+}
+#endif
+
+int vm1_run_lanes(vm1_state *const *vms, unsigned long count, int *status)
+{
+    // Nonzero for virtual machines that reached END in a lane
+    unsigned char *finished = calloc(count + 1, sizeof(char));
+    int failed = FALSE;
+
+#ifdef HAS_LANES
+    unsigned char *grouped = calloc(count + 1, sizeof(char));
+
+    // Lanes are filled with the first virtual machines that have the
+    // same program, and what's left over runs on its own below
+    for (unsigned long first = 0; first < count && finished != NULL && grouped != NULL; first++)
+    {
+        vm1_state *set[LANES];
+        unsigned long set_at[LANES], set_len = 0;
+        unsigned char alone[LANES];
+
+        if (grouped[first] || !lanes_can_run(vms[first]))
+            continue;
+
+        for (unsigned long i = first; i < count && set_len < LANES; i++)
+        {
+            if (grouped[i] || !lanes_can_run(vms[i]) || !vm1_lanes_compatible(vms[first], vms[i]))
+                continue;
+
+            grouped[i] = TRUE;
+
+            // Like vm1_run(), the memory is about to change
+            error_clear(vms[i]);
+            drop_fork_base(vms[i]);
+
+            set[set_len] = vms[i];
+            set_at[set_len++] = i;
+        }
+
+        vm1_lanes_run(set, set_len, alone);
+
+        for (unsigned long lane = 0; lane < set_len; lane++)
+            finished[set_at[lane]] = !alone[lane];
+    }
+
+    free(grouped);
+#endif
+
+    for (unsigned long i = 0; i < count; i++)
+    {
+        int result = finished != NULL && finished[i] ? VM1_OK : vm1_run(vms[i]);
+
+        if (status != NULL)
+            status[i] = result;
+
+        if (result != VM1_OK)
+            failed = TRUE;
+    }
+
+    free(finished);
+
+    return failed ? VM1_ERROR : VM1_OK;
+}
+
+uint16_t vm1_get_register(vm1_state *vm, int reg)
+{
+    return reg >= 0 && reg < R_COUNT ? vm->registers[reg] : 0;
+}
+
+void vm1_set_register(vm1_state *vm, int reg, uint16_t value)
+{
+    if (reg >= 0 && reg < R_COUNT)
+        vm->registers[reg] = value;
+}
+
+int vm1_get_flag(vm1_state *vm, int flag)
+{
+    return flag >= 0 && flag < F_COUNT ? vm1_flag_get(vm, flag) : 0;
+}
+
+const unsigned char *vm1_get_memory(vm1_state *vm, unsigned long *length)
+{
+    if (length != NULL)
+        *length = vm->memory_len;
+
+    return vm->memory;
+}
+
+const char *vm1_get_error(vm1_state *vm)
+{
+    return vm->error;
 }
@@ -0,0 +1,235 @@
+#ifndef VM1_H
+#define VM1_H
+
+#include <stdio.h>  // FILE
+#include <stdint.h> // uint16_t, uint64_t
+
+// VM1 library. Every virtual machine lives in its own vm1_state,
+// and nothing is shared between them, so a host can keep any
+// number of them alive at once.
+//
+//   vm1_state *vm = vm1_create();
+//
+//   if (vm1_load(vm, program, program_len) != VM1_OK ||
+//       vm1_run(vm) != VM1_OK)
+//       printf("%s", vm1_get_error(vm));
+//
+//   vm1_destroy(vm);
+
+// Registers
+enum
+{
+    R_GENERAL1,
+    R_GENERAL2,
+    R_GENERAL3,
+    R_GENERAL4,
+    R_COUNT
+};
+
+// Flags
+enum
+{
+    F_ZERO,
+    F_POSITIVE,
+    F_NEGATIVE,
+    F_EQUAL,
+    F_LESS_THAN,
+    F_MORE_THAN,
+    F_LESS_OR_EQUAL_TO,
+    F_MORE_OR_EQUAL_TO,
+    F_COUNT
+};
+
+// Return values
+enum
+{
+    VM1_OK,
+    VM1_ERROR,
+    VM1_YIELD
+};
+
+// Dispatch engines
+enum
+{
+    VM1_DISPATCH_SWITCH,
+    VM1_DISPATCH_THREADED
+};
+
+typedef struct vm1_state vm1_state;
+
+// Receives the output of OUT instructions. Text isn't null
+// terminated.
+typedef void (*vm1_output_function)(void *data, const char *text, unsigned long length);
+
+// Creates a virtual machine with no program. Returns NULL when
+// out of memory.
+vm1_state *vm1_create();
+
+// Frees the virtual machine and everything it owns.
+void vm1_destroy(vm1_state *vm);
+
+// Selects the dispatch engine. Returns VM1_ERROR when this build
+// doesn't have it, and keeps the current one.
+int vm1_set_dispatch(vm1_state *vm, int dispatch);
+
+// Compiles the program to machine code before running when enabled
+// is nonzero. Returns VM1_ERROR when this build doesn't have a JIT.
+int vm1_set_jit(vm1_state *vm, int enabled);
+
+// Limits every vm1_run() to the given number of instructions and
+// microseconds. Zero is no limit. Time is checked every 1024
+// instructions. Programs with a limit are always run by an
+// interpreter that counts every instruction, never by the JIT.
+void vm1_set_budget(vm1_state *vm, unsigned long instructions, unsigned long microseconds);
+
+// Counts executions of every op code, memory location and jump or
+// branch when enabled is nonzero. Profiled programs are run by the
+// same interpreter as programs with a budget. Counts start from
+// zero whenever a program is loaded. Returns VM1_ERROR when out of
+// memory.
+int vm1_set_profile(vm1_state *vm, int enabled);
+
+// Prints the counts, most executed first. Returns VM1_ERROR if the
+// virtual machine isn't profiling.
+int vm1_print_profile(vm1_state *vm, FILE *stream);
+
+// Writes the counts in CSV, one count per line. Returns VM1_ERROR if
+// the virtual machine isn't profiling or the file can't be written.
+int vm1_write_profile(vm1_state *vm, const char *file_name);
+
+// Returns the number of instructions executed since the program was
+// loaded, superinstructions counted as two. Only profiled programs
+// are counted, others return 0.
+uint64_t vm1_get_instruction_count(vm1_state *vm);
+
+// Writes every executed instruction to stream before executing it,
+// with the registers at that point. NULL stops tracing. Traced
+// programs are run by the same interpreter as profiled ones.
+void vm1_set_trace(vm1_state *vm, FILE *stream);
+
+// Reads a source map written by the assembler with -map. Errors,
+// profiles and traces then give the source line and label of every
+// memory location, verification errors too when it's loaded before
+// vm1_load(). NULL drops the map. Returns VM1_ERROR if the file
+// can't be read or isn't a map.
+int vm1_load_map(vm1_state *vm, const char *file_name);
+
+// Default size of the output buffer in bytes
+#define VM1_OUTPUT_BUFFER 4096
+
+// Output of OUT instructions is buffered, and sent to stdout in
+// chunks of the buffer size. The buffer is flushed whenever
+// vm1_run() returns, at END, on error or when the budget runs out.
+
+// Sends output to output instead of stdout. data is passed to it
+// as is.
+void vm1_set_output(vm1_state *vm, vm1_output_function output, void *data);
+
+// Sends output to a file descriptor instead of stdout.
+void vm1_set_output_fd(vm1_state *vm, int fd);
+
+// Sets the output buffer size. Zero sends the text of every OUT on
+// its own. Returns VM1_ERROR when out of memory.
+int vm1_set_output_buffer(vm1_state *vm, unsigned long size);
+
+// Sends everything in the output buffer to the output right away.
+void vm1_flush(vm1_state *vm);
+
+// Copies the program into the memory of the virtual machine,
+// verifies and decodes it. Registers and flags are cleared, and
+// execution starts from the first byte.
+int vm1_load(vm1_state *vm, const unsigned char *program, unsigned long length);
+
+// Loads the contents of a program file written by the assembler,
+// see vbc.h. Memory is allocated at the length the file declares,
+// and execution starts from its entry point. A source map in the
+// file is used unless one was loaded with vm1_load_map(). Files
+// older assemblers wrote, with no container, are loaded like
+// vm1_load() does. Returns VM1_ERROR when the file is broken or the
+// program doesn't verify.
+int vm1_load_vbc(vm1_state *vm, const unsigned char *file, unsigned long length);
+
+// Loads a program file like vm1_load_vbc(), straight from the file.
+// The file is mapped instead of read, and whole pages of the program
+// are mapped to the memory copy-on-write, so virtual machines and
+// processes running the same file share them until SMR writes to
+// one. Returns VM1_ERROR when the file can't be read, too.
+int vm1_load_file(vm1_state *vm, const char *file_name);
+
+// Writes the loaded program to file as C source, which runs it
+// without the interpreter: every instruction is a statement on local
+// registers, and jumps and branches are gotos. The C program starts
+// where vm1_run() would continue, with the memory, registers and
+// flags the virtual machine has now, and does what vm1 does from
+// there, see vm1_doc.txt. Returns VM1_ERROR when an SMR writes over
+// code, since the code then isn't known before running.
+int vm1_translate(vm1_state *vm, FILE *file);
+
+// Writes the whole state of the virtual machine to a snapshot file:
+// memory, registers, flags, the next instruction and output still
+// in the buffer. Take it when vm1_run() returns VM1_YIELD, after a
+// program has built its tables, and later runs can start from there
+// with vm1_load_snapshot() instead of running that part again.
+// Returns VM1_ERROR when the program has ended or the file can't be
+// written.
+int vm1_save_snapshot(vm1_state *vm, const char *file_name);
+
+// Restores a snapshot written by vm1_save_snapshot(), over the
+// program it was taken from, which has to be loaded first. The file
+// is mapped, and whole pages of memory are mapped from it
+// copy-on-write like the pages of a program file. The next
+// vm1_run() continues from where the snapshot was taken. Returns
+// VM1_ERROR when the snapshot is broken or was taken from another
+// program, and the program can't be run then.
+int vm1_load_snapshot(vm1_state *vm, const char *file_name);
+
+// Creates a virtual machine that continues from the state of this
+// one: memory, registers, flags and the next instruction, with the
+// same settings and output. Memory isn't copied. Pages of a page or
+// more are mapped copy-on-write from a file both share, so a fork
+// only gets its own copy of the pages its SMR writes to, and the
+// decoded program is shared until a fork writes over code. Forks
+// are independent virtual machines, and can run on other threads
+// while this one is left alone. A source map and the trace stream
+// aren't shared. Windows builds copy the memory. Returns NULL when
+// no program is loaded or out of memory, with the reason in
+// vm1_get_error() of this virtual machine.
+vm1_state *vm1_fork(vm1_state *vm);
+
+// Runs the loaded program until END. Returns VM1_YIELD when the
+// budget set with vm1_set_budget() ran out before that. The state is
+// kept as is, and the next vm1_run() continues from the next
+// instruction.
+int vm1_run(vm1_state *vm);
+
+// Runs count virtual machines until END, like vm1_run() on each one,
+// and puts what vm1_run() would return for each in status, unless
+// it's NULL. Virtual machines with the same program, like forks
+// from vm1_fork() with different registers, are run as lanes of a
+// vector, 16 at a time in builds for AVX2 and 8 in others, and
+// every instruction is done for all of them at once.
+// Lanes run together until a branch goes both ways and splits them,
+// and run together again once they get back to the same
+// instruction. Output, registers, flags and memory end up the same
+// as with vm1_run(). Virtual machines with a budget, profile or
+// trace, and lanes that write over code, read past the end of
+// memory or divide by zero, finish on their own with vm1_run().
+// Compilers without vectors of GNU C run every one on its own.
+// Returns VM1_ERROR if any of them didn't return VM1_OK.
+int vm1_run_lanes(vm1_state *const *vms, unsigned long count, int *status);
+
+uint16_t vm1_get_register(vm1_state *vm, int reg);
+void vm1_set_register(vm1_state *vm, int reg, uint16_t value);
+
+// Returns 1 if the flag is set, 0 otherwise.
+int vm1_get_flag(vm1_state *vm, int flag);
+
+// Returns the memory of the virtual machine, and its length in
+// length.
+const unsigned char *vm1_get_memory(vm1_state *vm, unsigned long *length);
+
+// Returns the reason the last vm1_load() or vm1_run() failed. One
+// problem per line.
+const char *vm1_get_error(vm1_state *vm);
+
+#endif
@@ -0,0 +1,464 @@
+#include <stdio.h>  // fprintf(), fputs()
+#include <stdlib.h> // calloc(), free()
+
+#include "..\shared\shared_macros.h"
+
+#include "vm1_aot.h"
+#include "vm1_internal.h"
+#include "vm1_profile.h"
+#include "vm1_map.h"
+
+static const char *const aot_flag_name[F_COUNT] = {
+    "F_ZERO", "F_POSITIVE", "F_NEGATIVE", "F_EQUAL",
+    "F_LESS_THAN", "F_MORE_THAN", "F_LESS_OR_EQUAL_TO", "F_MORE_OR_EQUAL_TO"};
+
+// Everything that doesn't depend on the program. Flags and output
+// work like they do in vm1.c, see vm1_flag_get() and vm1_out() there.
+static const char *const aot_runtime =
+    "#include <stdio.h>\n"
+    "#include <stdint.h>\n"
+    "#include <string.h>\n"
+    "\n"
+    "enum\n"
+    "{\n"
+    "    F_ZERO,\n"
+    "    F_POSITIVE,\n"
+    "    F_NEGATIVE,\n"
+    "    F_EQUAL,\n"
+    "    F_LESS_THAN,\n"
+    "    F_MORE_THAN,\n"
+    "    F_LESS_OR_EQUAL_TO,\n"
+    "    F_MORE_OR_EQUAL_TO,\n"
+    "    F_COUNT\n"
+    "};\n"
+    "\n"
+    "// Flags follow the value in flag_result, see vm1_internal.h\n"
+    "#define FLAGS_FROM_RESULT (F_COUNT + 1)\n"
+    "\n"
+    "#define OUTPUT_SIZE 4096\n"
+    "\n"
+    "// Same as vm1_output_function in vm1.h\n"
+    "typedef void (*vm1_aot_output)(void *data, const char *text, unsigned long length);\n"
+    "\n"
+    "typedef struct\n"
+    "{\n"
+    "    char text[OUTPUT_SIZE + 32];\n"
+    "    unsigned long len;\n"
+    "    vm1_aot_output output;\n"
+    "    void *data;\n"
+    "} output_buffer;\n"
+    "\n"
+    "static inline void flush(output_buffer *buffer)\n"
+    "{\n"
+    "    if (buffer->len > 0 && buffer->output != NULL)\n"
+    "        buffer->output(buffer->data, buffer->text, buffer->len);\n"
+    "    else if (buffer->len > 0)\n"
+    "        fwrite(buffer->text, 1, buffer->len, stdout);\n"
+    "\n"
+    "    buffer->len = 0;\n"
+    "}\n"
+    "\n"
+    "static inline void out(output_buffer *buffer, uint16_t value, unsigned char format)\n"
+    "{\n"
+    "    char *text = buffer->text + buffer->len, digits[5];\n"
+    "    int length = 0, count = 0;\n"
+    "\n"
+    "    switch (format)\n"
+    "    {\n"
+    "    case 0:\n"
+    "        for (int i = 15; i >= 0; i--)\n"
+    "            text[length++] = '0' + ((value >> i) & 1);\n"
+    "        break;\n"
+    "\n"
+    "    case 1:\n"
+    "    case 2:\n"
+    "        do\n"
+    "        {\n"
+    "            digits[count++] = format == 1 ? \"0123456789abcdef\"[value & 0xF] : '0' + value % 10;\n"
+    "            value = format == 1 ? value >> 4 : value / 10;\n"
+    "        } while (value > 0);\n"
+    "\n"
+    "        while (count > 0)\n"
+    "            text[length++] = digits[--count];\n"
+    "        break;\n"
+    "\n"
+    "    case 3:\n"
+    "        text[length++] = (char)value;\n"
+    "        break;\n"
+    "    }\n"
+    "\n"
+    "    buffer->len += length;\n"
+    "\n"
+    "    if (buffer->len >= OUTPUT_SIZE)\n"
+    "        flush(buffer);\n"
+    "}\n"
+    "\n"
+    "static inline int get_flag(unsigned flag_op, uint16_t flag_result, unsigned flag)\n"
+    "{\n"
+    "    if (flag_op == FLAGS_FROM_RESULT)\n"
+    "        return flag == F_ZERO ? flag_result == 0 : flag == F_POSITIVE && flag_result > 0;\n"
+    "\n"
+    "    return flag == flag_op && flag_result != 0;\n"
+    "}\n"
+    "\n";
+
+// Writes text as the inside of a C string literal.
+static void write_escaped(FILE *file, const char *text)
+{
+    for (; *text != '\0'; text++)
+    {
+        if (*text == '"' || *text == '\\')
+            fprintf(file, "\\%c", *text);
+        else if ((unsigned char)*text < ' ')
+            fprintf(file, "\\%03o", (unsigned char)*text);
+        else
+            fputc(*text, file);
+    }
+}
+
+// Returns the 16bit value in loc of the memory.
+static unsigned long value_at(vm1_state *vm, unsigned long loc)
+{
+    return vm->memory[loc] + (vm->memory[loc + 1] << 8);
+}
+
+// Writes the check that stops the program with message as the error
+// of the instruction in loc when condition is true.
+static void write_check(FILE *file, unsigned long loc, const char *source, const char *condition, const char *message)
+{
+    fprintf(file, "    if (%s)\n    {\n        error = \"0x%04lX: %s", condition, loc, message);
+
+    if (source[0] != '\0')
+    {
+        fprintf(file, " (");
+        write_escaped(file, source);
+        fprintf(file, ")");
+    }
+
+    fprintf(file, "\";\n        goto end;\n    }\n\n");
+}
+
+// Writes the statements that leave the memory location of a load or
+// a store in address, and check that width bytes from there fit in
+// the memory and, for stores, aren't code.
+static void write_offset_address(vm1_state *vm, FILE *file, unsigned long loc, const char *source, unsigned long width)
+{
+    const unsigned char *ins = vm->memory + loc;
+    char condition[64];
+
+    fprintf(file, "    address = (uint16_t)(r%d + %lu);\n", ins[2], value_at(vm, loc + 3));
+
+    snprintf(condition, sizeof(condition), "address + %lu > MEMORY_LEN", width);
+    write_check(file, loc, source, condition, "Memory access out of bounds");
+
+    if (ins[0] == I_STORE_DOUBLE || ins[0] == I_STORE_QUAD)
+    {
+        snprintf(condition, sizeof(condition), "writes_code(address, %lu)", width);
+        write_check(file, loc, source, condition, "Writes over code, which can't be translated");
+    }
+}
+
+// Writes the statements of the instruction in loc.
+static void write_instruction(vm1_state *vm, FILE *file, unsigned long loc)
+{
+    const unsigned char *ins = vm->memory + loc;
+    char source[256];
+
+    if (vm1_map_describe(vm->map, loc, source, sizeof(source)) == 0)
+        source[0] = '\0';
+
+    fprintf(file, "    // 0x%04lX %s", loc, vm1_op_name[ins[0]]);
+
+    if (source[0] != '\0')
+    {
+        fprintf(file, " ");
+        write_escaped(file, source);
+    }
+
+    fprintf(file, "\n");
+
+    switch (ins[0])
+    {
+    case I_END:
+        fprintf(file, "    goto end;\n");
+        return;
+
+    case I_JUMP:
+        fprintf(file, "    goto L_%04lX;\n", value_at(vm, loc + 1));
+        return;
+
+    case I_POSITIVE_BRANCH:
+    case I_NEGATIVE_BRANCH:
+        fprintf(file, "    if (%sget_flag(flag_op, flag_result, %s))\n        goto L_%04lX;\n",
+                ins[0] == I_NEGATIVE_BRANCH ? "!" : "", aot_flag_name[ins[1]], value_at(vm, loc + 2));
+        return;
+
+    case I_ADDITION:
+        fprintf(file, "    r%d += r%d;\n", ins[1], ins[2]);
+        break;
+
+    case I_SUBTRACTION:
+        fprintf(file, "    r%d -= r%d;\n", ins[1], ins[2]);
+        break;
+
+    // Unsigned, int would overflow
+    case I_MULTIPLICATION:
+        fprintf(file, "    r%d = (uint16_t)((unsigned)r%d * r%d);\n", ins[1], ins[1], ins[2]);
+        break;
+
+    case I_DIVISION:
+    case I_REMAINDER:
+    {
+        char condition[32];
+
+        snprintf(condition, sizeof(condition), "r%d == 0", ins[2]);
+        write_check(file, loc, source, condition, "Division by zero");
+        fprintf(file, ins[0] == I_DIVISION ? "    r%d /= r%d;\n" : "    r%d %%= r%d;\n", ins[1], ins[2]);
+        break;
+    }
+
+    case I_SET_REG_VAL:
+        fprintf(file, "    r%d = %lu;\n", ins[1], value_at(vm, loc + 2));
+        break;
+
+    case I_SET_REG_REG:
+        fprintf(file, "    r%d = r%d;\n", ins[1], ins[2]);
+        break;
+
+    case I_SET_REG_MEM:
+    {
+        char condition[32];
+
+        snprintf(condition, sizeof(condition), "r%d >= MEMORY_LEN", ins[2]);
+        write_check(file, loc, source, condition, "Memory access out of bounds");
+        fprintf(file, "    r%d = memory[r%d];\n", ins[1], ins[2]);
+        break;
+    }
+
+    case I_SET_MEM_REG:
+        fprintf(file, "    memory[%lu] = (unsigned char)r%d;\n", value_at(vm, loc + 1), ins[3]);
+        fprintf(file, "    flag_op = FLAGS_FROM_RESULT;\n    flag_result = r%d;\n", ins[3]);
+        return;
+
+    case I_IS_EQUAL:
+    case I_IS_LESS_THAN:
+    case I_IS_MORE_THAN:
+    case I_IS_LESS_OR_EQUAL_TO:
+    case I_IS_MORE_OR_EQUAL_TO:
+    {
+        static const char *const compare[] = {"==", "<", ">", "<=", ">="};
+        static const unsigned char compare_flag[] = {F_EQUAL, F_LESS_THAN, F_MORE_THAN, F_LESS_OR_EQUAL_TO, F_MORE_OR_EQUAL_TO};
+
+        fprintf(file, "    flag_op = %s;\n", aot_flag_name[compare_flag[ins[0] - I_IS_EQUAL]]);
+
+        // A register against itself, compilers warn about the comparison
+        if (ins[1] == ins[2])
+            fprintf(file, "    flag_result = %d;\n", ins[0] == I_IS_EQUAL || ins[0] >= I_IS_LESS_OR_EQUAL_TO);
+        else
+            fprintf(file, "    flag_result = r%d %s r%d;\n", ins[1], compare[ins[0] - I_IS_EQUAL], ins[2]);
+
+        return;
+    }
+
+    case I_OUT:
+        fprintf(file, "    out(&buffer, r%d, %d);\n", ins[1], ins[2]);
+        return;
+
+    case I_LOAD_DOUBLE:
+        write_offset_address(vm, file, loc, source, 2);
+        fprintf(file, "    r%d = memory[address] | memory[address + 1] << 8;\n", ins[1]);
+        break;
+
+    case I_STORE_DOUBLE:
+        write_offset_address(vm, file, loc, source, 2);
+        fprintf(file, "    memory[address] = (unsigned char)r%d;\n    memory[address + 1] = r%d >> 8;\n", ins[1], ins[1]);
+        break;
+
+    // 32bit values are in a pair of registers, and their flags follow
+    // both, see update_quad_flags()
+    case I_LOAD_QUAD:
+        write_offset_address(vm, file, loc, source, 4);
+        fprintf(file, "    r%d = memory[address] | memory[address + 1] << 8;\n", ins[1]);
+        fprintf(file, "    r%d = memory[address + 2] | memory[address + 3] << 8;\n", ins[1] + 1);
+        fprintf(file, "    flag_op = FLAGS_FROM_RESULT;\n    flag_result = r%d | r%d;\n", ins[1], ins[1] + 1);
+        return;
+
+    case I_STORE_QUAD:
+        write_offset_address(vm, file, loc, source, 4);
+        fprintf(file, "    memory[address] = (unsigned char)r%d;\n    memory[address + 1] = r%d >> 8;\n", ins[1], ins[1]);
+        fprintf(file, "    memory[address + 2] = (unsigned char)r%d;\n    memory[address + 3] = r%d >> 8;\n", ins[1] + 1, ins[1] + 1);
+        fprintf(file, "    flag_op = FLAGS_FROM_RESULT;\n    flag_result = r%d | r%d;\n", ins[1], ins[1] + 1);
+        return;
+    }
+
+    // Flags of everything that writes a register
+    fprintf(file, "    flag_op = FLAGS_FROM_RESULT;\n    flag_result = r%d;\n", ins[1]);
+}
+
+void vm1_aot_write(vm1_state *vm, FILE *file)
+{
+    unsigned long entry = vm->instructions[vm->index].loc;
+    unsigned char *labels = calloc(vm->memory_len + 1, sizeof(char));
+
+    if (labels == NULL)
+        vm1_error(vm, "Out of memory");
+
+    labels[entry] = TRUE;
+
+    // Memory is only known when nothing writes over code, and jumps
+    // only go to where the verifier says
+    for (unsigned long loc = 0; loc < vm->memory_len; loc++)
+    {
+        if (vm->instruction_at[loc] == NO_INSTRUCTION)
+            continue;
+
+        const unsigned char *ins = vm->memory + loc;
+
+        if (ins[0] == I_JUMP)
+            labels[value_at(vm, loc + 1)] = TRUE;
+        else if (ins[0] == I_POSITIVE_BRANCH || ins[0] == I_NEGATIVE_BRANCH)
+            labels[value_at(vm, loc + 2)] = TRUE;
+        else if (ins[0] == I_SET_MEM_REG && vm->code_map[value_at(vm, loc + 1)])
+        {
+            free(labels);
+            vm1_error_at(vm, loc, "SMR writes over code, which can't be translated");
+        }
+    }
+
+    // Trailing zeros are left to C
+    unsigned long memory_end = vm->memory_len;
+
+    while (memory_end > 0 && vm->memory[memory_end - 1] == 0)
+        memory_end--;
+
+    fprintf(file,
+            "// Translated by %s %s. Build it as a program, or as a library for a\n"
+            "// host with VM1_AOT_LIBRARY defined:\n"
+            "//\n"
+            "//   cc -O2 program.c -o program\n"
+            "//   cc -O2 -shared -fPIC -DVM1_AOT_LIBRARY program.c -o program.so\n"
+            "\n",
+            PROJECT_NAME, VM_VERSION);
+
+    fputs(aot_runtime, file);
+
+    fprintf(file, "#define MEMORY_LEN %luUL\n\n", vm->memory_len);
+
+    // Code is only known where it was decoded from, so STD and STQ
+    // check that they don't write over it
+    fprintf(file,
+            "// Returns 1 if width bytes from address are code\n"
+            "static inline int writes_code(unsigned long address, unsigned long width)\n"
+            "{\n"
+            "    return");
+
+    for (unsigned long loc = 0, ranges = 0; loc < vm->memory_len; loc++)
+    {
+        if (!vm->code_map[loc] || (loc > 0 && vm->code_map[loc - 1]))
+            continue;
+
+        unsigned long end = loc;
+
+        while (end < vm->memory_len && vm->code_map[end])
+            end++;
+
+        fprintf(file, "%s(address < %luUL && address + width > %luUL)", ranges++ > 0 ? " ||\n           " : " ", end, loc);
+    }
+
+    fprintf(file, ";\n}\n\n");
+    fprintf(file, "const unsigned long vm1_aot_memory_len = MEMORY_LEN;\n\n");
+    fprintf(file, "// Memory when the program starts, and a zero after it\n");
+    fprintf(file, "const unsigned char vm1_aot_memory[MEMORY_LEN + 1] = {");
+
+    for (unsigned long loc = 0; loc < memory_end; loc++)
+        fprintf(file, "%s%d,", loc % 16 == 0 ? "\n    " : " ", vm->memory[loc]);
+
+    fprintf(file,
+            "};\n"
+            "\n"
+            "// Runs the program on memory, which holds MEMORY_LEN + 1 bytes and\n"
+            "// starts as a copy of vm1_aot_memory. registers are read at the\n"
+            "// start and written at the end, when flags gets every flag. Output\n"
+            "// goes to output, or stdout when it's NULL. Returns NULL at END, or\n"
+            "// what went wrong.\n"
+            "const char *vm1_aot_run(uint16_t registers[4], unsigned char flags[F_COUNT], unsigned char *memory,\n"
+            "                        vm1_aot_output output, void *data)\n"
+            "{\n"
+            "    output_buffer buffer = {.len = 0, .output = output, .data = data};\n"
+            "    uint16_t r0 = registers[0], r1 = registers[1], r2 = registers[2], r3 = registers[3];\n"
+            "    unsigned flag_op = %d;\n"
+            "    uint16_t flag_result = %d;\n"
+            "    const char *error = NULL;\n"
+            "    unsigned long address = 0;\n"
+            "\n"
+            "    // Unused when nothing reads or writes memory\n"
+            "    (void)memory;\n"
+            "    (void)address;\n"
+            "    goto L_%04lX;\n",
+            vm->flag_op, vm->flag_result, entry);
+
+    for (unsigned long loc = 0; loc < vm->memory_len; loc++)
+    {
+        if (vm->instruction_at[loc] == NO_INSTRUCTION)
+            continue;
+
+        fprintf(file, "\n");
+
+        if (labels[loc])
+            fprintf(file, "L_%04lX:\n", loc);
+
+        write_instruction(vm, file, loc);
+    }
+
+    // Never reached, the verifier doesn't let execution run past the
+    // last instruction. Keeps end used for programs without END
+    fprintf(file,
+            "\n"
+            "    goto end;\n"
+            "\n"
+            "end:\n"
+            "    flush(&buffer);\n"
+            "\n"
+            "    registers[0] = r0;\n"
+            "    registers[1] = r1;\n"
+            "    registers[2] = r2;\n"
+            "    registers[3] = r3;\n"
+            "\n"
+            "    for (unsigned flag = 0; flag < F_COUNT; flag++)\n"
+            "        flags[flag] = get_flag(flag_op, flag_result, flag);\n"
+            "\n"
+            "    return error;\n"
+            "}\n"
+            "\n"
+            "#ifndef VM1_AOT_LIBRARY\n"
+            "static unsigned char memory[MEMORY_LEN + 1];\n"
+            "\n"
+            "// Prints what vm1 prints after the program\n"
+            "int main(void)\n"
+            "{\n"
+            "    uint16_t registers[4] = {%d, %d, %d, %d};\n"
+            "    unsigned char flags[F_COUNT];\n"
+            "\n"
+            "    memcpy(memory, vm1_aot_memory, sizeof(memory));\n"
+            "\n"
+            "    const char *error = vm1_aot_run(registers, flags, memory, NULL, NULL);\n"
+            "\n"
+            "    if (error != NULL)\n"
+            "    {\n"
+            "        printf(\"%s ERROR! %%s\", error);\n"
+            "        return 1;\n"
+            "    }\n"
+            "\n"
+            "    printf(\n"
+            "        \"\\nRegisters [%%d,%%d,%%d,%%d] Flags [ZRO %%d,POS %%d,NEG %%d,EQL %%d,LTH %%d,MTH %%d,LQT %%d,MQT %%d]\\n\",\n"
+            "        registers[0], registers[1], registers[2], registers[3],\n"
+            "        flags[F_ZERO], flags[F_POSITIVE], flags[F_NEGATIVE], flags[F_EQUAL],\n"
+            "        flags[F_LESS_THAN], flags[F_MORE_THAN], flags[F_LESS_OR_EQUAL_TO], flags[F_MORE_OR_EQUAL_TO]);\n"
+            "\n"
+            "    return 0;\n"
+            "}\n"
+            "#endif\n",
+            vm->registers[0], vm->registers[1], vm->registers[2], vm->registers[3], PROJECT_NAME);
+
+    free(labels);
+}
@@ -0,0 +1,15 @@
+#ifndef VM1_AOT_H
+#define VM1_AOT_H
+
+#include <stdio.h> // FILE
+
+#include "vm1_internal.h"
+
+// Writes the decoded program of vm to file as C source, with every
+// instruction as a statement on local registers and a goto for every
+// jump and branch. The C program starts from vm->index, with the
+// memory, registers and flags vm has now. Stops with vm1_error_at() when
+// an SMR writes over code, which can't be translated.
+void vm1_aot_write(vm1_state *vm, FILE *file);
+
+#endif
@@ -0,0 +1,591 @@
+// Needed for sysconf()
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>  // printf(), fopen()
+#include <stdlib.h> // malloc(), realloc(), free(), qsort()
+#include <string.h> // memcpy(), strcmp(), strlen()
+#include <stdarg.h> // va_list
+
+#include "..\shared\shared_macros.h"
+
+#include "vm1.h"
+#include "vm1_batch.h"
+
+#ifdef _WIN32
+#include <windows.h> // CreateThread(), CRITICAL_SECTION, FindFirstFileA()
+#else
+#include <pthread.h> // pthread_create(), pthread_mutex_t
+#include <unistd.h>  // sysconf()
+#include <dirent.h>  // opendir(), readdir()
+#endif
+
+// Threads
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION batch_lock;
+typedef HANDLE batch_thread;
+#else
+typedef pthread_mutex_t batch_lock;
+typedef pthread_t batch_thread;
+#endif
+
+void lock_init(batch_lock *lock)
+{
+#ifdef _WIN32
+    InitializeCriticalSection(lock);
+#else
+    pthread_mutex_init(lock, NULL);
+#endif
+}
+
+void lock_free(batch_lock *lock)
+{
+#ifdef _WIN32
+    DeleteCriticalSection(lock);
+#else
+    pthread_mutex_destroy(lock);
+#endif
+}
+
+void lock_acquire(batch_lock *lock)
+{
+#ifdef _WIN32
+    EnterCriticalSection(lock);
+#else
+    pthread_mutex_lock(lock);
+#endif
+}
+
+void lock_release(batch_lock *lock)
+{
+#ifdef _WIN32
+    LeaveCriticalSection(lock);
+#else
+    pthread_mutex_unlock(lock);
+#endif
+}
+
+unsigned long core_count()
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    long count = info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+    return count > 0 ? count : 1;
+}
+
+// Text buffer
+
+// Growable text, every program writes its report in its own one
+// so output of programs running at the same time never mixes.
+typedef struct
+{
+    char *text;
+    unsigned long len;
+    unsigned long size;
+} batch_text;
+
+void text_append(batch_text *text, const char *append, unsigned long length)
+{
+    if (text->len + length > text->size)
+    {
+        unsigned long size = text->size > 0 ? text->size : 256;
+
+        while (size < text->len + length)
+            size *= 2;
+
+        char *grown = realloc(text->text, size);
+
+        // Out of memory, the rest of the report is lost
+        if (grown == NULL)
+            return;
+
+        text->text = grown;
+        text->size = size;
+    }
+
+    memcpy(text->text + text->len, append, length);
+    text->len += length;
+}
+
+void text_printf(batch_text *text, const char *format, ...)
+{
+    char line[256];
+    va_list args;
+
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    if (length > (int)sizeof(line) - 1)
+        length = sizeof(line) - 1;
+
+    if (length > 0)
+        text_append(text, line, length);
+}
+
+// Adds every line of message with the error prefix.
+void text_error(batch_text *text, const char *message)
+{
+    while (*message != '\0')
+    {
+        const char *end = message;
+
+        while (*end != '\0' && *end != '\n')
+            end++;
+
+        text_printf(text, "%s ERROR! ", PROJECT_NAME);
+        text_append(text, message, end - message);
+        text_append(text, "\n", 1);
+
+        message = *end == '\n' ? end + 1 : end;
+    }
+}
+
+// Output function given to the virtual machines
+void output_text(void *data, const char *text, unsigned long length)
+{
+    text_append(data, text, length);
+}
+
+// Jobs
+
+typedef struct
+{
+    char *file_name;
+    batch_text report;
+    int failed;
+} batch_job;
+
+// Jobs a worker hasn't taken yet are the job indexes from front to
+// back. The worker takes them from the front, and other workers
+// steal from the back.
+typedef struct
+{
+    batch_lock lock;
+    unsigned long front;
+    unsigned long back;
+} batch_deque;
+
+struct batch;
+
+typedef struct
+{
+    unsigned long id;
+    struct batch *batch;
+    batch_deque deque;
+    batch_thread thread;
+    int started;
+} batch_worker;
+
+typedef struct batch
+{
+    batch_options *options;
+
+    batch_job *jobs;
+    unsigned long job_count;
+
+    batch_worker *workers;
+    unsigned long worker_count;
+} batch;
+
+// Reads the program of the job and runs it, writing everything it
+// outputs to the report of the job.
+void run_job(vm1_state *vm, batch_job *job)
+{
+    batch_text *report = &job->report;
+
+    text_printf(report, "File: %s\n", job->file_name);
+
+    if (vm == NULL)
+    {
+        text_error(report, "Out of memory");
+        job->failed = TRUE;
+        return;
+    }
+
+    vm1_set_output(vm, output_text, report);
+
+    // Jobs running the same file share its pages
+    int status = vm1_load_file(vm, job->file_name);
+    unsigned long program_len = 0;
+
+    if (vm1_get_memory(vm, &program_len) != NULL)
+        text_printf(report, "Program size: %lu bytes\n", program_len);
+
+    if (status == VM1_OK)
+        status = vm1_run(vm);
+
+    if (status == VM1_YIELD)
+    {
+        text_error(report, "Instruction limit reached");
+        job->failed = TRUE;
+        return;
+    }
+
+    if (status != VM1_OK)
+    {
+        text_error(report, vm1_get_error(vm));
+        job->failed = TRUE;
+        return;
+    }
+
+    text_printf(
+        report,
+        "\nRegisters [%d,%d,%d,%d] Flags [ZRO %d,POS %d,NEG %d,EQL %d,LTH %d,MTH %d,LQT %d,MQT %d]\n",
+
+        vm1_get_register(vm, R_GENERAL1),
+        vm1_get_register(vm, R_GENERAL2),
+        vm1_get_register(vm, R_GENERAL3),
+        vm1_get_register(vm, R_GENERAL4),
+
+        vm1_get_flag(vm, F_ZERO),
+        vm1_get_flag(vm, F_POSITIVE),
+        vm1_get_flag(vm, F_NEGATIVE),
+
+        vm1_get_flag(vm, F_EQUAL),
+        vm1_get_flag(vm, F_LESS_THAN),
+        vm1_get_flag(vm, F_MORE_THAN),
+
+        vm1_get_flag(vm, F_LESS_OR_EQUAL_TO),
+        vm1_get_flag(vm, F_MORE_OR_EQUAL_TO));
+}
+
+// Work stealing
+
+// Takes the next job of the worker itself. Returns 0 when it has
+// none left.
+int take_job(batch_worker *worker, unsigned long *job)
+{
+    int found = FALSE;
+
+    lock_acquire(&worker->deque.lock);
+
+    if (worker->deque.front < worker->deque.back)
+    {
+        *job = worker->deque.front++;
+        found = TRUE;
+    }
+
+    lock_release(&worker->deque.lock);
+
+    return found;
+}
+
+// Steals the back half of the jobs of the first other worker that
+// has any left. The first stolen job is returned in job, and the
+// rest become the jobs of the worker. Returns 0 when every worker
+// is out of jobs.
+int steal_job(batch_worker *worker, unsigned long *job)
+{
+    batch *batch = worker->batch;
+
+    for (unsigned long i = 1; i < batch->worker_count; i++)
+    {
+        batch_worker *victim = &batch->workers[(worker->id + i) % batch->worker_count];
+        unsigned long from = 0, until = 0;
+
+        lock_acquire(&victim->deque.lock);
+
+        unsigned long left = victim->deque.back - victim->deque.front;
+
+        if (left > 0)
+        {
+            until = victim->deque.back;
+            from = until - (left + 1) / 2;
+            victim->deque.back = from;
+        }
+
+        lock_release(&victim->deque.lock);
+
+        if (from == until)
+            continue;
+
+        lock_acquire(&worker->deque.lock);
+        worker->deque.front = from + 1;
+        worker->deque.back = until;
+        lock_release(&worker->deque.lock);
+
+        *job = from;
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+void work(batch_worker *worker)
+{
+    batch *batch = worker->batch;
+    vm1_state *vm = vm1_create();
+
+    if (vm != NULL)
+    {
+        if (batch->options->dispatch >= 0)
+            vm1_set_dispatch(vm, batch->options->dispatch);
+        vm1_set_jit(vm, batch->options->use_jit);
+        vm1_set_budget(vm, batch->options->limit, 0);
+
+        if (batch->options->output_buffer >= 0)
+            vm1_set_output_buffer(vm, batch->options->output_buffer);
+    }
+
+    unsigned long job;
+
+    while (take_job(worker, &job) || steal_job(worker, &job))
+        run_job(vm, &batch->jobs[job]);
+
+    vm1_destroy(vm);
+}
+
+#ifdef _WIN32
+DWORD WINAPI worker_main(LPVOID worker)
+{
+    work(worker);
+    return 0;
+}
+#else
+void *worker_main(void *worker)
+{
+    work(worker);
+    return NULL;
+}
+#endif
+
+int thread_start(batch_worker *worker)
+{
+#ifdef _WIN32
+    worker->thread = CreateThread(NULL, 0, worker_main, worker, 0, NULL);
+    return worker->thread != NULL;
+#else
+    return pthread_create(&worker->thread, NULL, worker_main, worker) == 0;
+#endif
+}
+
+void thread_join(batch_worker *worker)
+{
+#ifdef _WIN32
+    WaitForSingleObject(worker->thread, INFINITE);
+    CloseHandle(worker->thread);
+#else
+    pthread_join(worker->thread, NULL);
+#endif
+}
+
+// Listing programs
+
+typedef struct
+{
+    char **names;
+    unsigned long len;
+    unsigned long size;
+} batch_list;
+
+int list_add(batch_list *list, const char *name, unsigned long length)
+{
+    if (list->len == list->size)
+    {
+        unsigned long size = list->size > 0 ? list->size * 2 : 64;
+        char **grown = realloc(list->names, sizeof(char *) * size);
+
+        if (grown == NULL)
+            return FALSE;
+
+        list->names = grown;
+        list->size = size;
+    }
+
+    char *copy = malloc(length + 1);
+
+    if (copy == NULL)
+        return FALSE;
+
+    memcpy(copy, name, length);
+    copy[length] = '\0';
+
+    list->names[list->len++] = copy;
+    return TRUE;
+}
+
+int compare_names(const void *name1, const void *name2)
+{
+    return strcmp(*(char *const *)name1, *(char *const *)name2);
+}
+
+int is_vbc(const char *name)
+{
+    unsigned long length = strlen(name);
+
+    return length > 4 && strcmp(name + length - 4, ".vbc") == 0;
+}
+
+// Adds every .vbc file in the directory in name order. Returns 0
+// if path isn't a directory.
+int list_directory(batch_list *list, const char *path)
+{
+    char file_name[4096];
+
+#ifdef _WIN32
+    WIN32_FIND_DATAA found;
+    DWORD attributes = GetFileAttributesA(path);
+
+    if (attributes == INVALID_FILE_ATTRIBUTES || !(attributes & FILE_ATTRIBUTE_DIRECTORY))
+        return FALSE;
+
+    snprintf(file_name, sizeof(file_name), "%s\\*.vbc", path);
+    HANDLE find = FindFirstFileA(file_name, &found);
+
+    if (find != INVALID_HANDLE_VALUE)
+    {
+        do
+        {
+            if (found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY || !is_vbc(found.cFileName))
+                continue;
+
+            int length = snprintf(file_name, sizeof(file_name), "%s\\%s", path, found.cFileName);
+            list_add(list, file_name, length);
+        } while (FindNextFileA(find, &found));
+
+        FindClose(find);
+    }
+#else
+    DIR *dir = opendir(path);
+
+    if (dir == NULL)
+        return FALSE;
+
+    struct dirent *entry;
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (!is_vbc(entry->d_name))
+            continue;
+
+        int length = snprintf(file_name, sizeof(file_name), "%s/%s", path, entry->d_name);
+        list_add(list, file_name, length);
+    }
+
+    closedir(dir);
+#endif
+
+    qsort(list->names, list->len, sizeof(char *), compare_names);
+    return TRUE;
+}
+
+// Adds every program file in the manifest, one per line. Empty lines
+// and lines starting with # are skipped. Returns 0 if the manifest
+// can't be read.
+int list_manifest(batch_list *list, const char *path)
+{
+    FILE *file = fopen(path, "r");
+
+    if (file == NULL)
+        return FALSE;
+
+    char line[4096];
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        unsigned long length = strlen(line);
+
+        while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r' ||
+                               line[length - 1] == ' ' || line[length - 1] == '\t'))
+            length--;
+
+        if (length == 0 || line[0] == '#')
+            continue;
+
+        list_add(list, line, length);
+    }
+
+    fclose(file);
+    return TRUE;
+}
+
+// Batch
+
+long batch_run(const char *path, batch_options *options)
+{
+    batch_list list = {NULL, 0, 0};
+
+    if (!list_directory(&list, path) && !list_manifest(&list, path))
+        return -1;
+
+    batch batch;
+
+    batch.options = options;
+    batch.job_count = list.len;
+    batch.jobs = calloc(list.len + 1, sizeof(batch_job));
+
+    batch.worker_count = options->threads > 0 ? options->threads : core_count();
+    if (batch.worker_count > list.len)
+        batch.worker_count = list.len > 0 ? list.len : 1;
+
+    batch.workers = calloc(batch.worker_count, sizeof(batch_worker));
+
+    if (batch.jobs == NULL || batch.workers == NULL)
+    {
+        for (unsigned long i = 0; i < list.len; i++)
+            free(list.names[i]);
+        free(list.names);
+        free(batch.jobs);
+        free(batch.workers);
+
+        return -1;
+    }
+
+    for (unsigned long i = 0; i < list.len; i++)
+        batch.jobs[i].file_name = list.names[i];
+
+    // Every worker starts with an equal share of the jobs in
+    // submission order
+    for (unsigned long i = 0; i < batch.worker_count; i++)
+    {
+        batch_worker *worker = &batch.workers[i];
+
+        worker->id = i;
+        worker->batch = &batch;
+        worker->deque.front = batch.job_count * i / batch.worker_count;
+        worker->deque.back = batch.job_count * (i + 1) / batch.worker_count;
+        lock_init(&worker->deque.lock);
+    }
+
+    // This thread is the first worker. Jobs of a worker whose thread
+    // couldn't be started are stolen by the others.
+    for (unsigned long i = 1; i < batch.worker_count; i++)
+        batch.workers[i].started = thread_start(&batch.workers[i]);
+
+    work(&batch.workers[0]);
+
+    for (unsigned long i = 1; i < batch.worker_count; i++)
+        if (batch.workers[i].started)
+            thread_join(&batch.workers[i]);
+
+    // Results in submission order
+    long failed = 0;
+
+    for (unsigned long i = 0; i < batch.job_count; i++)
+    {
+        batch_job *job = &batch.jobs[i];
+
+        fwrite(job->report.text, 1, job->report.len, stdout);
+        failed += job->failed;
+
+        free(job->report.text);
+        free(job->file_name);
+    }
+
+    printf("\nBatch: %lu programs, %ld failed, %lu threads\n", batch.job_count, failed, batch.worker_count);
+
+    for (unsigned long i = 0; i < batch.worker_count; i++)
+        lock_free(&batch.workers[i].deque.lock);
+
+    free(batch.jobs);
+    free(batch.workers);
+    free(list.names);
+
+    return failed;
+}
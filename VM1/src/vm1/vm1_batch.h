@@ -0,0 +1,22 @@
+#ifndef VM1_BATCH_H
+#define VM1_BATCH_H
+
+// Settings every program of a batch is run with
+typedef struct
+{
+    int dispatch;          // VM1_DISPATCH_*, or -1 for the default
+    int use_jit;           // nonzero to compile programs before running
+    unsigned long limit;   // most instructions a program can run, 0 for no limit
+    long output_buffer;    // output buffer size, or -1 for the default
+    unsigned long threads; // worker threads, 0 for one per core
+} batch_options;
+
+// Runs every program listed in path, which is either a manifest
+// with one program file per line, or a directory whose .vbc files
+// are run in name order. Programs are run in parallel, and the
+// results are printed in the order the programs were listed.
+// Returns the number of programs that failed, or -1 if the
+// programs couldn't be listed.
+long batch_run(const char *path, batch_options *options);
+
+#endif
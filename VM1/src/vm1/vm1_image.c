@@ -0,0 +1,252 @@
+// Needed for MAP_ANONYMOUS and memfd_create()
+#define _GNU_SOURCE
+
+#include <stdio.h>  // fopen(), fread(), tmpfile()
+#include <stdlib.h> // malloc(), calloc(), free()
+#include <string.h> // memcpy()
+
+#ifdef _WIN32
+#include <windows.h> // CreateFileMappingA(), MapViewOfFile()
+#else
+#include <fcntl.h>    // open()
+#include <unistd.h>   // close(), dup(), write(), sysconf()
+#include <sys/mman.h> // mmap(), munmap()
+#include <sys/stat.h> // fstat()
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
+#include "..\shared\shared_macros.h"
+
+#include "vm1_image.h"
+
+#ifndef _WIN32
+static unsigned long page_size()
+{
+    return (unsigned long)sysconf(_SC_PAGESIZE);
+}
+#endif
+
+// Reads the file to a buffer, for files that can't be mapped.
+static int read_whole_file(image_file *file, const char *file_name)
+{
+    FILE *input = fopen(file_name, "rb");
+
+    if (input == NULL)
+        return FALSE;
+
+    fseek(input, 0x0, SEEK_END);
+    long length = ftell(input);
+    fseek(input, 0x0, SEEK_SET);
+
+    unsigned char *data = length >= 0 ? malloc(length + 1) : NULL;
+
+    if (data == NULL || (length > 0 && fread(data, length, 1, input) != 1))
+    {
+        free(data);
+        fclose(input);
+        return FALSE;
+    }
+
+    fclose(input);
+
+    file->data = data;
+    file->length = length;
+    return TRUE;
+}
+
+int vm1_image_open(image_file *file, const char *file_name)
+{
+    file->data = NULL;
+    file->length = 0;
+    file->mapped = FALSE;
+    file->fd = -1;
+
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(file_name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER size;
+
+    if (handle == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    if (GetFileSizeEx(handle, &size) && size.QuadPart > 0)
+    {
+        HANDLE mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+
+        if (mapping != NULL)
+        {
+            file->data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+        }
+
+        file->length = (unsigned long)size.QuadPart;
+    }
+
+    CloseHandle(handle);
+#else
+    int fd = open(file_name, O_RDONLY);
+    struct stat info;
+
+    if (fd < 0)
+        return FALSE;
+
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0)
+    {
+        void *data = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+        if (data != MAP_FAILED)
+        {
+            file->data = data;
+            file->fd = fd;
+        }
+
+        file->length = (unsigned long)info.st_size;
+    }
+
+    if (file->fd < 0)
+        close(fd);
+#endif
+
+    if (file->data != NULL)
+    {
+        file->mapped = TRUE;
+        return TRUE;
+    }
+
+    // Empty, or something that can't be mapped
+    return read_whole_file(file, file_name);
+}
+
+void vm1_image_close(image_file *file)
+{
+    if (!file->mapped)
+        free((void *)file->data);
+#ifdef _WIN32
+    else
+        UnmapViewOfFile(file->data);
+#else
+    else
+    {
+        munmap((void *)file->data, file->length);
+        close(file->fd);
+    }
+#endif
+
+    file->data = NULL;
+    file->fd = -1;
+}
+
+int vm1_image_share(image_file *file, const unsigned char *memory, unsigned long length)
+{
+    file->data = NULL;
+    file->length = length;
+    file->mapped = FALSE;
+    file->fd = -1;
+
+#ifdef _WIN32
+    return FALSE;
+#else
+    // Memory backed file on Linux, a deleted temporary file elsewhere
+#ifdef MFD_CLOEXEC
+    int fd = memfd_create("vm1", MFD_CLOEXEC);
+#else
+    FILE *temp = tmpfile();
+    int fd = temp != NULL ? dup(fileno(temp)) : -1;
+
+    if (temp != NULL)
+        fclose(temp);
+#endif
+
+    if (fd < 0)
+        return FALSE;
+
+    for (unsigned long written = 0; written < length;)
+    {
+        long count = write(fd, memory + written, length - written);
+
+        if (count <= 0)
+        {
+            close(fd);
+            return FALSE;
+        }
+
+        written += count;
+    }
+
+    void *data = length > 0 ? mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+
+    if (data == MAP_FAILED)
+    {
+        close(fd);
+        return FALSE;
+    }
+
+    file->data = data;
+    file->fd = fd;
+    file->mapped = TRUE;
+    return TRUE;
+#endif
+}
+
+unsigned char *vm1_image_alloc(unsigned long length, unsigned long *size)
+{
+    *size = 0;
+
+#ifndef _WIN32
+    unsigned long page = page_size();
+
+    // Smaller memory would map a whole page for nothing
+    if (length >= page)
+    {
+        void *memory = mmap(NULL, length / page * page + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (memory == MAP_FAILED)
+            return NULL;
+
+        *size = length / page * page + page;
+        return memory;
+    }
+#endif
+
+    return calloc(length + 1, sizeof(char));
+}
+
+void vm1_image_free(unsigned char *memory, unsigned long size)
+{
+#ifndef _WIN32
+    if (size > 0)
+    {
+        munmap(memory, size);
+        return;
+    }
+#endif
+
+    free(memory);
+}
+
+void vm1_image_fill(unsigned char *memory, unsigned long size, const image_file *file,
+                unsigned long offset, unsigned long loc, unsigned long length)
+{
+    // Part of loc to loc + length that's mapped
+    unsigned long start = loc, end = loc;
+
+#ifndef _WIN32
+    unsigned long page = page_size();
+
+    if (size > 0 && file->fd >= 0 && offset % page == loc % page)
+    {
+        start = (loc + page - 1) / page * page;
+        end = (loc + length) / page * page;
+
+        // MAP_FIXED replaces the zero pages that were there
+        if (start >= end ||
+            mmap(memory + start, end - start, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                 file->fd, offset + (start - loc)) == MAP_FAILED)
+            start = end = loc;
+    }
+#endif
+
+    memcpy(memory + loc, file->data + offset, start - loc);
+    memcpy(memory + end, file->data + offset + (end - loc), loc + length - end);
+}
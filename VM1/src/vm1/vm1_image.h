@@ -0,0 +1,46 @@
+#ifndef VM1_IMAGE_H
+#define VM1_IMAGE_H
+
+// Program files mapped to memory, and the memory of virtual machines
+// loaded from them. Whole pages of a program are mapped from the
+// file copy-on-write instead of copied, so every virtual machine
+// and process running the same file shares them until SMR writes
+// to one. Windows builds copy the pages.
+
+typedef struct
+{
+    const unsigned char *data;
+    unsigned long length;
+    int mapped; // FALSE when data was read to a buffer
+    int fd;     // Kept open to map pages from, -1 on Windows
+} image_file;
+
+// Maps the whole file read only, or reads it when it can't be
+// mapped. Returns 0 if the file can't be read.
+int vm1_image_open(image_file *file, const char *file_name);
+
+void vm1_image_close(image_file *file);
+
+// Writes length bytes of memory to an unnamed file that only lives
+// as long as it is open or mapped, and maps it read only like
+// vm1_image_open(). vm1_image_fill() from it then maps the pages of one
+// virtual machine to others copy-on-write. Returns 0 when there's
+// no such file, always on Windows.
+int vm1_image_share(image_file *file, const unsigned char *memory, unsigned long length);
+
+// Allocates length bytes of memory that start as zero, and a zero
+// byte after them. Memory of a page or more is mapped, so that
+// vm1_image_fill() can map pages of a file into it. Sets size to the
+// length of the mapping, or 0 when the memory is from calloc().
+// Returns NULL when out of memory.
+unsigned char *vm1_image_alloc(unsigned long length, unsigned long *size);
+
+void vm1_image_free(unsigned char *memory, unsigned long size);
+
+// Copies length bytes from offset in the file to loc in the memory.
+// Whole pages are mapped instead when the memory is mapped, and
+// offset and loc are as far from the start of a page.
+void vm1_image_fill(unsigned char *memory, unsigned long size, const image_file *file,
+                unsigned long offset, unsigned long loc, unsigned long length);
+
+#endif
@@ -0,0 +1,216 @@
+#ifndef VM1_INTERNAL_H
+#define VM1_INTERNAL_H
+
+#include <stdint.h> // uint16_t, uint32_t
+#include <setjmp.h> // jmp_buf
+#include <stdio.h>  // FILE
+
+#include "vm1.h"
+#include "vm1_image.h"
+
+// Instruction set
+enum
+{
+    I_END,
+    I_JUMP,
+    I_POSITIVE_BRANCH,
+    I_NEGATIVE_BRANCH,
+    I_ADDITION,
+    I_SUBTRACTION,
+    I_MULTIPLICATION,
+    I_DIVISION,
+    I_REMAINDER,
+    I_SET_REG_VAL,
+    I_SET_REG_REG,
+    I_SET_REG_MEM,
+    I_SET_MEM_REG,
+    I_IS_EQUAL,
+    I_IS_LESS_THAN,
+    I_IS_MORE_THAN,
+    I_IS_LESS_OR_EQUAL_TO,
+    I_IS_MORE_OR_EQUAL_TO,
+    I_OUT,
+
+    // Register plus offset addressing, 16bit values and 32bit values
+    // in a pair of registers
+    I_LOAD_DOUBLE,
+    I_STORE_DOUBLE,
+    I_LOAD_QUAD,
+    I_STORE_QUAD
+};
+
+// Superinstructions. Only found in decoded programs, where each one
+// replaces the first of two instructions and does the work of both.
+// The second instruction is kept right after it, so jumps to the
+// second instruction still work.
+enum
+{
+    // Compare, and PBR or NBR on the flag the compare sets
+    S_IS_EQUAL_BRANCH = 0x80,
+    S_IS_LESS_THAN_BRANCH,
+    S_IS_MORE_THAN_BRANCH,
+    S_IS_LESS_OR_EQUAL_TO_BRANCH,
+    S_IS_MORE_OR_EQUAL_TO_BRANCH,
+
+    // SRV, and ADD or SUB that uses the value
+    S_ADD_VAL,
+    S_SUB_VAL,
+
+    // SRV, and OUT of the same register
+    S_OUT_VAL
+};
+
+// Only found in programs decoded again after they wrote over their
+// own code, in place of an instruction that failed verification.
+// Running it stops the program with the problems.
+enum
+{
+    P_TRAP = 0xF0
+};
+
+// Instruction with its operands already read from the memory.
+// 16 bytes, so four of them fit in a cache line.
+//
+// Superinstructions keep the operands of their first instruction,
+// and take the rest from the second one:
+//   compare and branch: value is 1 for PBR and 0 for NBR, target
+//                       is the target of the branch
+//   SRV and ADD or SUB: reg2 is the register added to
+//   SRV and OUT:        reg2 is the format
+typedef struct
+{
+    unsigned char op;     // op code, superinstruction or P_TRAP
+    unsigned char reg1;   // first register, or the flag of a branch
+    unsigned char reg2;   // second register, or the format of an output
+    unsigned char length; // length in memory, in bytes
+    uint16_t value;       // 16bit value, the memory location of SMR or an offset
+    unsigned char code;   // op code in memory, even for superinstructions, or P_TRAP
+    uint32_t loc;         // memory location the instruction was decoded from
+    uint32_t target;      // instruction index of a jump or branch target
+} instruction;
+
+// Not a flag, see flag_op
+#define FLAGS_FROM_RESULT (F_COUNT + 1)
+
+#define CACHE_LINE 64
+#define NO_INSTRUCTION UINT32_MAX
+
+// Longest text a single OUT writes, 16 binary digits
+#define OUT_MAX_LENGTH 16
+
+// Room for the error messages of a single load or run
+#define VM1_ERROR_LEN 1024
+
+// Virtual machine state
+struct vm1_state
+{
+    // Memory, see vm1_image_alloc() for memory_size
+    unsigned char *memory;
+    unsigned long memory_len;
+    unsigned long memory_size;
+
+    // Memory as it was at the last vm1_fork(), which every fork
+    // maps copy-on-write. Only kept until the memory can change.
+    image_file fork_base;
+    int has_fork_base;
+
+    // Registers
+    uint16_t registers[R_COUNT];
+
+    // Flags aren't stored one by one. Only the operation that last
+    // updated them and its result are recorded, and every flag is
+    // worked out from those when it is read.
+    //
+    // flag_op is either the flag that is set when flag_result isn't
+    // zero, FLAGS_FROM_RESULT when flags follow the value in
+    // flag_result like after update_flags(), or F_COUNT when no
+    // flag is set.
+    unsigned char flag_op;
+    uint16_t flag_result;
+
+    // Decoded program
+    instruction *instructions;
+    uint32_t instruction_count;
+
+    // Instruction index for every memory location where a decoded
+    // instruction starts, NO_INSTRUCTION elsewhere.
+    uint32_t *instruction_at;
+
+    // Nonzero for every memory location that belongs to a decoded
+    // instruction. Writing to those with SMR means the program
+    // modified its own code, and it has to be decoded again.
+    unsigned char *code_map;
+
+    // Number of virtual machines sharing the decoded program with
+    // this one, itself included, NULL when nothing is shared. Forks
+    // share it until they decode again, and the last one frees it.
+    long *decoded_refs;
+
+    // Checksum of the loaded program. Snapshots record it, and are
+    // only restored over the program they were taken from.
+    uint32_t program_crc;
+
+    // Program counter, index of the next decoded instruction
+    uint32_t index;
+
+    // Nonzero once the program has reached END or failed
+    int ended;
+
+    // Settings
+    int dispatch;
+    int use_jit;
+
+    // Most instructions and microseconds a single vm1_run() can
+    // take, zero for no limit
+    unsigned long budget;
+    unsigned long time_slice;
+
+    // Execution counts when profiling, see vm1_profile.h
+    int profiling;
+    struct vm1_profile *profile;
+
+    // Executed instructions are written here when tracing
+    FILE *trace;
+
+    // Source lines of the program, see vm1_map.h. map_embedded is
+    // nonzero when it came in the program file, and goes with it.
+    struct vm1_map *map;
+    int map_embedded;
+
+    // Output of OUT is collected to output_buffer, and sent to
+    // output once output_size bytes are waiting. The buffer has
+    // OUT_MAX_LENGTH bytes of extra room, so a single OUT always fits.
+    vm1_output_function output;
+    void *output_data;
+    int output_fd;
+    char *output_buffer;
+    unsigned long output_len;
+    unsigned long output_size;
+
+    // vm1_error() jumps here, set by vm1_load() and vm1_run()
+    jmp_buf error_jump;
+    char error[VM1_ERROR_LEN];
+    unsigned long error_len;
+};
+
+// Adds the message to the error messages, and stops the load or run
+// in progress.
+void vm1_error(vm1_state *vm, char *message);
+
+// Like vm1_error(), for a problem with the instruction in loc. The
+// message gets the location, and its source line when there's a map.
+void vm1_error_at(vm1_state *vm, unsigned long loc, char *message);
+
+// Returns flag in given index.
+unsigned char vm1_flag_get(vm1_state *vm, unsigned char flag);
+
+// Sets flag, and clears every other flag.
+void vm1_flag_set(vm1_state *vm, unsigned char flag);
+
+// Writes value in given output format to the output buffer.
+void vm1_out(vm1_state *vm, uint16_t value, unsigned char format);
+
+// Sends everything in the output buffer to the output.
+void vm1_output_flush(vm1_state *vm);
+
+#endif
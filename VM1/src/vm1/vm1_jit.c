@@ -0,0 +1,713 @@
+// Needed for MAP_ANONYMOUS
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h> // malloc(), free()
+#include <stdint.h> // uint16_t, uint32_t, uint64_t, uintptr_t
+
+#include "..\shared\shared_macros.h"
+
+#include "vm1_internal.h"
+#include "vm1_jit.h"
+
+#ifdef HAS_JIT
+
+#ifdef _WIN32
+#include <windows.h> // VirtualAlloc(), VirtualProtect(), VirtualFree()
+#else
+#include <sys/mman.h> // mmap(), mprotect(), munmap()
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
+
+// Returned by the compiled code when it reached END
+#define JIT_END UINT32_MAX
+
+// Largest machine code emitted for a single instruction, and for
+// the prologue and epilogue, in bytes.
+#define JIT_MAX_INSTRUCTION 80
+#define JIT_MAX_FRAME 128
+
+// Lower 3 bits of the host register that keeps the VM register.
+// Registers are kept in r12w - r15w, which always need a REX prefix.
+#define HOST(reg) (4 + (reg))
+
+// State shared with the compiled code. The prologue and epilogue
+// depend on the offsets of the fields.
+typedef struct
+{
+    uint16_t registers[R_COUNT]; // offset 0
+    uint32_t flag;               // offset 8, index of the set flag or F_COUNT
+    unsigned char *memory;       // offset 16
+} jit_state;
+
+// Compiled code returns the memory location where the interpreter
+// has to continue, or JIT_END.
+typedef uint32_t (*jit_function)(jit_state *state);
+
+// Locations of 32bit jump offsets, and the instruction indexes they
+// jump to. Filled in after every instruction has been compiled.
+typedef struct
+{
+    unsigned long loc;
+    uint32_t target;
+} jit_patch;
+
+// Compiler state, one for every compiled program
+typedef struct
+{
+    vm1_state *vm;
+
+    // Machine code
+    unsigned char *code;
+    unsigned long code_len;
+
+    // Location of the epilogue in code
+    unsigned long exit_loc;
+
+    // Location of every decoded instruction in code
+    unsigned long *native_at;
+
+    jit_patch *patches;
+    uint32_t patches_len;
+} jit_compiler;
+
+static void emit(jit_compiler *jit, unsigned char byte)
+{
+    jit->code[jit->code_len++] = byte;
+}
+
+static void emit_32bit(jit_compiler *jit, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        emit(jit, value >> (i * 8));
+}
+
+static void emit_64bit(jit_compiler *jit, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+        emit(jit, value >> (i * 8));
+}
+
+static void emit_rel32(jit_compiler *jit, unsigned long target)
+{
+    emit_32bit(jit, (uint32_t)(target - (jit->code_len + 4)));
+}
+
+// Offset to a decoded instruction, filled in later.
+static void emit_branch(jit_compiler *jit, uint32_t target)
+{
+    jit->patches[jit->patches_len].loc = jit->code_len;
+    jit->patches[jit->patches_len].target = target;
+    jit->patches_len++;
+
+    emit_32bit(jit, 0);
+}
+
+// Leaves the compiled code, and continues from memory location loc
+// in the interpreter. Always 10 bytes.
+static void emit_exit(jit_compiler *jit, uint32_t loc)
+{
+    emit(jit, 0xB8); // mov eax, loc
+    emit_32bit(jit, loc);
+    emit(jit, 0xE9); // jmp exit
+    emit_rel32(jit, jit->exit_loc);
+}
+
+// Sets the flag from the value of the host register reg, like
+// update_flags(). F_ZERO is 0 and F_POSITIVE 1, so the flag is
+// the result of setnz. F_NEGATIVE is never set by update_flags(),
+// since a 16bit register is never below zero.
+static void emit_update_flags(jit_compiler *jit, unsigned char reg)
+{
+    emit(jit, 0x31); // xor ebx, ebx
+    emit(jit, 0xDB);
+
+    emit(jit, 0x66); // test reg, reg
+    emit(jit, 0x45);
+    emit(jit, 0x85);
+    emit(jit, 0xC0 | reg << 3 | reg);
+
+    emit(jit, 0x0F); // setnz bl
+    emit(jit, 0x95);
+    emit(jit, 0xC3);
+}
+
+// Emits 16bit operation between two host registers.
+static void emit_reg_reg(jit_compiler *jit, unsigned char op, unsigned char dst, unsigned char src)
+{
+    emit(jit, 0x66);
+    emit(jit, 0x45);
+    emit(jit, op);
+    emit(jit, 0xC0 | src << 3 | dst);
+}
+
+// Compare instructions set the flag to flag if condition code
+// cc is true, and clear it otherwise.
+static void emit_compare(jit_compiler *jit, unsigned char reg1, unsigned char reg2, unsigned char cc, unsigned char flag)
+{
+    emit_reg_reg(jit, 0x39, reg1, reg2); // cmp reg1, reg2
+
+    emit(jit, 0xBB); // mov ebx, F_COUNT
+    emit_32bit(jit, F_COUNT);
+    emit(jit, 0xB8); // mov eax, flag
+    emit_32bit(jit, flag);
+
+    emit(jit, 0x0F); // cmovcc ebx, eax
+    emit(jit, 0x40 | cc);
+    emit(jit, 0xD8);
+}
+
+// Leaves the memory location of a load or a store in eax: the
+// second register plus the offset, in 16 bits. Accesses that don't
+// fit in the memory are left to the interpreter, and so are stores
+// that write over code.
+static void emit_offset_address(jit_compiler *jit, instruction *ins, unsigned long width, int store)
+{
+    unsigned long memory_len = jit->vm->memory_len;
+
+    emit(jit, 0x41); // movzx eax, reg2
+    emit(jit, 0x0F);
+    emit(jit, 0xB7);
+    emit(jit, 0xC0 | HOST(ins->reg2));
+
+    emit(jit, 0x66); // add ax, offset
+    emit(jit, 0x05);
+    emit(jit, ins->value);
+    emit(jit, ins->value >> 8);
+
+    emit(jit, 0x3D); // cmp eax, last location that fits + 1
+    emit_32bit(jit, memory_len >= width ? memory_len - width + 1 : 0);
+    emit(jit, 0x72); // jb over the exit
+    emit(jit, 0x0A);
+    emit_exit(jit, ins->loc);
+
+    if (!store)
+        return;
+
+    emit(jit, 0x48); // mov rcx, code_map
+    emit(jit, 0xB9);
+    emit_64bit(jit, (uint64_t)(uintptr_t)jit->vm->code_map);
+
+    if (width == 2)
+        emit(jit, 0x66); // cmp word [rcx + rax], 0
+    emit(jit, 0x83);     // cmp dword [rcx + rax], 0
+    emit(jit, 0x3C);
+    emit(jit, 0x01);
+    emit(jit, 0x00);
+
+    emit(jit, 0x74); // je over the exit
+    emit(jit, 0x0A);
+    emit_exit(jit, ins->loc);
+}
+
+static void emit_prologue(jit_compiler *jit)
+{
+    // push rbx, rbp, r12, r13, r14, r15
+    emit(jit, 0x53);
+    emit(jit, 0x55);
+    emit(jit, 0x41);
+    emit(jit, 0x54);
+    emit(jit, 0x41);
+    emit(jit, 0x55);
+    emit(jit, 0x41);
+    emit(jit, 0x56);
+    emit(jit, 0x41);
+    emit(jit, 0x57);
+
+    // sub rsp, 40. Keeps the stack aligned to 16 bytes for calls,
+    // with room for the shadow space on Windows and the state
+    // pointer at rsp + 32.
+    emit(jit, 0x48);
+    emit(jit, 0x83);
+    emit(jit, 0xEC);
+    emit(jit, 0x28);
+
+#ifdef _WIN32
+    unsigned char arg = 1; // rcx
+#else
+    unsigned char arg = 7; // rdi
+#endif
+
+    emit(jit, 0x48); // mov [rsp + 32], arg
+    emit(jit, 0x89);
+    emit(jit, 0x44 | arg << 3);
+    emit(jit, 0x24);
+    emit(jit, 0x20);
+
+    emit(jit, 0x48); // mov rax, arg
+    emit(jit, 0x89);
+    emit(jit, 0xC0 | arg << 3);
+
+    // movzx r12d - r15d, word [rax + offset]
+    for (int reg = 0; reg < R_COUNT; reg++)
+    {
+        emit(jit, 0x44);
+        emit(jit, 0x0F);
+        emit(jit, 0xB7);
+        emit(jit, 0x40 | HOST(reg) << 3);
+        emit(jit, reg * 2);
+    }
+
+    emit(jit, 0x8B); // mov ebx, [rax + 8]
+    emit(jit, 0x58);
+    emit(jit, 0x08);
+
+    emit(jit, 0x48); // mov rbp, [rax + 16]
+    emit(jit, 0x8B);
+    emit(jit, 0x68);
+    emit(jit, 0x10);
+}
+
+// Writes registers and the flag back to the state, and returns
+// the value in eax.
+static void emit_epilogue(jit_compiler *jit)
+{
+    jit->exit_loc = jit->code_len;
+
+    emit(jit, 0x48); // mov rcx, [rsp + 32]
+    emit(jit, 0x8B);
+    emit(jit, 0x4C);
+    emit(jit, 0x24);
+    emit(jit, 0x20);
+
+    // mov [rcx + offset], r12w - r15w
+    for (int reg = 0; reg < R_COUNT; reg++)
+    {
+        emit(jit, 0x66);
+        emit(jit, 0x44);
+        emit(jit, 0x89);
+        emit(jit, 0x41 | HOST(reg) << 3);
+        emit(jit, reg * 2);
+    }
+
+    emit(jit, 0x89); // mov [rcx + 8], ebx
+    emit(jit, 0x59);
+    emit(jit, 0x08);
+
+    emit(jit, 0x48); // add rsp, 40
+    emit(jit, 0x83);
+    emit(jit, 0xC4);
+    emit(jit, 0x28);
+
+    // pop r15, r14, r13, r12, rbp, rbx
+    emit(jit, 0x41);
+    emit(jit, 0x5F);
+    emit(jit, 0x41);
+    emit(jit, 0x5E);
+    emit(jit, 0x41);
+    emit(jit, 0x5D);
+    emit(jit, 0x41);
+    emit(jit, 0x5C);
+    emit(jit, 0x5D);
+    emit(jit, 0x5B);
+
+    emit(jit, 0xC3); // ret
+}
+
+static void compile_instruction(jit_compiler *jit, instruction *ins)
+{
+    unsigned char
+        reg1 = HOST(ins->reg1),
+        reg2 = HOST(ins->reg2);
+
+    // Superinstructions are compiled as their first instruction,
+    // the second one follows anyway.
+    switch (ins->code)
+    {
+    case I_END:
+        emit_exit(jit, JIT_END);
+        break;
+
+    case I_JUMP:
+        emit(jit, 0xE9); // jmp target
+        emit_branch(jit, ins->target);
+        break;
+
+    case I_POSITIVE_BRANCH:
+    case I_NEGATIVE_BRANCH:
+        emit(jit, 0x83); // cmp ebx, flag
+        emit(jit, 0xFB);
+        emit(jit, ins->reg1);
+
+        emit(jit, 0x0F); // je / jne target
+        emit(jit, ins->code == I_POSITIVE_BRANCH ? 0x84 : 0x85);
+        emit_branch(jit, ins->target);
+        break;
+
+    case I_ADDITION:
+        emit_reg_reg(jit, 0x01, reg1, reg2); // add reg1, reg2
+        emit_update_flags(jit, reg1);
+        break;
+
+    case I_SUBTRACTION:
+        emit_reg_reg(jit, 0x29, reg1, reg2); // sub reg1, reg2
+        emit_update_flags(jit, reg1);
+        break;
+
+    case I_MULTIPLICATION:
+        emit(jit, 0x66); // imul reg1, reg2
+        emit(jit, 0x45);
+        emit(jit, 0x0F);
+        emit(jit, 0xAF);
+        emit(jit, 0xC0 | reg1 << 3 | reg2);
+        emit_update_flags(jit, reg1);
+        break;
+
+    case I_DIVISION:
+    case I_REMAINDER:
+        emit(jit, 0x41); // movzx eax, reg1
+        emit(jit, 0x0F);
+        emit(jit, 0xB7);
+        emit(jit, 0xC0 | reg1);
+
+        emit(jit, 0x41); // movzx ecx, reg2
+        emit(jit, 0x0F);
+        emit(jit, 0xB7);
+        emit(jit, 0xC8 | reg2);
+
+        // Division by zero is left to the interpreter
+        emit(jit, 0x85); // test ecx, ecx
+        emit(jit, 0xC9);
+        emit(jit, 0x75); // jnz over the exit
+        emit(jit, 0x0A);
+        emit_exit(jit, ins->loc);
+
+        emit(jit, 0x31); // xor edx, edx
+        emit(jit, 0xD2);
+        emit(jit, 0xF7); // div ecx
+        emit(jit, 0xF1);
+
+        emit(jit, 0x66); // mov reg1, ax / dx
+        emit(jit, 0x41);
+        emit(jit, 0x89);
+        emit(jit, (ins->code == I_DIVISION ? 0xC0 : 0xD0) | reg1);
+        emit_update_flags(jit, reg1);
+        break;
+
+    case I_SET_REG_VAL:
+        emit(jit, 0x66); // mov reg1, value
+        emit(jit, 0x41);
+        emit(jit, 0xB8 | reg1);
+        emit(jit, ins->value);
+        emit(jit, ins->value >> 8);
+
+        emit(jit, 0xBB); // mov ebx, flag
+        emit_32bit(jit, ins->value != 0 ? F_POSITIVE : F_ZERO);
+        break;
+
+    case I_SET_REG_REG:
+        emit_reg_reg(jit, 0x89, reg1, reg2); // mov reg1, reg2
+        emit_update_flags(jit, reg1);
+        break;
+
+    case I_SET_REG_MEM:
+        emit(jit, 0x41); // movzx eax, reg2
+        emit(jit, 0x0F);
+        emit(jit, 0xB7);
+        emit(jit, 0xC0 | reg2);
+
+        // Memory access out of bounds is left to the interpreter
+        if (jit->vm->memory_len <= UINT16_MAX)
+        {
+            emit(jit, 0x3D); // cmp eax, memory_len
+            emit_32bit(jit, jit->vm->memory_len);
+            emit(jit, 0x72); // jb over the exit
+            emit(jit, 0x0A);
+            emit_exit(jit, ins->loc);
+        }
+
+        emit(jit, 0x0F); // movzx eax, byte [rbp + rax]
+        emit(jit, 0xB6);
+        emit(jit, 0x44);
+        emit(jit, 0x05);
+        emit(jit, 0x00);
+
+        emit(jit, 0x66); // mov reg1, ax
+        emit(jit, 0x41);
+        emit(jit, 0x89);
+        emit(jit, 0xC0 | reg1);
+        emit_update_flags(jit, reg1);
+        break;
+
+    case I_SET_MEM_REG:
+        // Writing over code is left to the interpreter, since it
+        // has to decode the program again.
+        if (jit->vm->code_map[ins->value])
+        {
+            emit_exit(jit, ins->loc);
+            break;
+        }
+
+        emit(jit, 0x44); // mov [rbp + value], reg1 low byte
+        emit(jit, 0x88);
+        emit(jit, 0x85 | reg1 << 3);
+        emit_32bit(jit, ins->value);
+        emit_update_flags(jit, reg1);
+        break;
+
+    case I_LOAD_DOUBLE:
+        emit_offset_address(jit, ins, 2, FALSE);
+
+        emit(jit, 0x0F); // movzx eax, word [rbp + rax]
+        emit(jit, 0xB7);
+        emit(jit, 0x44);
+        emit(jit, 0x05);
+        emit(jit, 0x00);
+
+        emit(jit, 0x66); // mov reg1, ax
+        emit(jit, 0x41);
+        emit(jit, 0x89);
+        emit(jit, 0xC0 | reg1);
+        emit_update_flags(jit, reg1);
+        break;
+
+    case I_LOAD_QUAD:
+        emit_offset_address(jit, ins, 4, FALSE);
+
+        emit(jit, 0x8B); // mov eax, [rbp + rax]
+        emit(jit, 0x44);
+        emit(jit, 0x05);
+        emit(jit, 0x00);
+
+        emit(jit, 0x66); // mov reg1, ax
+        emit(jit, 0x41);
+        emit(jit, 0x89);
+        emit(jit, 0xC0 | reg1);
+
+        emit(jit, 0x31); // xor ebx, ebx
+        emit(jit, 0xDB);
+        emit(jit, 0x85); // test eax, eax
+        emit(jit, 0xC0);
+        emit(jit, 0x0F); // setnz bl
+        emit(jit, 0x95);
+        emit(jit, 0xC3);
+
+        emit(jit, 0xC1); // shr eax, 16
+        emit(jit, 0xE8);
+        emit(jit, 0x10);
+
+        emit(jit, 0x66); // mov register after reg1, ax
+        emit(jit, 0x41);
+        emit(jit, 0x89);
+        emit(jit, 0xC0 | HOST(ins->reg1 + 1));
+        break;
+
+    case I_STORE_DOUBLE:
+        emit_offset_address(jit, ins, 2, TRUE);
+
+        emit(jit, 0x66); // mov [rbp + rax], reg1
+        emit(jit, 0x44);
+        emit(jit, 0x89);
+        emit(jit, 0x44 | reg1 << 3);
+        emit(jit, 0x05);
+        emit(jit, 0x00);
+        emit_update_flags(jit, reg1);
+        break;
+
+    case I_STORE_QUAD:
+        emit_offset_address(jit, ins, 4, TRUE);
+
+        emit(jit, 0x41); // movzx edx, register after reg1
+        emit(jit, 0x0F);
+        emit(jit, 0xB7);
+        emit(jit, 0xD0 | HOST(ins->reg1 + 1));
+
+        emit(jit, 0xC1); // shl edx, 16
+        emit(jit, 0xE2);
+        emit(jit, 0x10);
+
+        emit(jit, 0x41); // movzx ecx, reg1
+        emit(jit, 0x0F);
+        emit(jit, 0xB7);
+        emit(jit, 0xC8 | reg1);
+
+        emit(jit, 0x09); // or edx, ecx
+        emit(jit, 0xCA);
+
+        emit(jit, 0x89); // mov [rbp + rax], edx
+        emit(jit, 0x54);
+        emit(jit, 0x05);
+        emit(jit, 0x00);
+
+        emit(jit, 0x31); // xor ebx, ebx
+        emit(jit, 0xDB);
+        emit(jit, 0x85); // test edx, edx
+        emit(jit, 0xD2);
+        emit(jit, 0x0F); // setnz bl
+        emit(jit, 0x95);
+        emit(jit, 0xC3);
+        break;
+
+    // Condition codes: e, b, a, be, ae
+    case I_IS_EQUAL:
+        emit_compare(jit, reg1, reg2, 0x4, F_EQUAL);
+        break;
+    case I_IS_LESS_THAN:
+        emit_compare(jit, reg1, reg2, 0x2, F_LESS_THAN);
+        break;
+    case I_IS_MORE_THAN:
+        emit_compare(jit, reg1, reg2, 0x7, F_MORE_THAN);
+        break;
+    case I_IS_LESS_OR_EQUAL_TO:
+        emit_compare(jit, reg1, reg2, 0x6, F_LESS_OR_EQUAL_TO);
+        break;
+    case I_IS_MORE_OR_EQUAL_TO:
+        emit_compare(jit, reg1, reg2, 0x3, F_MORE_OR_EQUAL_TO);
+        break;
+
+    case I_OUT:
+#ifdef _WIN32
+        emit(jit, 0x48); // mov rcx, vm
+        emit(jit, 0xB9);
+        emit_64bit(jit, (uint64_t)(uintptr_t)jit->vm);
+        emit(jit, 0x41); // movzx edx, reg1
+        emit(jit, 0x0F);
+        emit(jit, 0xB7);
+        emit(jit, 0xD0 | reg1);
+        emit(jit, 0x41); // mov r8d, format
+        emit(jit, 0xB8);
+#else
+        emit(jit, 0x48); // mov rdi, vm
+        emit(jit, 0xBF);
+        emit_64bit(jit, (uint64_t)(uintptr_t)jit->vm);
+        emit(jit, 0x41); // movzx esi, reg1
+        emit(jit, 0x0F);
+        emit(jit, 0xB7);
+        emit(jit, 0xF0 | reg1);
+        emit(jit, 0xBA); // mov edx, format
+#endif
+        emit_32bit(jit, ins->reg2);
+
+        emit(jit, 0x48); // mov rax, vm1_out
+        emit(jit, 0xB8);
+        emit_64bit(jit, (uint64_t)(uintptr_t)&vm1_out);
+        emit(jit, 0xFF); // call rax
+        emit(jit, 0xD0);
+        break;
+
+    default:
+        // Anything else runs in the interpreter
+        emit_exit(jit, ins->loc);
+        break;
+    }
+}
+
+// Executable memory
+
+static unsigned char *code_alloc(unsigned long size)
+{
+#ifdef _WIN32
+    return VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+    void *block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    return block == MAP_FAILED ? NULL : block;
+#endif
+}
+
+// Makes the code executable. Code is never writable and
+// executable at the same time.
+static int code_protect(unsigned char *block, unsigned long size)
+{
+#ifdef _WIN32
+    DWORD old;
+    return VirtualProtect(block, size, PAGE_EXECUTE_READ, &old) != 0;
+#else
+    return mprotect(block, size, PROT_READ | PROT_EXEC) == 0;
+#endif
+}
+
+static void code_free(unsigned char *block, unsigned long size)
+{
+#ifdef _WIN32
+    VirtualFree(block, 0, MEM_RELEASE);
+#else
+    munmap(block, size);
+#endif
+}
+
+int vm1_jit_run(vm1_state *vm)
+{
+    jit_compiler compiler, *jit = &compiler;
+    unsigned long size = vm->instruction_count * JIT_MAX_INSTRUCTION + JIT_MAX_FRAME;
+
+    jit->vm = vm;
+    jit->code = code_alloc(size);
+    jit->code_len = 0;
+
+    jit->native_at = malloc(sizeof(unsigned long) * vm->instruction_count);
+    jit->patches = malloc(sizeof(jit_patch) * (vm->instruction_count + 1));
+    jit->patches_len = 0;
+
+    if (jit->code == NULL || jit->native_at == NULL || jit->patches == NULL)
+    {
+        if (jit->code != NULL)
+            code_free(jit->code, size);
+        free(jit->native_at);
+        free(jit->patches);
+
+        return 1;
+    }
+
+    // Prologue jumps over the epilogue to the first instruction
+    emit_prologue(jit);
+    emit(jit, 0xE9);
+    emit_branch(jit, vm->index);
+    emit_epilogue(jit);
+
+    for (uint32_t i = 0; i < vm->instruction_count; i++)
+    {
+        jit->native_at[i] = jit->code_len;
+        compile_instruction(jit, &vm->instructions[i]);
+    }
+
+    for (uint32_t i = 0; i < jit->patches_len; i++)
+    {
+        unsigned long loc = jit->patches[i].loc;
+        uint32_t offset = jit->native_at[jit->patches[i].target] - (loc + 4);
+
+        for (int byte = 0; byte < 4; byte++)
+            jit->code[loc + byte] = offset >> (byte * 8);
+    }
+
+    free(jit->native_at);
+    free(jit->patches);
+
+    if (!code_protect(jit->code, size))
+    {
+        code_free(jit->code, size);
+
+        return 1;
+    }
+
+    // Running
+    jit_state state;
+
+    for (int reg = 0; reg < R_COUNT; reg++)
+        state.registers[reg] = vm->registers[reg];
+
+    state.flag = F_COUNT;
+    for (int flag = F_COUNT - 1; flag >= 0; flag--)
+        if (vm1_flag_get(vm, flag))
+            state.flag = flag;
+
+    state.memory = vm->memory;
+
+    uint32_t loc = ((jit_function)jit->code)(&state);
+
+    code_free(jit->code, size);
+
+    for (int reg = 0; reg < R_COUNT; reg++)
+        vm->registers[reg] = state.registers[reg];
+
+    vm1_flag_set(vm, state.flag);
+
+    if (loc == JIT_END)
+        return 0;
+
+    vm->index = vm->instruction_at[loc];
+    return 1;
+}
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef VM1_JIT_H
+#define VM1_JIT_H
+
+// The JIT emits x86-64 machine code, other targets only have the
+// interpreter.
+#if defined(__x86_64__) || defined(_M_X64)
+#define HAS_JIT
+#endif
+
+#ifdef HAS_JIT
+
+#include "vm1_internal.h"
+
+// Compiles the decoded program of vm to machine code and runs it
+// from the instruction index in vm->index. Registers and flags are
+// written back when the compiled code stops.
+// Returns 0 when the program reached END, and 1 when the
+// interpreter has to continue from vm->index. Instructions the
+// compiled code can't handle, like SMR writing over code, are left
+// to the interpreter this way, and so is the whole program when
+// there is no memory for the compiled code.
+int vm1_jit_run(vm1_state *vm);
+
+#endif
+
+#endif
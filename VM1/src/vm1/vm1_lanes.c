@@ -0,0 +1,503 @@
+#include <stdint.h> // uint16_t, uint32_t, uint64_t
+#include <string.h> // memcpy(), memset()
+
+#include "..\shared\shared_macros.h"
+
+#include "vm1_lanes.h"
+#include "vm1_internal.h"
+
+#ifdef HAS_LANES
+
+// Vectors are returned, but passed by pointer. Their calling
+// convention depends on AVX, and only functions of this file use it.
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+// 16bit value of every lane
+typedef uint16_t lane_vector __attribute__((vector_size(LANES * sizeof(uint16_t))));
+
+// Masks are lane vectors with every bit of a lane set, or none.
+// Comparisons give them.
+#define MASK(comparison) ((lane_vector)(comparison))
+
+// first in the lanes of mask, and second in the others
+#define BLEND(mask, first, second) (((first) & (mask)) | ((second) & ~(mask)))
+
+typedef struct
+{
+    vm1_state *vms[LANES];
+    unsigned char *alone;
+
+    // Registers and flags of every lane, see vm1_state
+    lane_vector registers[R_COUNT];
+    lane_vector flag_op;
+    lane_vector flag_result;
+
+    // Program counter of every lane. Lanes with the same one run
+    // together, and only write theirs here when they stop.
+    uint32_t index[LANES];
+
+    // Lanes that haven't ended or been left alone
+    lane_vector live;
+} lanes;
+
+// Returns value in every lane.
+static lane_vector splat(uint16_t value)
+{
+    lane_vector vector = {0};
+
+    return vector + value;
+}
+
+// Returns 1 if any lane of mask is set.
+static int any(const lane_vector *mask)
+{
+    // Compilers test the whole vector at once
+    uint64_t words[sizeof(lane_vector) / sizeof(uint64_t)], bits = 0;
+
+    memcpy(words, mask, sizeof(words));
+
+    for (unsigned long i = 0; i < sizeof(words) / sizeof(uint64_t); i++)
+        bits |= words[i];
+
+    return bits != 0;
+}
+
+// Every flag is worked out like vm1_flag_get() does it, in every lane.
+static lane_vector lanes_flag(lanes *l, unsigned char flag)
+{
+    lane_vector from_result = MASK(l->flag_op == splat(FLAGS_FROM_RESULT));
+    lane_vector by_result = splat(0);
+
+    if (flag == F_ZERO)
+        by_result = MASK(l->flag_result == splat(0));
+    else if (flag == F_POSITIVE)
+        by_result = MASK(l->flag_result > splat(0));
+
+    lane_vector by_op = MASK(l->flag_op == splat(flag)) & MASK(l->flag_result != splat(0));
+
+    return BLEND(from_result, by_result, by_op);
+}
+
+// Sets reg in the lanes of mask, and their flags from it like
+// update_flags().
+static void lanes_set(lanes *l, const lane_vector *mask, unsigned char reg, const lane_vector *value)
+{
+    l->registers[reg] = BLEND(*mask, *value, l->registers[reg]);
+    l->flag_op = BLEND(*mask, splat(FLAGS_FROM_RESULT), l->flag_op);
+    l->flag_result = BLEND(*mask, l->registers[reg], l->flag_result);
+}
+
+// Sets the 32bit value in reg and the register after it in the lanes
+// of mask, and their flags like update_quad_flags().
+static void lanes_set_quad(lanes *l, const lane_vector *mask, unsigned char reg, const lane_vector *low, const lane_vector *high)
+{
+    l->registers[reg] = BLEND(*mask, *low, l->registers[reg]);
+    l->registers[reg + 1] = BLEND(*mask, *high, l->registers[reg + 1]);
+    l->flag_op = BLEND(*mask, splat(FLAGS_FROM_RESULT), l->flag_op);
+    l->flag_result = BLEND(*mask, l->registers[reg] | l->registers[reg + 1], l->flag_result);
+}
+
+// Sets the flags of a compare in the lanes of mask.
+static void lanes_compare(lanes *l, const lane_vector *mask, unsigned char flag, const lane_vector *result)
+{
+    l->flag_op = BLEND(*mask, splat(flag), l->flag_op);
+    l->flag_result = BLEND(*mask, *result & splat(1), l->flag_result);
+}
+
+// Moves the lanes of mask to index.
+static void lanes_move(lanes *l, const lane_vector *mask, uint32_t index)
+{
+    for (int lane = 0; lane < LANES; lane++)
+        if ((*mask)[lane])
+            l->index[lane] = index;
+}
+
+// Writes the lanes of mask back to their virtual machines, which
+// continue from index, and stops running them.
+static void lanes_store(lanes *l, const lane_vector *mask, uint32_t index)
+{
+    for (int lane = 0; lane < LANES; lane++)
+    {
+        if (!(*mask)[lane])
+            continue;
+
+        vm1_state *vm = l->vms[lane];
+
+        for (int reg = 0; reg < R_COUNT; reg++)
+            vm->registers[reg] = l->registers[reg][lane];
+
+        vm->flag_op = l->flag_op[lane];
+        vm->flag_result = l->flag_result[lane];
+        vm->index = index;
+    }
+
+    l->live &= ~*mask;
+}
+
+// Leaves the lanes of mask to run on their own from index.
+static void lanes_leave(lanes *l, const lane_vector *mask, uint32_t index)
+{
+    lanes_store(l, mask, index);
+
+    for (int lane = 0; lane < LANES; lane++)
+        if ((*mask)[lane])
+            l->alone[lane] = TRUE;
+}
+
+// Ends the lanes of mask like compute() does at END.
+static void lanes_end(lanes *l, const lane_vector *mask, uint32_t index)
+{
+    lanes_store(l, mask, index);
+
+    for (int lane = 0; lane < LANES; lane++)
+    {
+        if ((*mask)[lane])
+        {
+            vm1_output_flush(l->vms[lane]);
+            l->vms[lane]->ended = TRUE;
+        }
+    }
+}
+
+int vm1_lanes_compatible(vm1_state *vm1, vm1_state *vm2)
+{
+    if (vm1->memory_len != vm2->memory_len || vm1->instruction_count != vm2->instruction_count)
+        return FALSE;
+
+    // Forks share it
+    if (vm1->instructions == vm2->instructions)
+        return TRUE;
+
+    for (uint32_t i = 0; i < vm1->instruction_count; i++)
+    {
+        instruction *ins1 = &vm1->instructions[i], *ins2 = &vm2->instructions[i];
+
+        if (ins1->code != ins2->code || ins1->loc != ins2->loc || ins1->reg1 != ins2->reg1 ||
+            ins1->reg2 != ins2->reg2 || ins1->value != ins2->value || ins1->target != ins2->target)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+void vm1_lanes_run(vm1_state **vms, unsigned long count, unsigned char *alone)
+{
+    lanes l;
+    memset(&l, 0, sizeof(l));
+
+    l.alone = alone;
+
+    for (unsigned long lane = 0; lane < count; lane++)
+    {
+        vm1_state *vm = vms[lane];
+
+        l.vms[lane] = vm;
+        alone[lane] = FALSE;
+
+        for (int reg = 0; reg < R_COUNT; reg++)
+            l.registers[reg][lane] = vm->registers[reg];
+
+        l.flag_op[lane] = vm->flag_op;
+        l.flag_result[lane] = vm->flag_result;
+        l.index[lane] = vm->index;
+        l.live[lane] = UINT16_MAX;
+    }
+
+    // Every lane has the same decoded program
+    instruction *instructions = vms[0]->instructions;
+    const unsigned char *code_map = vms[0]->code_map;
+    unsigned long memory_len = vms[0]->memory_len;
+
+    lane_vector *registers = l.registers;
+
+    while (any(&l.live))
+    {
+        // Lanes furthest behind run first, and stop once they get
+        // to where the next lanes wait. Lanes that branched apart
+        // meet again where their paths join, and run together from
+        // there.
+        uint32_t index = UINT32_MAX, waiting = UINT32_MAX;
+
+        for (int lane = 0; lane < LANES; lane++)
+            if (l.live[lane] && l.index[lane] < index)
+                index = l.index[lane];
+
+        lane_vector group = splat(0), value, stopped, address, high;
+        unsigned long width;
+
+        for (int lane = 0; lane < LANES; lane++)
+        {
+            if (l.live[lane] && l.index[lane] == index)
+                group[lane] = UINT16_MAX;
+            else if (l.live[lane] && l.index[lane] < waiting)
+                waiting = l.index[lane];
+        }
+
+        // Cleared when the group ends, splits or its last lane leaves
+        int running = TRUE;
+
+        while (running && index < waiting)
+        {
+            instruction *ins = &instructions[index];
+            unsigned char reg1 = ins->reg1, reg2 = ins->reg2;
+
+            // Dispatches on the op code in memory like the counting
+            // engine, superinstructions run as their two instructions
+            switch (ins->code)
+            {
+            case I_END:
+                lanes_end(&l, &group, index + 1);
+                group = splat(0);
+                running = FALSE;
+                continue;
+
+            case I_JUMP:
+                index = ins->target;
+                continue;
+
+            case I_POSITIVE_BRANCH:
+            case I_NEGATIVE_BRANCH:
+                value = lanes_flag(&l, reg1);
+
+                if (ins->code == I_NEGATIVE_BRANCH)
+                    value = ~value;
+
+                value &= group;
+                stopped = group & ~value;
+
+                // Lanes that branch apart are split, and run in turns
+                if (any(&value) && any(&stopped))
+                {
+                    lanes_move(&l, &value, ins->target);
+                    lanes_move(&l, &stopped, index + 1);
+                    group = splat(0);
+                    running = FALSE;
+                    continue;
+                }
+
+                index = any(&value) ? ins->target : index + 1;
+                continue;
+
+            case I_ADDITION:
+                value = registers[reg1] + registers[reg2];
+                lanes_set(&l, &group, reg1, &value);
+                break;
+            case I_SUBTRACTION:
+                value = registers[reg1] - registers[reg2];
+                lanes_set(&l, &group, reg1, &value);
+                break;
+            case I_MULTIPLICATION:
+                value = registers[reg1] * registers[reg2];
+                lanes_set(&l, &group, reg1, &value);
+                break;
+
+            case I_DIVISION:
+            case I_REMAINDER:
+                stopped = group & MASK(registers[reg2] == splat(0));
+
+                if (any(&stopped))
+                {
+                    lanes_leave(&l, &stopped, index);
+                    group &= ~stopped;
+                    running = any(&group);
+                }
+
+                // Lanes that don't divide divide by one
+                value = BLEND(group, registers[reg2], splat(1));
+
+                if (ins->code == I_DIVISION)
+                    value = registers[reg1] / value;
+                else
+                    value = registers[reg1] % value;
+
+                lanes_set(&l, &group, reg1, &value);
+                break;
+
+            case I_SET_REG_VAL:
+                value = splat(ins->value);
+                lanes_set(&l, &group, reg1, &value);
+                break;
+            case I_SET_REG_REG:
+                lanes_set(&l, &group, reg1, &registers[reg2]);
+                break;
+
+            case I_SET_REG_MEM:
+                // Every lane reads its own memory
+                value = registers[reg1];
+                stopped = splat(0);
+
+                for (int lane = 0; lane < LANES; lane++)
+                {
+                    if (!group[lane])
+                        continue;
+
+                    if (registers[reg2][lane] >= memory_len)
+                        stopped[lane] = UINT16_MAX;
+                    else
+                        value[lane] = l.vms[lane]->memory[registers[reg2][lane]];
+                }
+
+                if (any(&stopped))
+                {
+                    lanes_leave(&l, &stopped, index);
+                    group &= ~stopped;
+                    running = any(&group);
+                }
+
+                lanes_set(&l, &group, reg1, &value);
+                break;
+
+            case I_SET_MEM_REG:
+                // Code is the same in every lane
+                if (code_map[ins->value])
+                {
+                    lanes_leave(&l, &group, index);
+                    group = splat(0);
+                    running = FALSE;
+                    continue;
+                }
+
+                for (int lane = 0; lane < LANES; lane++)
+                    if (group[lane])
+                        l.vms[lane]->memory[ins->value] = registers[reg1][lane];
+
+                lanes_set(&l, &group, reg1, &registers[reg1]);
+                break;
+
+            case I_IS_EQUAL:
+                value = MASK(registers[reg1] == registers[reg2]);
+                lanes_compare(&l, &group, F_EQUAL, &value);
+                break;
+            case I_IS_LESS_THAN:
+                value = MASK(registers[reg1] < registers[reg2]);
+                lanes_compare(&l, &group, F_LESS_THAN, &value);
+                break;
+            case I_IS_MORE_THAN:
+                value = MASK(registers[reg1] > registers[reg2]);
+                lanes_compare(&l, &group, F_MORE_THAN, &value);
+                break;
+            case I_IS_LESS_OR_EQUAL_TO:
+                value = MASK(registers[reg1] <= registers[reg2]);
+                lanes_compare(&l, &group, F_LESS_OR_EQUAL_TO, &value);
+                break;
+            case I_IS_MORE_OR_EQUAL_TO:
+                value = MASK(registers[reg1] >= registers[reg2]);
+                lanes_compare(&l, &group, F_MORE_OR_EQUAL_TO, &value);
+                break;
+
+            case I_LOAD_DOUBLE:
+            case I_LOAD_QUAD:
+                // Every lane reads its own memory, from its own address
+                width = ins->code == I_LOAD_QUAD ? 4 : 2;
+                address = registers[reg2] + splat(ins->value);
+                value = registers[reg1];
+                high = splat(0);
+                stopped = splat(0);
+
+                for (int lane = 0; lane < LANES; lane++)
+                {
+                    if (!group[lane])
+                        continue;
+
+                    if (address[lane] + width > memory_len)
+                    {
+                        stopped[lane] = UINT16_MAX;
+                        continue;
+                    }
+
+                    const unsigned char *memory = l.vms[lane]->memory + address[lane];
+
+                    value[lane] = memory[0] + (memory[1] << 8);
+
+                    if (width == 4)
+                        high[lane] = memory[2] + (memory[3] << 8);
+                }
+
+                if (any(&stopped))
+                {
+                    lanes_leave(&l, &stopped, index);
+                    group &= ~stopped;
+                    running = any(&group);
+                }
+
+                if (width == 4)
+                    lanes_set_quad(&l, &group, reg1, &value, &high);
+                else
+                    lanes_set(&l, &group, reg1, &value);
+                break;
+
+            case I_STORE_DOUBLE:
+            case I_STORE_QUAD:
+                // Lanes that write over code or past the end of memory
+                // are left alone
+                width = ins->code == I_STORE_QUAD ? 4 : 2;
+                address = registers[reg2] + splat(ins->value);
+                stopped = splat(0);
+
+                for (int lane = 0; lane < LANES; lane++)
+                {
+                    if (!group[lane])
+                        continue;
+
+                    if (address[lane] + width > memory_len)
+                        stopped[lane] = UINT16_MAX;
+                    else
+                        for (unsigned long i = 0; i < width; i++)
+                            if (code_map[address[lane] + i])
+                                stopped[lane] = UINT16_MAX;
+                }
+
+                if (any(&stopped))
+                {
+                    lanes_leave(&l, &stopped, index);
+                    group &= ~stopped;
+                    running = any(&group);
+                }
+
+                for (int lane = 0; lane < LANES; lane++)
+                {
+                    if (!group[lane])
+                        continue;
+
+                    unsigned char *memory = l.vms[lane]->memory + address[lane];
+
+                    memory[0] = (unsigned char)registers[reg1][lane];
+                    memory[1] = registers[reg1][lane] >> 8;
+
+                    if (width == 4)
+                    {
+                        memory[2] = (unsigned char)registers[reg1 + 1][lane];
+                        memory[3] = registers[reg1 + 1][lane] >> 8;
+                    }
+                }
+
+                if (width == 4)
+                    lanes_set_quad(&l, &group, reg1, &registers[reg1], &registers[reg1 + 1]);
+                else
+                    lanes_set(&l, &group, reg1, &registers[reg1]);
+                break;
+
+            // Every lane writes to its own output
+            case I_OUT:
+                for (int lane = 0; lane < LANES; lane++)
+                    if (group[lane])
+                        vm1_out(l.vms[lane], registers[reg1][lane], reg2);
+                break;
+
+            // Reports the error on its own
+            default:
+                lanes_leave(&l, &group, index);
+                group = splat(0);
+                running = FALSE;
+                continue;
+            }
+
+            index++;
+        }
+
+        // Lanes that got to where others wait join them
+        lanes_move(&l, &group, index);
+    }
+}
+
+#endif
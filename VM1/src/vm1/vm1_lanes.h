@@ -0,0 +1,39 @@
+#ifndef VM1_LANES_H
+#define VM1_LANES_H
+
+#include "vm1_internal.h"
+
+// Lanes are vectors of GNU C, like computed goto. Other compilers
+// run every virtual machine on its own.
+#if defined(__GNUC__)
+#define HAS_LANES
+#endif
+
+#ifdef HAS_LANES
+
+// Lanes of 16 bits in a vector register: 16 in AVX2 builds, and 8 in
+// the 128bit registers of SSE2 and NEON. Vectors wider than the
+// build has are done in halves, which is slower than fewer lanes.
+#if defined(__AVX2__)
+#define LANES 16
+#else
+#define LANES 8
+#endif
+
+// Returns 1 if both virtual machines have the same decoded program,
+// so they can run as lanes of each other.
+int vm1_lanes_compatible(vm1_state *vm1, vm1_state *vm2);
+
+// Runs up to LANES virtual machines with the same decoded
+// program in lockstep, one lane each. Registers and flags of every
+// lane are kept side by side in vectors, so an instruction is done
+// for every lane at once. When every lane returns, it has either
+// reached END with its output flushed, or is marked in alone and has
+// to be continued with vm1_run() from where it stopped: writing
+// over code, memory accesses past the end of memory and division by
+// zero are left to the lanes on their own.
+void vm1_lanes_run(vm1_state **vms, unsigned long count, unsigned char *alone);
+
+#endif
+
+#endif
@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "..\shared\shared_macros.h"
+#include "..\shared\str.h"
+
+#include "vm1.h"
+#include "vm1_batch.h"
+
+// Utility
+
+// Prints every line of the error messages and exits.
+void error_exit(const char *message)
+{
+    const char *line = message;
+
+    while (*line != '\0')
+    {
+        const char *end = line;
+
+        while (*end != '\0' && *end != '\n')
+            end++;
+
+        printf("%s ERROR! %.*s", PROJECT_NAME, (int)(end - line), line);
+
+        if (*end == '\n')
+        {
+            printf("\n");
+            end++;
+        }
+
+        line = end;
+    }
+
+    getchar();
+    exit(EXIT_FAILURE);
+}
+
+// Program
+int main(int argc, const char *argv[])
+{
+    const char *file_name = NULL;
+    const char *batch_path = NULL;
+    const char *profile_name = NULL;
+    const char *map_name = NULL;
+    const char *trace_name = NULL;
+    const char *aot_name = NULL;
+    const char *save_name = NULL;
+    const char *restore_name = NULL;
+
+    batch_options options = {-1, FALSE, 0, -1, 0};
+
+    // Options are given before the input file
+    for (int i = 1; i < argc; i++)
+    {
+        if (str_equals((char *)argv[i], "-switch"))
+            options.dispatch = VM1_DISPATCH_SWITCH;
+        else if (str_equals((char *)argv[i], "-threaded"))
+            options.dispatch = VM1_DISPATCH_THREADED;
+        else if (str_equals((char *)argv[i], "-jit"))
+            options.use_jit = TRUE;
+        else if (str_equals((char *)argv[i], "-batch") && i + 1 < argc)
+            batch_path = argv[++i];
+        else if (str_equals((char *)argv[i], "-limit") && i + 1 < argc)
+            options.limit = strtoul(argv[++i], NULL, 10);
+        else if (str_equals((char *)argv[i], "-buffer") && i + 1 < argc)
+            options.output_buffer = strtol(argv[++i], NULL, 10);
+        else if (str_equals((char *)argv[i], "-profile") && i + 1 < argc)
+            profile_name = argv[++i];
+        else if (str_equals((char *)argv[i], "-map") && i + 1 < argc)
+            map_name = argv[++i];
+        else if (str_equals((char *)argv[i], "-trace") && i + 1 < argc)
+            trace_name = argv[++i];
+        else if (str_equals((char *)argv[i], "-aot") && i + 1 < argc)
+            aot_name = argv[++i];
+        else if (str_equals((char *)argv[i], "-save") && i + 1 < argc)
+            save_name = argv[++i];
+        else if (str_equals((char *)argv[i], "-restore") && i + 1 < argc)
+            restore_name = argv[++i];
+        else if (str_equals((char *)argv[i], "-threads") && i + 1 < argc)
+            options.threads = strtoul(argv[++i], NULL, 10);
+        else
+            file_name = argv[i];
+    }
+
+    vm1_state *vm = vm1_create();
+
+    if (vm == NULL)
+        error_exit("Out of memory");
+
+    // Checking the options against this build
+    if (options.dispatch >= 0 && vm1_set_dispatch(vm, options.dispatch) != VM1_OK)
+    {
+        printf("Threaded dispatch isn't supported by this build, using switch dispatch\n");
+        options.dispatch = VM1_DISPATCH_SWITCH;
+    }
+
+    if (vm1_set_jit(vm, options.use_jit) != VM1_OK)
+    {
+        printf("JIT isn't supported by this build, using interpreter\n");
+        options.use_jit = FALSE;
+    }
+
+    vm1_set_budget(vm, options.limit, 0);
+
+    if (options.output_buffer >= 0 && vm1_set_output_buffer(vm, options.output_buffer) != VM1_OK)
+        error_exit("Out of memory");
+
+    if (profile_name != NULL)
+        vm1_set_profile(vm, TRUE);
+
+    // Running many programs at once
+    if (batch_path != NULL)
+    {
+        vm1_destroy(vm);
+
+        // These read or write a file of a single program
+        if (profile_name != NULL || map_name != NULL || trace_name != NULL ||
+            aot_name != NULL || save_name != NULL || restore_name != NULL)
+            error_exit("-profile, -map, -trace, -aot, -save and -restore can't be used with -batch");
+
+        printf("%s %s\nBatch: %s\n", PROJECT_NAME, VM_VERSION, batch_path);
+
+        long failed = batch_run(batch_path, &options);
+
+        if (failed < 0)
+            error_exit("Couldn't read the batch");
+
+        getchar();
+        return failed > 0 ? EXIT_FAILURE : 0;
+    }
+
+    // No input file given, exit
+    if (file_name == NULL)
+    {
+        vm1_destroy(vm);
+        return 0;
+    }
+
+    printf("%s %s\nFile: %s\n", PROJECT_NAME, VM_VERSION, file_name);
+
+    // Source map written by the assembler next to the program,
+    // unless another one is given. Loaded first so verification
+    // errors point at the source too
+    char *default_map_name = str_combine(str_new((char *)file_name), ".map");
+
+    if (map_name != NULL)
+    {
+        if (vm1_load_map(vm, map_name) != VM1_OK)
+            error_exit("Couldn't read the source map");
+    }
+    else if (vm1_load_map(vm, default_map_name) == VM1_OK)
+        map_name = default_map_name;
+
+    // The program file is mapped, not read. Memory is there even
+    // when the program doesn't verify
+    int status = vm1_load_file(vm, file_name);
+    unsigned long program_len = 0;
+
+    if (vm1_get_memory(vm, &program_len) != NULL)
+        printf("Program size: %lu bytes\n", program_len);
+
+    if (map_name != NULL)
+        printf("Source map: %s\n", map_name);
+
+    free(default_map_name);
+
+    if (status != VM1_OK)
+        error_exit(vm1_get_error(vm));
+
+    // Continuing from a snapshot instead of the entry point
+    if (restore_name != NULL)
+    {
+        if (vm1_load_snapshot(vm, restore_name) != VM1_OK)
+            error_exit(vm1_get_error(vm));
+
+        printf("Snapshot: %s\n", restore_name);
+    }
+
+    // Translated instead of run
+    if (aot_name != NULL)
+    {
+        FILE *aot = fopen(aot_name, "w");
+
+        if (aot == NULL)
+            error_exit("Couldn't write the C source");
+
+        status = vm1_translate(vm, aot);
+
+        if (fclose(aot) != 0 && status == VM1_OK)
+        {
+            remove(aot_name);
+            error_exit("Couldn't write the C source");
+        }
+
+        // No half written source left behind
+        if (status != VM1_OK)
+        {
+            remove(aot_name);
+            error_exit(vm1_get_error(vm));
+        }
+
+        printf("C source written to %s\n", aot_name);
+
+        vm1_destroy(vm);
+
+        getchar();
+        return 0;
+    }
+
+    FILE *trace = NULL;
+
+    if (trace_name != NULL)
+    {
+        trace = fopen(trace_name, "w");
+
+        if (trace == NULL)
+            error_exit("Couldn't write the trace");
+
+        vm1_set_trace(vm, trace);
+    }
+
+    // Virtual machine at work
+    status = vm1_run(vm);
+
+    if (trace != NULL)
+        fclose(trace);
+
+    // State at the limit is kept for later runs
+    if (status == VM1_YIELD && save_name != NULL)
+    {
+        if (vm1_save_snapshot(vm, save_name) != VM1_OK)
+            error_exit(vm1_get_error(vm));
+
+        printf("\nSnapshot written to %s\n", save_name);
+
+        vm1_destroy(vm);
+
+        getchar();
+        return 0;
+    }
+
+    if (status == VM1_YIELD)
+        error_exit("Instruction limit reached");
+
+    if (status != VM1_OK)
+        error_exit(vm1_get_error(vm));
+
+    // Showing values of registers and flags at exit
+    printf(
+        "\nRegisters [%d,%d,%d,%d] Flags [ZRO %d,POS %d,NEG %d,EQL %d,LTH %d,MTH %d,LQT %d,MQT %d]\n",
+
+        vm1_get_register(vm, R_GENERAL1),
+        vm1_get_register(vm, R_GENERAL2),
+        vm1_get_register(vm, R_GENERAL3),
+        vm1_get_register(vm, R_GENERAL4),
+
+        vm1_get_flag(vm, F_ZERO),
+        vm1_get_flag(vm, F_POSITIVE),
+        vm1_get_flag(vm, F_NEGATIVE),
+
+        vm1_get_flag(vm, F_EQUAL),
+        vm1_get_flag(vm, F_LESS_THAN),
+        vm1_get_flag(vm, F_MORE_THAN),
+
+        vm1_get_flag(vm, F_LESS_OR_EQUAL_TO),
+        vm1_get_flag(vm, F_MORE_OR_EQUAL_TO));
+
+    if (profile_name != NULL)
+    {
+        vm1_print_profile(vm, stdout);
+
+        if (vm1_write_profile(vm, profile_name) != VM1_OK)
+            error_exit("Couldn't write the profile");
+
+        printf("\nProfile written to %s\n", profile_name);
+    }
+
+    vm1_destroy(vm);
+
+    getchar();
+    return 0;
+}
@@ -0,0 +1,232 @@
+#include <stdio.h>  // fopen(), fread(), sscanf(), snprintf()
+#include <stdlib.h> // malloc(), realloc(), free(), qsort()
+#include <string.h> // strlen(), strncmp(), memcpy()
+
+#include "..\shared\shared_macros.h"
+
+#include "vm1_map.h"
+
+#define MAP_HEADER "VM1 map 1"
+
+// Longest line and label name read from a map
+#define MAP_LINE_LEN 1024
+
+static char *copy_string(const char *str, unsigned long length)
+{
+    char *copy = malloc(length + 1);
+
+    if (copy == NULL)
+        return NULL;
+
+    memcpy(copy, str, length);
+    copy[length] = '\0';
+
+    return copy;
+}
+
+static int compare_lines(const void *line1, const void *line2)
+{
+    const map_line *first = line1, *second = line2;
+
+    return first->loc < second->loc ? -1 : first->loc > second->loc;
+}
+
+static int compare_labels(const void *label1, const void *label2)
+{
+    const map_label *first = label1, *second = label2;
+
+    return first->loc < second->loc ? -1 : first->loc > second->loc;
+}
+
+// Grows the array in array to hold one more item of item_size bytes.
+// Returns 0 when out of memory.
+static int grow(void **array, unsigned long len, unsigned long item_size)
+{
+    // Size doubles every time len reaches a power of two
+    if (len > 0 && (len & (len - 1)) != 0)
+        return TRUE;
+
+    void *grown = realloc(*array, (len > 0 ? len * 2 : 16) * item_size);
+
+    if (grown == NULL)
+        return FALSE;
+
+    *array = grown;
+    return TRUE;
+}
+
+vm1_map *vm1_map_parse(const char *text, unsigned long length)
+{
+    vm1_map *map = calloc(1, sizeof(vm1_map));
+    int valid = map != NULL;
+
+    for (unsigned long offset = 0, count = 0; valid && offset < length; count++)
+    {
+        char line[MAP_LINE_LEN];
+        unsigned long end = offset, loc, number;
+        char name[MAP_LINE_LEN];
+
+        while (end < length && text[end] != '\n')
+            end++;
+
+        // Longer lines are cut
+        unsigned long line_len = end - offset < MAP_LINE_LEN ? end - offset : MAP_LINE_LEN - 1;
+
+        memcpy(line, text + offset, line_len);
+        line[line_len] = '\0';
+        offset = end + 1;
+
+        while (line_len > 0 && line[line_len - 1] == '\r')
+            line[--line_len] = '\0';
+
+        if (count == 0)
+            valid = strncmp(line, MAP_HEADER, strlen(MAP_HEADER)) == 0;
+        else if (strncmp(line, "source ", 7) == 0)
+        {
+            free(map->source);
+            map->source = copy_string(line + 7, line_len - 7);
+            valid = map->source != NULL;
+        }
+        else if (sscanf(line, "line %lu %lu", &loc, &number) == 2)
+        {
+            valid = grow((void **)&map->lines, map->lines_len, sizeof(map_line));
+
+            if (valid)
+                map->lines[map->lines_len++] = (map_line){loc, number};
+        }
+        else if (sscanf(line, "label %lu %1023s", &loc, name) == 2)
+        {
+            valid = grow((void **)&map->labels, map->labels_len, sizeof(map_label));
+
+            if (valid)
+            {
+                map->labels[map->labels_len].loc = loc;
+                map->labels[map->labels_len].name = copy_string(name, strlen(name));
+                valid = map->labels[map->labels_len++].name != NULL;
+            }
+        }
+    }
+
+    if (!valid || length == 0)
+    {
+        vm1_map_free(map);
+        return NULL;
+    }
+
+    // A map can have no entries, and then no arrays to sort
+    if (map->lines_len > 0)
+        qsort(map->lines, map->lines_len, sizeof(map_line), compare_lines);
+
+    if (map->labels_len > 0)
+        qsort(map->labels, map->labels_len, sizeof(map_label), compare_labels);
+
+    return map;
+}
+
+vm1_map *vm1_map_read(const char *file_name)
+{
+    FILE *file = fopen(file_name, "rb");
+
+    if (file == NULL)
+        return NULL;
+
+    fseek(file, 0x0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0x0, SEEK_SET);
+
+    char *text = length >= 0 ? malloc(length + 1) : NULL;
+    vm1_map *map = NULL;
+
+    if (text != NULL && (length == 0 || fread(text, length, 1, file) == 1))
+        map = vm1_map_parse(text, length);
+
+    free(text);
+    fclose(file);
+
+    return map;
+}
+
+void vm1_map_free(vm1_map *map)
+{
+    if (map == NULL)
+        return;
+
+    for (unsigned long i = 0; i < map->labels_len; i++)
+        free(map->labels[i].name);
+
+    free(map->labels);
+    free(map->lines);
+    free(map->source);
+    free(map);
+}
+
+uint32_t vm1_map_line_of(vm1_map *map, unsigned long loc)
+{
+    if (map == NULL)
+        return 0;
+
+    // Last entry at or before loc
+    unsigned long low = 0, high = map->lines_len;
+
+    while (low < high)
+    {
+        unsigned long middle = low + (high - low) / 2;
+
+        if (map->lines[middle].loc <= loc)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    return low > 0 ? map->lines[low - 1].line : 0;
+}
+
+const char *vm1_map_label_of(vm1_map *map, unsigned long loc, unsigned long *offset)
+{
+    if (map == NULL)
+        return NULL;
+
+    unsigned long low = 0, high = map->labels_len;
+
+    while (low < high)
+    {
+        unsigned long middle = low + (high - low) / 2;
+
+        if (map->labels[middle].loc <= loc)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    if (low == 0)
+        return NULL;
+
+    *offset = loc - map->labels[low - 1].loc;
+    return map->labels[low - 1].name;
+}
+
+int vm1_map_describe(vm1_map *map, unsigned long loc, char *text, unsigned long size)
+{
+    uint32_t line = vm1_map_line_of(map, loc);
+    unsigned long offset = 0;
+    const char *label = vm1_map_label_of(map, loc, &offset);
+    int length = 0;
+
+    if (line == 0 && label == NULL)
+        return 0;
+
+    if (line > 0)
+        length = snprintf(text, size, "%s:%lu", map->source != NULL ? map->source : "line", (unsigned long)line);
+
+    if (label != NULL && length >= 0 && (unsigned long)length < size)
+    {
+        const char *space = length > 0 ? " " : "";
+
+        if (offset > 0)
+            length += snprintf(text + length, size - length, "%s%s+%lu", space, label, offset);
+        else
+            length += snprintf(text + length, size - length, "%s%s", space, label);
+    }
+
+    return (unsigned long)length < size ? length : (int)size - 1;
+}
@@ -0,0 +1,61 @@
+#ifndef VM1_MAP_H
+#define VM1_MAP_H
+
+#include <stdint.h> // uint32_t
+
+// Source map written by the assembler, tells which line of the
+// source and which label every byte of the program came from.
+//
+//   VM1 map 1
+//   source file.vm1
+//   line <offset> <line>
+//   label <offset> <name>
+//
+// A line entry covers every byte from its offset until the next
+// line entry. Offsets are decimal, and entries are sorted by them.
+
+typedef struct
+{
+    uint32_t loc;
+    uint32_t line;
+} map_line;
+
+typedef struct
+{
+    uint32_t loc;
+    char *name;
+} map_label;
+
+typedef struct vm1_map
+{
+    char *source;
+
+    map_line *lines;
+    unsigned long lines_len;
+
+    map_label *labels;
+    unsigned long labels_len;
+} vm1_map;
+
+// Reads a map from the file. Returns NULL if the file can't be read
+// or isn't a map.
+vm1_map *vm1_map_read(const char *file_name);
+
+// Reads a map from length bytes of text, like the map section of a
+// program file. Returns NULL if it isn't a map.
+vm1_map *vm1_map_parse(const char *text, unsigned long length);
+
+void vm1_map_free(vm1_map *map);
+
+// Writes where loc came from to text, like "file.vm1:12 loop+4".
+// Returns the length of the text, or 0 when the map doesn't know.
+int vm1_map_describe(vm1_map *map, unsigned long loc, char *text, unsigned long size);
+
+// Returns the source line of loc, or 0 when the map doesn't know.
+uint32_t vm1_map_line_of(vm1_map *map, unsigned long loc);
+
+// Returns the label at or before loc, and the distance to it in
+// offset. Returns NULL when there's none.
+const char *vm1_map_label_of(vm1_map *map, unsigned long loc, unsigned long *offset);
+
+#endif
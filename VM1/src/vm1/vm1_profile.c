@@ -0,0 +1,297 @@
+#include <stdio.h>    // fprintf(), fopen()
+#include <stdlib.h>   // calloc(), free(), qsort()
+#include <inttypes.h> // PRIu64
+
+#include "vm1_internal.h"
+#include "vm1_profile.h"
+#include "vm1_map.h"
+
+// Longest lists in the report
+#define REPORT_HOT_SPOTS 20
+#define REPORT_BRANCHES 20
+#define REPORT_PAIRS 10
+
+// Mnemonics of the assembler
+const char *const vm1_op_name[OP_COUNT] = {
+    [I_END] = "END",
+    [I_JUMP] = "JMP",
+    [I_POSITIVE_BRANCH] = "PBR",
+    [I_NEGATIVE_BRANCH] = "NBR",
+
+    [I_ADDITION] = "ADD",
+    [I_SUBTRACTION] = "SUB",
+    [I_MULTIPLICATION] = "MUL",
+    [I_DIVISION] = "DIV",
+    [I_REMAINDER] = "REM",
+
+    [I_SET_REG_VAL] = "SRV",
+    [I_SET_REG_REG] = "SRR",
+    [I_SET_REG_MEM] = "SRM",
+    [I_SET_MEM_REG] = "SMR",
+
+    [I_IS_EQUAL] = "IEQ",
+    [I_IS_LESS_THAN] = "ILT",
+    [I_IS_MORE_THAN] = "IMT",
+    [I_IS_LESS_OR_EQUAL_TO] = "ILQ",
+    [I_IS_MORE_OR_EQUAL_TO] = "IMQ",
+
+    [I_OUT] = "OUT",
+
+    [I_LOAD_DOUBLE] = "LDD",
+    [I_STORE_DOUBLE] = "STD",
+    [I_LOAD_QUAD] = "LDQ",
+    [I_STORE_QUAD] = "STQ"};
+
+vm1_profile *vm1_profile_create(unsigned long memory_len)
+{
+    vm1_profile *profile = calloc(1, sizeof(vm1_profile));
+
+    if (profile == NULL)
+        return NULL;
+
+    profile->last_op = OP_COUNT;
+    profile->memory_len = memory_len;
+    profile->hits = calloc(memory_len + 1, sizeof(uint64_t));
+    profile->taken = calloc(memory_len + 1, sizeof(uint64_t));
+    profile->ops = calloc(memory_len + 1, sizeof(char));
+
+    if (profile->hits == NULL || profile->taken == NULL || profile->ops == NULL)
+    {
+        vm1_profile_free(profile);
+        return NULL;
+    }
+
+    return profile;
+}
+
+void vm1_profile_free(vm1_profile *profile)
+{
+    if (profile == NULL)
+        return;
+
+    free(profile->hits);
+    free(profile->taken);
+    free(profile->ops);
+    free(profile);
+}
+
+void vm1_profile_count(vm1_state *vm, instruction *ins)
+{
+    vm1_profile *profile = vm->profile;
+    unsigned char op = ins->code;
+
+    profile->total++;
+    profile->operations[op]++;
+    profile->hits[ins->loc]++;
+    profile->ops[ins->loc] = op;
+
+    if (profile->last_op < OP_COUNT)
+        profile->pairs[profile->last_op][op]++;
+    profile->last_op = op;
+
+    // Flags haven't changed yet, so this is the same check the
+    // branch is about to make
+    if (op == I_JUMP ||
+        (op == I_POSITIVE_BRANCH && vm1_flag_get(vm, ins->reg1) == 1) ||
+        (op == I_NEGATIVE_BRANCH && vm1_flag_get(vm, ins->reg1) == 0))
+        profile->taken[ins->loc]++;
+}
+
+uint64_t vm1_get_instruction_count(vm1_state *vm)
+{
+    return vm->profile != NULL ? vm->profile->total : 0;
+}
+
+// Trace
+
+void vm1_trace_instruction(vm1_state *vm, instruction *ins)
+{
+    char source[256];
+
+    if (vm1_map_describe(vm->map, ins->loc, source, sizeof(source)) == 0)
+        source[0] = '\0';
+
+    fprintf(vm->trace, "0x%04lX %s [%d,%d,%d,%d] %s\n",
+            (unsigned long)ins->loc, vm1_op_name[ins->code],
+            vm->registers[R_GENERAL1], vm->registers[R_GENERAL2],
+            vm->registers[R_GENERAL3], vm->registers[R_GENERAL4],
+            source);
+}
+
+// Report
+
+// Count and what it is for, sorted by the count
+typedef struct
+{
+    uint64_t count;
+    unsigned long key;
+} profile_entry;
+
+static int compare_entries(const void *entry1, const void *entry2)
+{
+    const profile_entry *first = entry1, *second = entry2;
+
+    if (first->count != second->count)
+        return first->count < second->count ? 1 : -1;
+
+    // Equal counts in the order of the keys
+    return first->key < second->key ? -1 : first->key > second->key;
+}
+
+static double share(uint64_t count, uint64_t total)
+{
+    return total > 0 ? 100.0 * count / total : 0.0;
+}
+
+int vm1_print_profile(vm1_state *vm, FILE *stream)
+{
+    vm1_profile *profile = vm->profile;
+
+    if (profile == NULL)
+        return VM1_ERROR;
+
+    unsigned long size = profile->memory_len > OP_COUNT * OP_COUNT ? profile->memory_len : OP_COUNT * OP_COUNT;
+    profile_entry *entries = malloc(sizeof(profile_entry) * size);
+
+    if (entries == NULL)
+        return VM1_ERROR;
+
+    uint64_t total = profile->total;
+    unsigned long count = 0;
+
+    fprintf(stream, "\nProfile: %" PRIu64 " instructions\n", total);
+
+    // Operations
+    for (int op = 0; op < OP_COUNT; op++)
+        if (profile->operations[op] > 0)
+            entries[count++] = (profile_entry){profile->operations[op], op};
+
+    qsort(entries, count, sizeof(profile_entry), compare_entries);
+
+    fprintf(stream, "\nOperations\n");
+    for (unsigned long i = 0; i < count; i++)
+        fprintf(stream, "  %s %14" PRIu64 " %6.2f%%\n",
+                vm1_op_name[entries[i].key], entries[i].count, share(entries[i].count, total));
+
+    // Hot spots
+    count = 0;
+    for (unsigned long loc = 0; loc < profile->memory_len; loc++)
+        if (profile->hits[loc] > 0)
+            entries[count++] = (profile_entry){profile->hits[loc], loc};
+
+    qsort(entries, count, sizeof(profile_entry), compare_entries);
+
+    char source[256];
+
+    fprintf(stream, "\nHot spots\n");
+    for (unsigned long i = 0; i < count && i < REPORT_HOT_SPOTS; i++)
+    {
+        if (vm1_map_describe(vm->map, entries[i].key, source, sizeof(source)) == 0)
+            source[0] = '\0';
+
+        fprintf(stream, "  0x%04lX %s %14" PRIu64 " %6.2f%%  %s\n",
+                entries[i].key, vm1_op_name[profile->ops[entries[i].key]], entries[i].count, share(entries[i].count, total), source);
+    }
+
+    // Branches, hot spots that are jumps or branches
+    fprintf(stream, "\nBranches\n");
+    for (unsigned long i = 0, shown = 0; i < count && shown < REPORT_BRANCHES; i++)
+    {
+        unsigned long loc = entries[i].key;
+        unsigned char op = profile->ops[loc];
+
+        if (op != I_JUMP && op != I_POSITIVE_BRANCH && op != I_NEGATIVE_BRANCH)
+            continue;
+
+        if (vm1_map_describe(vm->map, loc, source, sizeof(source)) == 0)
+            source[0] = '\0';
+
+        fprintf(stream, "  0x%04lX %s %14" PRIu64 " executed %14" PRIu64 " taken %6.2f%%  %s\n",
+                loc, vm1_op_name[op], entries[i].count, profile->taken[loc], share(profile->taken[loc], entries[i].count), source);
+        shown++;
+    }
+
+    // Pairs
+    count = 0;
+    for (int first = 0; first < OP_COUNT; first++)
+        for (int second = 0; second < OP_COUNT; second++)
+            if (profile->pairs[first][second] > 0)
+                entries[count++] = (profile_entry){profile->pairs[first][second], first * OP_COUNT + second};
+
+    qsort(entries, count, sizeof(profile_entry), compare_entries);
+
+    fprintf(stream, "\nPairs\n");
+    for (unsigned long i = 0; i < count && i < REPORT_PAIRS; i++)
+        fprintf(stream, "  %s %s %14" PRIu64 " %6.2f%%\n",
+                vm1_op_name[entries[i].key / OP_COUNT], vm1_op_name[entries[i].key % OP_COUNT],
+                entries[i].count, share(entries[i].count, total));
+
+    free(entries);
+    return VM1_OK;
+}
+
+// Machine readable profile, one count per line:
+//   operation,,SRV,count,,,
+//   pair,,SRV ADD,count,,,
+//   address,16,SRV,count,taken,line,label
+// Taken is only given for jumps and branches, and line and label
+// when there's a source map.
+int vm1_write_profile(vm1_state *vm, const char *file_name)
+{
+    vm1_profile *profile = vm->profile;
+
+    if (profile == NULL)
+        return VM1_ERROR;
+
+    FILE *file = fopen(file_name, "w");
+
+    if (file == NULL)
+        return VM1_ERROR;
+
+    fprintf(file, "type,address,operation,count,taken,line,label\n");
+
+    for (int op = 0; op < OP_COUNT; op++)
+        if (profile->operations[op] > 0)
+            fprintf(file, "operation,,%s,%" PRIu64 ",,,\n", vm1_op_name[op], profile->operations[op]);
+
+    for (int first = 0; first < OP_COUNT; first++)
+        for (int second = 0; second < OP_COUNT; second++)
+            if (profile->pairs[first][second] > 0)
+                fprintf(file, "pair,,%s %s,%" PRIu64 ",,,\n", vm1_op_name[first], vm1_op_name[second], profile->pairs[first][second]);
+
+    for (unsigned long loc = 0; loc < profile->memory_len; loc++)
+    {
+        if (profile->hits[loc] == 0)
+            continue;
+
+        unsigned char op = profile->ops[loc];
+
+        fprintf(file, "address,%lu,%s,%" PRIu64 ",", loc, vm1_op_name[op], profile->hits[loc]);
+
+        if (op == I_JUMP || op == I_POSITIVE_BRANCH || op == I_NEGATIVE_BRANCH)
+            fprintf(file, "%" PRIu64, profile->taken[loc]);
+
+        unsigned long offset = 0;
+        uint32_t line = vm1_map_line_of(vm->map, loc);
+        const char *label = vm1_map_label_of(vm->map, loc, &offset);
+
+        fprintf(file, ",");
+        if (line > 0)
+            fprintf(file, "%lu", (unsigned long)line);
+
+        fprintf(file, ",");
+        if (label != NULL && offset > 0)
+            fprintf(file, "%s+%lu", label, offset);
+        else if (label != NULL)
+            fprintf(file, "%s", label);
+
+        fprintf(file, "\n");
+    }
+
+    int failed = ferror(file);
+
+    if (fclose(file) != 0 || failed)
+        return VM1_ERROR;
+
+    return VM1_OK;
+}
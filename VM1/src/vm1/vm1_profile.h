@@ -0,0 +1,50 @@
+#ifndef VM1_PROFILE_H
+#define VM1_PROFILE_H
+
+#include <stdint.h> // uint64_t
+
+#include "vm1_internal.h"
+
+// Number of op codes in the instruction set
+#define OP_COUNT (I_STORE_QUAD + 1)
+
+// Mnemonics of the assembler
+extern const char *const vm1_op_name[OP_COUNT];
+
+// Execution counts of a profiled program. Only the counting engine
+// fills these, so programs that aren't profiled never pay for them.
+typedef struct vm1_profile
+{
+    uint64_t total;
+
+    // Executions of every op code, superinstructions counted as
+    // the two instructions they were made of
+    uint64_t operations[OP_COUNT];
+
+    // Executions of every op code right after another one, indexed
+    // by the first op code and then the second one
+    uint64_t pairs[OP_COUNT][OP_COUNT];
+    unsigned char last_op;
+
+    // Executions of the instruction in every memory location, how
+    // many times the jump or branch there was taken, and the op code
+    // last executed there, since SMR can change it
+    unsigned long memory_len;
+    uint64_t *hits;
+    uint64_t *taken;
+    unsigned char *ops;
+} vm1_profile;
+
+// Allocates a profile with every count at zero for a program of
+// memory_len bytes. Returns NULL when out of memory.
+vm1_profile *vm1_profile_create(unsigned long memory_len);
+
+void vm1_profile_free(vm1_profile *profile);
+
+// Counts the instruction before it is executed.
+void vm1_profile_count(vm1_state *vm, instruction *ins);
+
+// Writes the instruction to the trace before it is executed.
+void vm1_trace_instruction(vm1_state *vm, instruction *ins);
+
+#endif
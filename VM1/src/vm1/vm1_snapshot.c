@@ -0,0 +1,136 @@
+#include <stdio.h>  // fopen(), fwrite(), rename(), remove()
+#include <stdlib.h> // malloc(), free()
+#include <string.h> // memcmp(), memcpy(), strlen()
+
+#ifdef _WIN32
+#include <windows.h> // MoveFileExA()
+#endif
+
+#include "..\shared\shared_macros.h"
+#include "..\shared\vbc.h"
+
+#include "vm1_snapshot.h"
+#include "vm1_internal.h"
+
+int vm1_snapshot_write(vm1_state *vm, const char *file_name)
+{
+    // Header and output go together, so the checksum covers both
+    unsigned long header_len = SNAPSHOT_HEADER_LEN + vm->output_len;
+    unsigned char *header = calloc(header_len, sizeof(char));
+
+    if (header == NULL)
+        return FALSE;
+
+    // Memory starts on the first page after the output
+    unsigned long memory_offset = (header_len + VBC_PAGE_SIZE - 1) / VBC_PAGE_SIZE * VBC_PAGE_SIZE;
+
+    memcpy(header, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN);
+    vbc_put16(header + 4, SNAPSHOT_VERSION);
+    vbc_put16(header + 6, SNAPSHOT_HEADER_LEN);
+    vbc_put32(header + 12, vm->memory_len);
+    vbc_put32(header + 16, vm->instructions[vm->index].loc);
+    vbc_put32(header + 20, vm->program_crc);
+
+    for (int reg = 0; reg < R_COUNT; reg++)
+        vbc_put16(header + 24 + reg * 2, vm->registers[reg]);
+
+    header[32] = vm->flag_op;
+    vbc_put16(header + 34, vm->flag_result);
+    vbc_put32(header + 36, vm->output_len);
+    vbc_put32(header + 40, memory_offset);
+
+    memcpy(header + SNAPSHOT_HEADER_LEN, vm->output_buffer, vm->output_len);
+    vbc_put32(header + 8, vbc_crc32(header + 12, header_len - 12));
+
+    // Written next to file_name and renamed over it when complete.
+    // A restored virtual machine maps its memory from the snapshot it
+    // was restored from, which may be file_name, and a failed write
+    // leaves the old snapshot as it was.
+    char *temp_name = malloc(strlen(file_name) + sizeof(SNAPSHOT_TEMP_SUFFIX));
+    FILE *file = NULL;
+
+    if (temp_name != NULL)
+    {
+        strcpy(temp_name, file_name);
+        strcat(temp_name, SNAPSHOT_TEMP_SUFFIX);
+        file = fopen(temp_name, "wb");
+    }
+
+    if (file == NULL)
+    {
+        free(header);
+        free(temp_name);
+        return FALSE;
+    }
+
+    fwrite(header, 1, header_len, file);
+    free(header);
+
+    for (unsigned long offset = header_len; offset < memory_offset; offset++)
+        fputc(0, file);
+
+    fwrite(vm->memory, 1, vm->memory_len, file);
+
+    int failed = fflush(file) != 0 || ferror(file);
+
+    if (fclose(file) != 0)
+        failed = TRUE;
+
+#ifdef _WIN32
+    if (!failed && !MoveFileExA(temp_name, file_name, MOVEFILE_REPLACE_EXISTING))
+        failed = TRUE;
+#else
+    if (!failed && rename(temp_name, file_name) != 0)
+        failed = TRUE;
+#endif
+
+    if (failed)
+        remove(temp_name);
+
+    free(temp_name);
+    return !failed;
+}
+
+const char *vm1_snapshot_check(const unsigned char *file, unsigned long length, snapshot_header *header)
+{
+    if (length < SNAPSHOT_HEADER_LEN || memcmp(file, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) != 0)
+        return "Not a snapshot";
+
+    if (vbc_get16(file + 4) != SNAPSHOT_VERSION)
+        return "Unsupported snapshot version";
+
+    unsigned long header_len = vbc_get16(file + 6);
+
+    if (header_len < SNAPSHOT_HEADER_LEN || header_len > length)
+        return "Broken snapshot header";
+
+    header->memory_len = vbc_get32(file + 12);
+    header->loc = vbc_get32(file + 16);
+    header->program_crc = vbc_get32(file + 20);
+
+    for (int reg = 0; reg < R_COUNT; reg++)
+        header->registers[reg] = vbc_get16(file + 24 + reg * 2);
+
+    header->flag_op = file[32];
+    header->flag_result = vbc_get16(file + 34);
+    header->output_len = vbc_get32(file + 36);
+    header->memory_offset = vbc_get32(file + 40);
+    header->output = file + header_len;
+
+    if (header->output_len > length - header_len)
+        return "Output runs past the end of the snapshot";
+
+    if (vbc_crc32(file + 12, header_len - 12 + header->output_len) != vbc_get32(file + 8))
+        return "Snapshot checksum doesn't match";
+
+    if (header->memory_offset > length || header->memory_len > length - header->memory_offset)
+        return "Memory runs past the end of the snapshot";
+
+    if (header->loc >= header->memory_len)
+        return "Program counter is past the end of memory";
+
+    if (header->flag_op > FLAGS_FROM_RESULT)
+        return "Broken snapshot flags";
+
+    return NULL;
+}
@@ -0,0 +1,62 @@
+#ifndef VM1_SNAPSHOT_H
+#define VM1_SNAPSHOT_H
+
+#include <stdint.h> // uint16_t, uint32_t
+
+#include "vm1_internal.h"
+
+// Snapshot of a virtual machine that hasn't ended, written by
+// vm1_save_snapshot(). Numbers are little endian.
+//
+//   Header, SNAPSHOT_HEADER_LEN bytes
+//     0   magic, SNAPSHOT_MAGIC
+//     4   16bit version, SNAPSHOT_VERSION
+//     6   16bit header length
+//     8   32bit CRC-32 of the rest of the header and the output
+//     12  32bit memory length
+//     16  32bit memory location of the next instruction
+//     20  32bit checksum of the program, see program_crc
+//     24  16bit registers, R_COUNT of them
+//     32  8bit flag_op, 8bit zero and 16bit flag_result
+//     36  32bit length of the output in the buffer
+//     40  32bit offset of the memory in the file
+//
+//   Output in the buffer, then zeros until the memory, which starts
+//   at a multiple of VBC_PAGE_SIZE so its pages can be mapped.
+//
+// The memory isn't in the checksum, so restoring doesn't have to
+// read it. Code in it is verified again when it is decoded.
+
+#define SNAPSHOT_MAGIC "VSS\x1A"
+#define SNAPSHOT_MAGIC_LEN 4
+#define SNAPSHOT_VERSION 1
+
+#define SNAPSHOT_HEADER_LEN 44
+
+// Added to the name of the snapshot while it's being written
+#define SNAPSHOT_TEMP_SUFFIX ".tmp"
+
+typedef struct
+{
+    uint32_t memory_len;
+    uint32_t loc;
+    uint32_t program_crc;
+    uint16_t registers[R_COUNT];
+    unsigned char flag_op;
+    uint16_t flag_result;
+    uint32_t output_len;
+    uint32_t memory_offset;
+    const unsigned char *output;
+} snapshot_header;
+
+// Writes the state of vm to file_name, which is only replaced once
+// the whole snapshot is written. Returns 0 if the file can't be
+// written, and leaves file_name as it was.
+int vm1_snapshot_write(vm1_state *vm, const char *file_name);
+
+// Reads the header and checks the version, the checksum and that
+// the output and the memory fit in the file. Returns what's wrong
+// with the snapshot, or NULL when nothing is.
+const char *vm1_snapshot_check(const unsigned char *file, unsigned long length, snapshot_header *header);
+
+#endif
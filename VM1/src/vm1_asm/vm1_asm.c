@@ -1,14 +1,30 @@
-#include <stdio.h>  // printf(), fopen(), fseek(), fread(), ftell(), fclose(), FILE
-#include <stdlib.h> // malloc(), free(), atoi()
-#include <stdint.h> // uint16_t
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200112L // fileno(), mmap()
+#endif
+
+#include <stdio.h>  // printf(), vsnprintf(), fopen(), fseek(), fread(), fwrite(), ftell(), fclose(), fileno(), rename(), remove(), FILE
+#include <stdlib.h> // malloc(), calloc(), realloc(), free()
+#include <string.h> // memset()
+#include <stdarg.h> // va_list, va_start(), va_end()
+#include <limits.h> // LONG_MAX
+#include <stdint.h> // uint16_t, uint32_t
+
+#ifdef _WIN32
+#include <windows.h> // CreateFileMapping(), MapViewOfFile(), MoveFileExA()
+#else
+#include <sys/mman.h> // mmap(), munmap()
+#include <sys/stat.h> // fstat()
+#endif
 
 #include "..\shared\shared_macros.h" // PROJECT_NAME, TRUE, FALSE
 #include "..\shared\str.h"           // str_length(), str_is_equal(), str_new(), str_append()
+#include "..\shared\vbc.h"           // VBC_MAGIC, vbc_put32(), vbc_crc32()
 
 // Program
 
 #define FILE_FORMAT_NAME ".vbc"
-#define HEX "0x"
+#define MAP_FORMAT_NAME ".map"
+#define TEMP_FORMAT_NAME ".tmp"
 
 // Error messages
 
@@ -36,11 +52,23 @@
 char *input_buffer;
 long input_len;
 
+// Input is mapped to memory instead of read when possible
+int input_mapped = FALSE;
+
 char cur_char;
 long index = 0;
 
+// Line of cur_char in the input, starting from 1
+long line = 1;
+
 FILE *output;
 
+// Options
+int write_map = FALSE;
+int dump = FALSE;
+int optimize = FALSE;
+int raw_output = FALSE;
+
 void error(char *message)
 {
     printf("%s ERROR! %s", PROJECT_NAME, message);
@@ -52,6 +80,9 @@ void error(char *message)
 
 void get_next_char()
 {
+    if (cur_char == '\n')
+        line++;
+
     if (index < input_len)
         cur_char = input_buffer[index++];
     else
@@ -61,48 +92,261 @@ void get_next_char()
 void demand_char(char ch, char *error_msg)
 {
     if (cur_char != ch)
-        error(error_msg);
+        error(str_new(error_msg));
     get_next_char();
 }
 
+// Returns a new message made with printf() formatting, for error().
+char *format_message(const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    char *message = malloc(length + 1);
+
+    if (message == NULL)
+    {
+        printf("%s ERROR! Out of memory", PROJECT_NAME);
+        exit(EXIT_FAILURE);
+    }
+
+    va_start(args, format);
+    vsnprintf(message, length + 1, format, args);
+    va_end(args);
+
+    return message;
+}
+
+// Grows the array to fit one more item when it's full, by doubling
+// its size.
+void *grow(void *array, unsigned long len, unsigned long *size, unsigned long item_size)
+{
+    if (len < *size)
+        return array;
+
+    *size = *size > 0 ? *size * 2 : 64;
+    array = realloc(array, *size * item_size);
+
+    if (array == NULL)
+        error(str_new("Out of memory"));
+
+    return array;
+}
+
+// Words
+
+// Word in the input buffer. It isn't copied or null terminated,
+// and keeps the case it was written in.
+typedef struct
+{
+    const char *start;
+    long length;
+} token;
+
+// Keywords and location pointers are case insensitive
+char to_upper(char ch)
+{
+    return ch >= 'a' && ch <= 'z' ? ch - 32 : ch;
+}
+
+// FNV-1a of the word in upper case
+uint32_t hash_token(token word, uint32_t seed)
+{
+    uint32_t hash = 2166136261u ^ seed;
+
+    for (long i = 0; i < word.length; i++)
+        hash = (hash ^ (unsigned char)to_upper(word.start[i])) * 16777619u;
+
+    return hash ^ hash >> 16;
+}
+
+// Returns 1 if the word is str in any case. str is in upper case.
+int token_equals(token word, const char *str)
+{
+    for (long i = 0; i < word.length; i++)
+        if (str[i] == '\0' || to_upper(word.start[i]) != str[i])
+            return 0;
+
+    return str[word.length] == '\0';
+}
+
+// Names of location pointers live until the end, so they are
+// copied to blocks that are freed all at once.
+#define ARENA_BLOCK_SIZE 65536
+
+typedef struct arena_block
+{
+    struct arena_block *next;
+    unsigned long used;
+    unsigned long size;
+    char data[];
+} arena_block;
+
+arena_block *arena = NULL;
+
+// Returns the word in upper case and null terminated.
+char *arena_copy(token word)
+{
+    unsigned long size = word.length + 1;
+
+    if (arena == NULL || arena->size - arena->used < size)
+    {
+        unsigned long block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        arena_block *block = malloc(sizeof(arena_block) + block_size);
+
+        if (block == NULL)
+            error(str_new("Out of memory"));
+
+        block->next = arena;
+        block->used = 0;
+        block->size = block_size;
+        arena = block;
+    }
+
+    char *copy = arena->data + arena->used;
+
+    for (long i = 0; i < word.length; i++)
+        copy[i] = to_upper(word.start[i]);
+
+    copy[word.length] = '\0';
+    arena->used += size;
+
+    return copy;
+}
+
+void arena_free()
+{
+    while (arena != NULL)
+    {
+        arena_block *next = arena->next;
+
+        free(arena);
+        arena = next;
+    }
+}
+
+// Reads the digits of the word in base until the first character
+// that isn't one, and saturates at LONG_MAX, like strtol() does.
+long parse_number(token word, int base)
+{
+    unsigned long value = 0;
+
+    for (long i = 0; i < word.length; i++)
+    {
+        char ch = to_upper(word.start[i]);
+        int digit = ch >= '0' && ch <= '9' ? ch - '0' : ch >= 'A' && ch <= 'Z' ? ch - 'A' + 10 : base;
+
+        if (digit >= base)
+            break;
+
+        if (value > (unsigned long)(LONG_MAX - digit) / base)
+            return LONG_MAX;
+
+        value = value * base + digit;
+    }
+
+    return (long)value;
+}
+
 // Location pointers
 
+// Every name is stored once, the first time it's either defined
+// or called, and calls refer to it by its index.
 typedef struct location_pointers
 {
-    char *id;
-    uint16_t mem_loc;
+    char *id; // In upper case, in the arena
+    long mem_loc;
+
+    // Line of the definition, 0 while the location pointer has
+    // only been called
+    long line;
 } loc_ptr;
 
+typedef struct
+{
+    uint32_t ptr;
+    long mem_loc;
+} loc_ptr_call;
+
 // Used for keeping track of the memory location for
 // location pointers
 long cur_mem_loc;
-loc_ptr loc_ptrs[UINT16_MAX];
-uint16_t loc_ptrs_len = 0;
+loc_ptr *loc_ptrs = NULL;
+unsigned long loc_ptrs_len = 0, loc_ptrs_size = 0;
+
+// Location pointers in the order they were defined in
+uint32_t *loc_ptr_defs = NULL;
+unsigned long loc_ptr_defs_len = 0, loc_ptr_defs_size = 0;
 
-loc_ptr loc_ptr_calls[UINT16_MAX];
-uint16_t loc_ptr_calls_len = 0;
+// Calls before the location pointer was defined, filled in at
+// the end
+loc_ptr_call *loc_ptr_calls = NULL;
+unsigned long loc_ptr_calls_len = 0, loc_ptr_calls_size = 0;
+
+// Hash table of the location pointers by id, open addressing with
+// linear probing. Slots hold the index in loc_ptrs plus one, 0 is
+// empty. Kept at most half full.
+uint32_t *loc_ptr_slots = NULL;
+unsigned long loc_ptr_slots_len = 0;
 
 // Used for saving the intermediate version from
 // the final output, so missing location pointers
-// can be filled in.
-char output_buffer[UINT16_MAX];
+// can be filled in. Grows as needed.
+char *output_buffer = NULL;
+long output_size = 0;
+
+// Line of the input every byte in the output came from,
+// for the source map. Only kept with -map.
+uint32_t *output_lines = NULL;
 
-int loc_ptr_exists(char *id)
+// Returns the slot of id, or the empty slot where it belongs.
+uint32_t *find_loc_ptr_slot(token id)
 {
-    for (int i = 0; i < loc_ptrs_len; i++)
-        if (str_equals(id, loc_ptrs[i].id))
-            return 1;
+    unsigned long mask = loc_ptr_slots_len - 1;
 
-    return 0;
+    for (unsigned long i = hash_token(id, 0) & mask;; i = (i + 1) & mask)
+        if (loc_ptr_slots[i] == 0 || token_equals(id, loc_ptrs[loc_ptr_slots[i] - 1].id))
+            return &loc_ptr_slots[i];
 }
 
-uint16_t get_loc_ptr(char *id)
+// Doubles the hash table and adds every location pointer again.
+void grow_loc_ptr_slots()
 {
-    for (int i = 0; i < loc_ptrs_len; i++)
-        if (str_equals(id, loc_ptrs[i].id))
-            return loc_ptrs[i].mem_loc;
+    free(loc_ptr_slots);
 
-    return 0;
+    loc_ptr_slots_len = loc_ptr_slots_len > 0 ? loc_ptr_slots_len * 2 : 256;
+    loc_ptr_slots = calloc(loc_ptr_slots_len, sizeof(uint32_t));
+
+    if (loc_ptr_slots == NULL)
+        error(str_new("Out of memory"));
+
+    for (unsigned long i = 0; i < loc_ptrs_len; i++)
+    {
+        token id = {loc_ptrs[i].id, strlen(loc_ptrs[i].id)};
+        *find_loc_ptr_slot(id) = i + 1;
+    }
+}
+
+// Returns the index of the location pointer called id, and adds it
+// as not yet defined when it's new.
+uint32_t intern_loc_ptr(token id)
+{
+    if (loc_ptrs_len * 2 >= loc_ptr_slots_len)
+        grow_loc_ptr_slots();
+
+    uint32_t *slot = find_loc_ptr_slot(id);
+
+    if (*slot != 0)
+        return *slot - 1;
+
+    loc_ptrs = grow(loc_ptrs, loc_ptrs_len, &loc_ptrs_size, sizeof(loc_ptr));
+    loc_ptrs[loc_ptrs_len] = (loc_ptr){arena_copy(id), 0, 0};
+
+    *slot = ++loc_ptrs_len;
+    return loc_ptrs_len - 1;
 }
 
 // Char recognition functions
@@ -139,27 +383,141 @@ void skip_blanks()
         get_next_char();
 }
 
-char *build_word()
+// Returns the word starting from cur_char, and moves past it.
+token build_word()
 {
-    char *word = str_new("");
+    token word = {&input_buffer[index - 1], 0};
 
     while (is_alphabet() || is_number() || cur_char == '_')
     {
-        if (cur_char >= 'a' && cur_char <= 'z')
-            cur_char -= 32;
-
-        word = str_combine(word, &cur_char);
+        word.length++;
         get_next_char();
     }
 
     return word;
 }
 
+// Input and output
+
+// Maps the whole input file to memory, or reads it when it can't be
+// mapped. Returns 0 if the file can't be read.
+int read_input(const char *file_name)
+{
+    input_buffer = NULL;
+    input_len = 0;
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(file_name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER size;
+
+    if (file == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+    {
+        HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+        if (mapping != NULL)
+        {
+            input_buffer = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+        }
+
+        input_len = (long)size.QuadPart;
+    }
+
+    CloseHandle(file);
+#else
+    FILE *file = fopen(file_name, "rb");
+    struct stat info;
+
+    if (file == NULL)
+        return FALSE;
+
+    if (fstat(fileno(file), &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0)
+    {
+        input_buffer = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+
+        if (input_buffer == MAP_FAILED)
+            input_buffer = NULL;
+
+        input_len = (long)info.st_size;
+    }
+
+    // The mapping stays after closing
+    fclose(file);
+#endif
+
+    if (input_buffer != NULL)
+    {
+        input_mapped = TRUE;
+        return TRUE;
+    }
+
+    // Empty, or something that can't be mapped
+    FILE *input_file = fopen(file_name, "rb");
+
+    if (input_file == NULL)
+        return FALSE;
+
+    fseek(input_file, 0x0, SEEK_END);
+    input_len = ftell(input_file);
+    fseek(input_file, 0x0, SEEK_SET);
+
+    input_buffer = malloc(sizeof(char) * input_len + 1);
+
+    if (input_buffer == NULL || (input_len > 0 && fread(input_buffer, sizeof(char) * input_len, 1, input_file) != 1))
+    {
+        free(input_buffer);
+        input_buffer = NULL;
+        fclose(input_file);
+        return FALSE;
+    }
+
+    fclose(input_file);
+    return TRUE;
+}
+
+void free_input()
+{
+    if (!input_mapped)
+        free(input_buffer);
+#ifdef _WIN32
+    else
+        UnmapViewOfFile(input_buffer);
+#else
+    else
+        munmap(input_buffer, input_len);
+#endif
+
+    input_buffer = NULL;
+}
+
+// Doubles the output buffer.
+void grow_output()
+{
+    output_size = output_size > 0 ? output_size * 2 : 65536;
+    output_buffer = realloc(output_buffer, output_size);
+
+    if (write_map)
+        output_lines = realloc(output_lines, output_size * sizeof(uint32_t));
+
+    if (output_buffer == NULL || (write_map && output_lines == NULL))
+        error(str_new("Out of memory"));
+}
+
 // Writing functions
 
 void write(unsigned char bytecode)
 {
+    if (cur_mem_loc == output_size)
+        grow_output();
+
     output_buffer[cur_mem_loc] = bytecode;
+
+    if (write_map)
+        output_lines[cur_mem_loc] = line;
+
     cur_mem_loc++;
 }
 
@@ -167,255 +525,1219 @@ void write_8bit_hex()
 {
     demand_char(S_VALUE_FORMAT_SETTER, VALUE_PREFIX_ERROR_MSG);
 
-    char *num = str_new(HEX);
-    num = str_combine(num, build_word());
-
-    write((unsigned char)strtol(num, NULL, 0));
+    long num = parse_number(build_word(), 16);
 
-    free(num);
+    write((unsigned char)num);
 }
 
 void write_16bit_hex()
 {
     demand_char(S_VALUE_FORMAT_SETTER, VALUE_PREFIX_ERROR_MSG);
 
-    char *num = str_new(HEX);
-    num = str_combine(num, build_word());
+    long num = parse_number(build_word(), 16);
 
-    write((unsigned char)strtol(num, NULL, 0));
-    write((unsigned char)((uint16_t)strtol(num, NULL, 0) >> 8));
-
-    free(num);
+    write((unsigned char)num);
+    write((unsigned char)((uint16_t)num >> 8));
 }
 
+// Ints are cut to int first, like atoi() does
 void write_8bit_int()
 {
     demand_char(S_VALUE_FORMAT_SETTER, VALUE_PREFIX_ERROR_MSG);
 
-    char *num = build_word();
-
-    write((unsigned char)atoi(num));
+    int num = (int)parse_number(build_word(), 10);
 
-    free(num);
+    write((unsigned char)num);
 }
 
 void write_16bit_int()
 {
     demand_char(S_VALUE_FORMAT_SETTER, VALUE_PREFIX_ERROR_MSG);
 
-    char *num = build_word();
+    int num = (int)parse_number(build_word(), 10);
 
-    write((unsigned char)atoi(num));
-    write((unsigned char)((uint16_t)atoi(num) >> 8));
-
-    free(num);
+    write((unsigned char)num);
+    write((unsigned char)((uint16_t)num >> 8));
 }
 
-void export()
+// Adds formatted text to the end of text, which grows as needed.
+void append_text(char **text, unsigned long *len, unsigned long *size, const char *format, ...)
 {
-    printf("Export:\n");
+    va_list args;
 
-    for (int i = 0; i < cur_mem_loc; i++)
+    for (;;)
     {
-        printf("%d ", output_buffer[i]);
-        fwrite(&output_buffer[i], sizeof(char), 1, output);
+        va_start(args, format);
+        int length = vsnprintf(*text + *len, *size - *len, format, args);
+        va_end(args);
+
+        if (*len + length < *size)
+        {
+            *len += length;
+            return;
+        }
+
+        *size = *size > 0 ? (*len + length + 1) * 2 : 4096;
+        *text = realloc(*text, *size);
+
+        if (*text == NULL)
+            error(str_new("Out of memory"));
     }
 }
 
-// Assembling functions
+// Returns the source map for vm1, a line entry whenever the line
+// changes and an entry for every location pointer, and its length
+// in len. See vm1_map.h for the format.
+char *format_map(char *source_name, unsigned long *len)
+{
+    char *text = NULL;
+    unsigned long size = 0;
+
+    *len = 0;
+    append_text(&text, len, &size, "VM1 map 1\nsource %s\n", source_name);
+
+    for (long i = 0; i < cur_mem_loc; i++)
+        if (i == 0 || output_lines[i] != output_lines[i - 1])
+            append_text(&text, len, &size, "line %ld %lu\n", i, (unsigned long)output_lines[i]);
+
+    for (unsigned long i = 0; i < loc_ptr_defs_len; i++)
+        append_text(&text, len, &size, "label %ld %s\n", loc_ptrs[loc_ptr_defs[i]].mem_loc, loc_ptrs[loc_ptr_defs[i]].id);
+
+    return text;
+}
+
+void export_map(char *file_name, char *source_name)
+{
+    FILE *map = fopen(file_name, "w");
+    unsigned long len;
+    char *text = format_map(source_name, &len);
+
+    if (map == NULL)
+        error(str_new("Couldn't write the map"));
+
+    fwrite(text, sizeof(char), len, map);
+    fclose(map);
+    free(text);
+}
 
-void write_keyword(char *word)
+// Keywords
+
+// What a keyword writes
+enum
+{
+    K_BYTE,       // value as is
+    K_8BIT_HEX,   // hex value that follows
+    K_16BIT_HEX,
+    K_8BIT_INT,   // int value that follows
+    K_16BIT_INT
+};
+
+typedef struct
 {
+    char *name;
+    unsigned char kind;
+    unsigned char value;
+} keyword;
+
+const keyword keywords[] = {
     // Op codes
 
     // Program flow related
-    if (str_equals(word, "END"))
-        write(0x0);
-    else if (str_equals(word, "JMP") || str_equals(word, "JUMP"))
-        write(0x1);
-    else if (str_equals(word, "PBR") || str_equals(word, "POSITIVE_BRANCH"))
-        write(0x2);
-    else if (str_equals(word, "NBR") || str_equals(word, "NEGATIVE_BRANCH"))
-        write(0x3);
+    {"END", K_BYTE, 0x0},
+    {"JMP", K_BYTE, 0x1},
+    {"JUMP", K_BYTE, 0x1},
+    {"PBR", K_BYTE, 0x2},
+    {"POSITIVE_BRANCH", K_BYTE, 0x2},
+    {"NBR", K_BYTE, 0x3},
+    {"NEGATIVE_BRANCH", K_BYTE, 0x3},
 
     // ALU related
-    else if (str_equals(word, "ADD"))
-        write(0x4);
-    else if (str_equals(word, "SUB") || str_equals(word, "SUBTRACT"))
-        write(0x5);
-    else if (str_equals(word, "MUL") || str_equals(word, "MULTIPLY"))
-        write(0x6);
-    else if (str_equals(word, "DIV") || str_equals(word, "DIVIDE"))
-        write(0x7);
-    else if (str_equals(word, "REM") || str_equals(word, "REMINDER"))
-        write(0x8);
+    {"ADD", K_BYTE, 0x4},
+    {"SUB", K_BYTE, 0x5},
+    {"SUBTRACT", K_BYTE, 0x5},
+    {"MUL", K_BYTE, 0x6},
+    {"MULTIPLY", K_BYTE, 0x6},
+    {"DIV", K_BYTE, 0x7},
+    {"DIVIDE", K_BYTE, 0x7},
+    {"REM", K_BYTE, 0x8},
+    {"REMINDER", K_BYTE, 0x8},
 
     // Memory management related
-    else if (str_equals(word, "SRV") || str_equals(word, "SET_REGISTER_VALUE"))
-        write(0x9);
-    else if (str_equals(word, "SRR") || str_equals(word, "SET_REGISTER_REGISTER"))
-        write(0xA);
-    else if (str_equals(word, "SRM") || str_equals(word, "SET_REGISTER_MEMORY"))
-        write(0xB);
-    else if (str_equals(word, "SMR") || str_equals(word, "SET_MEMORY_REGISTER"))
-        write(0xC);
+    {"SRV", K_BYTE, 0x9},
+    {"SET_REGISTER_VALUE", K_BYTE, 0x9},
+    {"SRR", K_BYTE, 0xA},
+    {"SET_REGISTER_REGISTER", K_BYTE, 0xA},
+    {"SRM", K_BYTE, 0xB},
+    {"SET_REGISTER_MEMORY", K_BYTE, 0xB},
+    {"SMR", K_BYTE, 0xC},
+    {"SET_MEMORY_REGISTER", K_BYTE, 0xC},
 
     // Conditionals related
-    else if (str_equals(word, "IEQ") || str_equals(word, "IS_EQUAL"))
-        write(0xD);
-    else if (str_equals(word, "ILT") || str_equals(word, "IS_LESS_THAN"))
-        write(0xE);
-    else if (str_equals(word, "IMT") || str_equals(word, "IS_MORE_THAN"))
-        write(0xF);
-    else if (str_equals(word, "ILQ") || str_equals(word, "IS_LESS_OR_EQUAL_TO"))
-        write(0x10);
-    else if (str_equals(word, "IMQ") || str_equals(word, "IS_MORE_OR_EQUAL_TO"))
-        write(0x11);
+    {"IEQ", K_BYTE, 0xD},
+    {"IS_EQUAL", K_BYTE, 0xD},
+    {"ILT", K_BYTE, 0xE},
+    {"IS_LESS_THAN", K_BYTE, 0xE},
+    {"IMT", K_BYTE, 0xF},
+    {"IS_MORE_THAN", K_BYTE, 0xF},
+    {"ILQ", K_BYTE, 0x10},
+    {"IS_LESS_OR_EQUAL_TO", K_BYTE, 0x10},
+    {"IMQ", K_BYTE, 0x11},
+    {"IS_MORE_OR_EQUAL_TO", K_BYTE, 0x11},
 
     // Output related
-    else if (str_equals(word, "OUT") || str_equals(word, "OUTPUT"))
-        write(0x12);
+    {"OUT", K_BYTE, 0x12},
+    {"OUTPUT", K_BYTE, 0x12},
+
+    // Register plus offset addressing related
+    {"LDD", K_BYTE, 0x13},
+    {"LOAD_DOUBLE", K_BYTE, 0x13},
+    {"STD", K_BYTE, 0x14},
+    {"STORE_DOUBLE", K_BYTE, 0x14},
+    {"LDQ", K_BYTE, 0x15},
+    {"LOAD_QUAD", K_BYTE, 0x15},
+    {"STQ", K_BYTE, 0x16},
+    {"STORE_QUAD", K_BYTE, 0x16},
 
     // Registers
-    else if (str_equals(word, "RG1") || str_equals(word, "REGISTER1"))
-        write(0x0);
-    else if (str_equals(word, "RG2") || str_equals(word, "REGISTER2"))
-        write(0x1);
-    else if (str_equals(word, "RG3") || str_equals(word, "REGISTER3"))
-        write(0x2);
-    else if (str_equals(word, "RG4") || str_equals(word, "REGISTER4"))
-        write(0x3);
+    {"RG1", K_BYTE, 0x0},
+    {"REGISTER1", K_BYTE, 0x0},
+    {"RG2", K_BYTE, 0x1},
+    {"REGISTER2", K_BYTE, 0x1},
+    {"RG3", K_BYTE, 0x2},
+    {"REGISTER3", K_BYTE, 0x2},
+    {"RG4", K_BYTE, 0x3},
+    {"REGISTER4", K_BYTE, 0x3},
 
     // Flags
-    else if (str_equals(word, "ZRO") || str_equals(word, "ZERO"))
-        write(0x0);
-    else if (str_equals(word, "POS") || str_equals(word, "POSITIVE"))
-        write(0x1);
-    else if (str_equals(word, "NEG") || str_equals(word, "NEGATIVE"))
-        write(0x2);
-    else if (str_equals(word, "EQL") || str_equals(word, "EQUAL"))
-        write(0x3);
-    else if (str_equals(word, "LTH") || str_equals(word, "LESS_THAN"))
-        write(0x4);
-    else if (str_equals(word, "MTH") || str_equals(word, "MORE_THAN"))
-        write(0x5);
-    else if (str_equals(word, "LQT") || str_equals(word, "LESS_OR_EQUAL_TO"))
-        write(0x6);
-    else if (str_equals(word, "MQT") || str_equals(word, "MORE_OR_EQUAL_TO"))
-        write(0x7);
+    {"ZRO", K_BYTE, 0x0},
+    {"ZERO", K_BYTE, 0x0},
+    {"POS", K_BYTE, 0x1},
+    {"POSITIVE", K_BYTE, 0x1},
+    {"NEG", K_BYTE, 0x2},
+    {"NEGATIVE", K_BYTE, 0x2},
+    {"EQL", K_BYTE, 0x3},
+    {"EQUAL", K_BYTE, 0x3},
+    {"LTH", K_BYTE, 0x4},
+    {"LESS_THAN", K_BYTE, 0x4},
+    {"MTH", K_BYTE, 0x5},
+    {"MORE_THAN", K_BYTE, 0x5},
+    {"LQT", K_BYTE, 0x6},
+    {"LESS_OR_EQUAL_TO", K_BYTE, 0x6},
+    {"MQT", K_BYTE, 0x7},
+    {"MORE_OR_EQUAL_TO", K_BYTE, 0x7},
 
     // Data formats
 
     // Hex
-    else if (str_equals(word, "SX") || str_equals(word, "SINGLE_HEX"))
-        write_8bit_hex();
-    else if (str_equals(word, "DX") || str_equals(word, "DOUBLE_HEX"))
-        write_16bit_hex();
+    {"SX", K_8BIT_HEX, 0},
+    {"SINGLE_HEX", K_8BIT_HEX, 0},
+    {"DX", K_16BIT_HEX, 0},
+    {"DOUBLE_HEX", K_16BIT_HEX, 0},
 
     // Int
-    else if (str_equals(word, "SI") || str_equals(word, "SINGLE_INT"))
-        write_8bit_int();
-    else if (str_equals(word, "DI") || str_equals(word, "DOUBLE_INT"))
-        write_16bit_int();
+    {"SI", K_8BIT_INT, 0},
+    {"SINGLE_INT", K_8BIT_INT, 0},
+    {"DI", K_16BIT_INT, 0},
+    {"DOUBLE_INT", K_16BIT_INT, 0}};
+
+#define KEYWORD_COUNT (sizeof(keywords) / sizeof(keywords[0]))
 
-    else // Keyword is unsupported
+// Keywords are found with a perfect hash: keyword_seed is picked
+// when starting so that every keyword gets a slot of its own, and
+// a word only needs to be compared with the keyword in its slot.
+// Slots hold the index of the keyword plus one, 0 is empty.
+#define KEYWORD_SLOTS 1024
+
+unsigned char keyword_slots[KEYWORD_SLOTS];
+uint32_t keyword_seed;
+
+uint32_t hash_keyword(token word, uint32_t seed)
+{
+    return hash_token(word, seed) & (KEYWORD_SLOTS - 1);
+}
+
+void init_keywords()
+{
+    for (keyword_seed = 0;; keyword_seed++)
     {
-        char *err_msg = str_new("");
+        unsigned long i;
+
+        memset(keyword_slots, 0, sizeof(keyword_slots));
+
+        for (i = 0; i < KEYWORD_COUNT; i++)
+        {
+            token name = {keywords[i].name, strlen(keywords[i].name)};
+            uint32_t slot = hash_keyword(name, keyword_seed);
+
+            if (keyword_slots[slot] != 0)
+                break;
 
-        err_msg = str_combine(err_msg, UNSUPPORTED_KEYWORD_ERROR_MSG);
-        err_msg = str_combine(err_msg, word);
+            keyword_slots[slot] = i + 1;
+        }
 
-        error(err_msg);
+        if (i == KEYWORD_COUNT)
+            return;
     }
 }
 
-int main(int argc, char *argv[])
+// Returns the keyword, or NULL when the word isn't one.
+const keyword *find_keyword(token word)
 {
-    // No input file given, exit
-    if (argc < 2)
-        return 0;
+    unsigned char slot = keyword_slots[hash_keyword(word, keyword_seed)];
 
-    printf("%s Assembler %s\nFile: %s\n", PROJECT_NAME, ASM_VERSION, argv[1]);
+    if (slot == 0 || !token_equals(word, keywords[slot - 1].name))
+        return NULL;
 
-    // Reading input file
-    FILE *input_file = fopen(argv[1], "rb");
+    return &keywords[slot - 1];
+}
 
-    // Counting file length
-    fseek(input_file, 0x0, SEEK_END);
-    input_len = ftell(input_file);
-    fseek(input_file, 0x0, SEEK_SET);
+// Returns the address of the location pointer for a call. Calls
+// are 16 bits, so they can't reach past the first 64K.
+uint16_t loc_ptr_address(loc_ptr *called)
+{
+    if (called->mem_loc > UINT16_MAX)
+        error(format_message("Location pointer \"%s\" is at %ld, calls can't reach past %u",
+                             called->id, called->mem_loc, UINT16_MAX));
 
-    // Creating input buffer with input file length size
-    // and add contents from input file to it
-    input_buffer = malloc(sizeof(char) * input_len + 1);
+    return (uint16_t)called->mem_loc;
+}
 
-    fread(input_buffer, sizeof(char) * input_len, 1, input_file);
-    fclose(input_file);
+// Assembling functions
 
-    input_buffer[input_len] = '\0';
+void write_keyword(token word)
+{
+    const keyword *key = find_keyword(word);
 
-    printf("Program size: %d bytes\n", input_len);
+    if (key == NULL) // Keyword is unsupported
+        error(format_message("%s%s", UNSUPPORTED_KEYWORD_ERROR_MSG, arena_copy(word)));
 
-    // Creating name for the output
-    char *output_file_name = str_new("");
+    switch (key->kind)
+    {
+    case K_BYTE:
+        write(key->value);
+        break;
+    case K_8BIT_HEX:
+        write_8bit_hex();
+        break;
+    case K_16BIT_HEX:
+        write_16bit_hex();
+        break;
+    case K_8BIT_INT:
+        write_8bit_int();
+        break;
+    case K_16BIT_INT:
+        write_16bit_int();
+        break;
+    }
+}
 
-    output_file_name = str_combine(output_file_name, argv[1]);
-    output_file_name = str_combine(output_file_name, FILE_FORMAT_NAME);
+// Optimizing
+
+// Op codes, see vm1_doc.txt
+#define OP_END 0x0
+#define OP_JUMP 0x1
+#define OP_POSITIVE_BRANCH 0x2
+#define OP_NEGATIVE_BRANCH 0x3
+#define OP_ADDITION 0x4
+#define OP_REMAINDER 0x8
+#define OP_SET_REG_VAL 0x9
+#define OP_SET_REG_REG 0xA
+#define OP_SET_REG_MEM 0xB
+#define OP_SET_MEM_REG 0xC
+#define OP_IS_EQUAL 0xD
+#define OP_IS_MORE_OR_EQUAL_TO 0x11
+#define OP_OUT 0x12
+#define OP_LOAD_DOUBLE 0x13
+#define OP_STORE_DOUBLE 0x14
+#define OP_LOAD_QUAD 0x15
+#define OP_STORE_QUAD 0x16
+
+#define REGISTER_COUNT 4
+#define FLAG_COUNT 8
+
+// Length of every instruction in bytes, op code included.
+// Zero for unsupported op codes.
+const unsigned char op_length[256] = {
+    [0x0] = 1, [0x1] = 3, [0x2] = 4, [0x3] = 4,
+    [0x4] = 3, [0x5] = 3, [0x6] = 3, [0x7] = 3, [0x8] = 3,
+    [0x9] = 4, [0xA] = 3, [0xB] = 3, [0xC] = 4,
+    [0xD] = 3, [0xE] = 3, [0xF] = 3, [0x10] = 3, [0x11] = 3,
+    [0x12] = 3,
+    [0x13] = 5, [0x14] = 5, [0x15] = 5, [0x16] = 5};
+
+// Register values known by the optimizer. Values set from a
+// location pointer call are told apart by the location pointer,
+// because the address isn't known until the end.
+#define VALUE_UNKNOWN -1
+#define VALUE_NOT_REACHED -2
+#define VALUE_OF_LOC_PTR(ptr) (0x10000 + (long)(ptr))
+
+typedef struct
+{
+    long loc;
+    unsigned char op;
+    unsigned char deleted;
 
-    output_file_name[str_length(output_file_name)] = '\0';
+    // Flags are read before they're set again after this
+    unsigned char flags_used;
 
-    printf("Exporting to: %s\n", output_file_name);
+    // Register values before this
+    long values[REGISTER_COUNT];
+} code_ins;
 
-    // Assembling
-    get_next_char();
-    char *cur_word;
+code_ins *code = NULL;
+unsigned long code_len = 0, code_size = 0;
 
-    while (cur_char != '\0')
+// Index plus one of the instruction starting in every location
+// of the output, and of the location pointer call written there.
+// 0 is none.
+uint32_t *code_at = NULL;
+uint32_t *call_at = NULL;
+
+int is_jump(unsigned char op)
+{
+    return op == OP_JUMP || op == OP_POSITIVE_BRANCH || op == OP_NEGATIVE_BRANCH;
+}
+
+int sets_flags(unsigned char op)
+{
+    return (op >= OP_ADDITION && op <= OP_IS_MORE_OR_EQUAL_TO) || (op >= OP_LOAD_DOUBLE && op <= OP_STORE_QUAD);
+}
+
+// Returns 1 if the instruction reads or writes memory in the location
+// a register has.
+int addresses_register(unsigned char op)
+{
+    return op == OP_SET_REG_MEM || (op >= OP_LOAD_DOUBLE && op <= OP_STORE_QUAD);
+}
+
+// Returns 1 if the registers and flags of the instruction exist.
+int operands_exist(unsigned char op, unsigned char *operands)
+{
+    switch (op)
     {
-        skip_blanks();
+    case OP_END:
+    case OP_JUMP:
+        return TRUE;
+    case OP_POSITIVE_BRANCH:
+    case OP_NEGATIVE_BRANCH:
+        return operands[0] < FLAG_COUNT;
+    case OP_SET_REG_VAL:
+    case OP_OUT:
+        return operands[0] < REGISTER_COUNT;
+    case OP_SET_MEM_REG:
+        return operands[2] < REGISTER_COUNT;
+    case OP_LOAD_QUAD:
+    case OP_STORE_QUAD:
+        // 32bit values take the register after the first one too
+        return operands[0] + 1 < REGISTER_COUNT && operands[1] < REGISTER_COUNT;
+    }
 
-        // Stated
-        switch (cur_char)
-        {
-        case S_LOCATION_POINTER_CALL:
-            get_next_char();
+    return operands[0] < REGISTER_COUNT && operands[1] < REGISTER_COUNT;
+}
 
-            char *id = build_word();
+// Memory location of the address in a jump, a branch or SMR.
+long address_loc(code_ins *ins)
+{
+    return ins->op == OP_POSITIVE_BRANCH || ins->op == OP_NEGATIVE_BRANCH ? ins->loc + 2 : ins->loc + 1;
+}
 
-            if (loc_ptr_exists(id))
-            {
-                uint16_t loc = get_loc_ptr(id);
-                write(loc);
-                write(loc >> 8);
+// Memory location of the 16bit value that can be an address of data:
+// the value of SRV, the address of SMR or the offset of a load or a
+// store. -1 for other instructions.
+long data_value_loc(code_ins *ins)
+{
+    if (ins->op == OP_SET_REG_VAL)
+        return ins->loc + 2;
 
-                printf("Non buffered location call %s: %i\n", id, loc);
+    if (ins->op == OP_SET_MEM_REG)
+        return ins->loc + 1;
 
-                free(id);
-            }
-            else
-            {
-                loc_ptr_calls[loc_ptr_calls_len].id = id;
-                loc_ptr_calls[loc_ptr_calls_len].mem_loc = cur_mem_loc;
-                loc_ptr_calls_len++;
+    return ins->op >= OP_LOAD_DOUBLE && ins->op <= OP_STORE_QUAD ? ins->loc + 3 : -1;
+}
 
-                write(0x0);
-                write(0x0);
-            }
-            break;
+// Skips the deleted instructions starting from loc.
+long skip_deleted(long loc)
+{
+    while (loc < cur_mem_loc && code_at[loc] != 0 && code[code_at[loc] - 1].deleted)
+        loc += op_length[code[code_at[loc] - 1].op];
 
-        case S_LOCATION_POINTER:
-            get_next_char();
+    return loc;
+}
 
-            loc_ptrs[loc_ptrs_len].id = build_word();
-            loc_ptrs[loc_ptrs_len].mem_loc = cur_mem_loc;
+// Returns the instruction a jump or a branch goes to.
+code_ins *jump_target(code_ins *ins)
+{
+    loc_ptr_call *call = &loc_ptr_calls[call_at[address_loc(ins)] - 1];
+    long loc = skip_deleted(loc_ptrs[call->ptr].mem_loc);
 
-            loc_ptrs_len++;
-            break;
+    return loc < cur_mem_loc && code_at[loc] != 0 ? &code[code_at[loc] - 1] : NULL;
+}
 
-        case S_COMMENT:
-            while (cur_char != '\n' && cur_char != '\0')
-                get_next_char();
-            break;
+// Returns the instruction execution continues from after ins, or
+// NULL when it never does.
+code_ins *next_ins(code_ins *ins)
+{
+    if (ins->op == OP_END || ins->op == OP_JUMP)
+        return NULL;
+
+    long loc = skip_deleted(ins->loc + op_length[ins->op]);
+
+    return loc < cur_mem_loc && code_at[loc] != 0 ? &code[code_at[loc] - 1] : NULL;
+}
+
+// Finds every instruction that can be reached from the start of
+// the program. Everything else is left alone as data. Returns why
+// the program can't be optimized, or NULL.
+const char *find_code()
+{
+    long *pending = malloc(sizeof(long) * (cur_mem_loc + 1));
+    unsigned char *covered = calloc(cur_mem_loc + 1, sizeof(char));
+    long pending_len = 0;
+    const char *problem = NULL;
+
+    if (pending == NULL || covered == NULL)
+        error(str_new("Out of memory"));
+
+    pending[pending_len++] = 0;
+
+    while (pending_len > 0 && problem == NULL)
+    {
+        long loc = pending[--pending_len];
+
+        if (loc < cur_mem_loc && code_at[loc] != 0)
+            continue;
+
+        // The program is left for vm1 to reject
+        if (loc >= cur_mem_loc)
+        {
+            problem = "execution runs past the end of the program";
+            break;
+        }
+
+        unsigned char op = output_buffer[loc];
+
+        if (op_length[op] == 0 || loc + op_length[op] > cur_mem_loc)
+        {
+            problem = "unsupported or incomplete operation";
+            break;
+        }
+
+        for (long i = loc; i < loc + op_length[op]; i++)
+            if (covered[i])
+                problem = "instructions overlap";
+
+        if (!operands_exist(op, (unsigned char *)&output_buffer[loc + 1]))
+            problem = "non existing register or flag";
+
+        if (problem != NULL)
+            break;
+
+        code = grow(code, code_len, &code_size, sizeof(code_ins));
+        code[code_len] = (code_ins){loc, op, FALSE, FALSE, {0}};
+        code_at[loc] = ++code_len;
+        memset(&covered[loc], TRUE, op_length[op]);
+
+        // Addresses are moved when the program shrinks, so they
+        // have to be location pointer calls
+        if (is_jump(op) || op == OP_SET_MEM_REG)
+        {
+            long address = address_loc(&code[code_len - 1]);
+
+            if (call_at[address] == 0)
+            {
+                problem = "an address isn't a location pointer call";
+                break;
+            }
+
+            if (op != OP_SET_MEM_REG)
+                pending[pending_len++] = loc_ptrs[loc_ptr_calls[call_at[address] - 1].ptr].mem_loc;
+        }
+
+        if (op != OP_END && op != OP_JUMP)
+            pending[pending_len++] = loc + op_length[op];
+    }
+
+    // Code can't be read or written with SRV, SMR and offsets,
+    // because it may change
+    for (unsigned long i = 0; i < code_len && problem == NULL; i++)
+    {
+        long address = data_value_loc(&code[i]);
+
+        if (address >= 0 && call_at[address] != 0)
+        {
+            long loc = loc_ptrs[loc_ptr_calls[call_at[address] - 1].ptr].mem_loc;
+
+            if (loc < cur_mem_loc && covered[loc])
+                problem = "a location pointer used as data points to code";
+        }
+    }
+
+    // Data moves with the code, so a value that points to data is
+    // taken as an address that isn't a location pointer call, when
+    // the program reads or writes memory through registers
+    int reads_memory = FALSE;
+
+    for (unsigned long i = 0; i < code_len; i++)
+        if (addresses_register(code[i].op))
+            reads_memory = TRUE;
+
+    for (unsigned long i = 0; i < code_len && problem == NULL && reads_memory; i++)
+    {
+        long address = data_value_loc(&code[i]);
+
+        if (address < 0)
+            continue;
+
+        unsigned char *operands = (unsigned char *)&output_buffer[address];
+        long value = operands[0] + (operands[1] << 8);
+
+        if (call_at[address] == 0 && value < cur_mem_loc && !covered[value])
+            problem = "a value points to data, but isn't a location pointer call";
+    }
+
+    free(pending);
+    free(covered);
+
+    return problem;
+}
+
+// Makes jumps and branches to jumps go straight to where the last
+// jump goes. Returns the number of jumps changed.
+long thread_jumps()
+{
+    long changed = 0;
+
+    for (unsigned long i = 0; i < code_len; i++)
+    {
+        if (code[i].deleted || !is_jump(code[i].op))
+            continue;
+
+        loc_ptr_call *call = &loc_ptr_calls[call_at[address_loc(&code[i])] - 1];
+        code_ins *target = jump_target(&code[i]);
+        uint32_t old_ptr = call->ptr;
+
+        // Steps are limited, so jumps in a loop end
+        for (unsigned long steps = 0; target != NULL && target->op == OP_JUMP && steps < code_len; steps++)
+        {
+            code_ins *next = jump_target(target);
+
+            if (next == target)
+                break;
+
+            call->ptr = loc_ptr_calls[call_at[target->loc + 1] - 1].ptr;
+            target = next;
+        }
+
+        if (call->ptr != old_ptr)
+            changed++;
+    }
+
+    return changed;
+}
+
+// Deletes jumps and branches to the next instruction.
+long delete_useless_jumps()
+{
+    long deleted = 0;
+
+    for (unsigned long i = 0; i < code_len; i++)
+    {
+        if (code[i].deleted || !is_jump(code[i].op))
+            continue;
+
+        long next = skip_deleted(code[i].loc + op_length[code[i].op]);
+        code_ins *target = jump_target(&code[i]);
+
+        if (target != NULL && target->loc == next)
+        {
+            code[i].deleted = TRUE;
+            deleted++;
+        }
+    }
+
+    return deleted;
+}
+
+// Deletes the instructions that can't be reached anymore.
+long delete_unreachable()
+{
+    unsigned char *reached = calloc(code_len + 1, sizeof(char));
+    uint32_t *pending = malloc(sizeof(uint32_t) * (code_len + 1));
+    unsigned long pending_len = 0;
+    long deleted = 0;
+
+    if (reached == NULL || pending == NULL)
+        error(str_new("Out of memory"));
+
+    long start = skip_deleted(0);
+
+    if (start < cur_mem_loc && code_at[start] != 0)
+    {
+        reached[code_at[start] - 1] = TRUE;
+        pending[pending_len++] = code_at[start] - 1;
+    }
+
+    while (pending_len > 0)
+    {
+        code_ins *ins = &code[pending[--pending_len]];
+        code_ins *next[2] = {next_ins(ins), is_jump(ins->op) ? jump_target(ins) : NULL};
+
+        for (int i = 0; i < 2; i++)
+            if (next[i] != NULL && !reached[next[i] - code])
+            {
+                reached[next[i] - code] = TRUE;
+                pending[pending_len++] = next[i] - code;
+            }
+    }
+
+    for (unsigned long i = 0; i < code_len; i++)
+        if (!code[i].deleted && !reached[i])
+        {
+            code[i].deleted = TRUE;
+            deleted++;
+        }
+
+    free(reached);
+    free(pending);
+
+    return deleted;
+}
+
+// Sets values of the instruction to what's known before it.
+// Returns 1 if they changed.
+int merge_values(code_ins *ins, long *values)
+{
+    int changed = FALSE;
+
+    for (int reg = 0; reg < REGISTER_COUNT; reg++)
+    {
+        long value = ins->values[reg] == VALUE_NOT_REACHED || ins->values[reg] == values[reg] ? values[reg] : VALUE_UNKNOWN;
+
+        if (value != ins->values[reg])
+        {
+            ins->values[reg] = value;
+            changed = TRUE;
+        }
+    }
+
+    return changed;
+}
+
+// Deletes SRV and SRR that set a register to the value it already
+// has, when nothing reads the flags they set.
+long delete_useless_sets()
+{
+    long deleted = 0;
+    int changed = TRUE;
+
+    for (unsigned long i = 0; i < code_len; i++)
+        code[i].flags_used = FALSE;
+
+    // Flags are read by branches, and shown when the program ends
+    while (changed)
+    {
+        changed = FALSE;
+
+        for (unsigned long i = code_len; i-- > 0;)
+        {
+            code_ins *ins = &code[i];
+
+            if (ins->deleted)
+                continue;
+
+            code_ins *next[2] = {next_ins(ins), is_jump(ins->op) ? jump_target(ins) : NULL};
+            int used = ins->op == OP_END;
+
+            for (int j = 0; j < 2; j++)
+                if (next[j] != NULL && (next[j]->op == OP_POSITIVE_BRANCH || next[j]->op == OP_NEGATIVE_BRANCH ||
+                                        (!sets_flags(next[j]->op) && next[j]->flags_used)))
+                    used = TRUE;
+
+            if (used != ins->flags_used)
+            {
+                ins->flags_used = used;
+                changed = TRUE;
+            }
+        }
+    }
+
+    // Register values, nothing is known when the program starts
+    long values[REGISTER_COUNT];
+
+    for (unsigned long i = 0; i < code_len; i++)
+        for (int reg = 0; reg < REGISTER_COUNT; reg++)
+            code[i].values[reg] = VALUE_NOT_REACHED;
+
+    long start = skip_deleted(0);
+
+    for (int reg = 0; reg < REGISTER_COUNT; reg++)
+        values[reg] = VALUE_UNKNOWN;
+
+    merge_values(&code[code_at[start] - 1], values);
+
+    for (changed = TRUE; changed;)
+    {
+        changed = FALSE;
+
+        for (unsigned long i = 0; i < code_len; i++)
+        {
+            code_ins *ins = &code[i];
+            unsigned char *operands = (unsigned char *)&output_buffer[ins->loc + 1];
+
+            if (ins->deleted || ins->values[0] == VALUE_NOT_REACHED)
+                continue;
+
+            memcpy(values, ins->values, sizeof(values));
+
+            if (ins->op == OP_SET_REG_VAL)
+                values[operands[0]] = call_at[ins->loc + 2] != 0
+                                          ? VALUE_OF_LOC_PTR(loc_ptr_calls[call_at[ins->loc + 2] - 1].ptr)
+                                          : operands[1] + (operands[2] << 8);
+            else if (ins->op == OP_SET_REG_REG)
+                values[operands[0]] = values[operands[1]];
+            else if ((ins->op >= OP_ADDITION && ins->op <= OP_REMAINDER) || ins->op == OP_SET_REG_MEM ||
+                     ins->op == OP_LOAD_DOUBLE)
+                values[operands[0]] = VALUE_UNKNOWN;
+            else if (ins->op == OP_LOAD_QUAD)
+                values[operands[0]] = values[operands[0] + 1] = VALUE_UNKNOWN;
+
+            code_ins *next[2] = {next_ins(ins), is_jump(ins->op) ? jump_target(ins) : NULL};
+
+            for (int j = 0; j < 2; j++)
+                if (next[j] != NULL && merge_values(next[j], values))
+                    changed = TRUE;
+        }
+    }
+
+    for (unsigned long i = 0; i < code_len; i++)
+    {
+        code_ins *ins = &code[i];
+        unsigned char *operands = (unsigned char *)&output_buffer[ins->loc + 1];
+
+        if (ins->deleted || ins->flags_used || ins->values[0] == VALUE_NOT_REACHED)
+            continue;
+
+        long value = VALUE_UNKNOWN;
+
+        if (ins->op == OP_SET_REG_VAL)
+            value = call_at[ins->loc + 2] != 0
+                        ? VALUE_OF_LOC_PTR(loc_ptr_calls[call_at[ins->loc + 2] - 1].ptr)
+                        : operands[1] + (operands[2] << 8);
+        else if (ins->op == OP_SET_REG_REG)
+            value = operands[0] == operands[1] ? ins->values[operands[0]] : ins->values[operands[1]];
+        else
+            continue;
+
+        // Moving a register to itself never changes it
+        if ((ins->op == OP_SET_REG_REG && operands[0] == operands[1]) ||
+            (value != VALUE_UNKNOWN && value == ins->values[operands[0]]))
+        {
+            ins->deleted = TRUE;
+            deleted++;
+        }
+    }
+
+    return deleted;
+}
+
+// Removes the deleted instructions from the output, and moves
+// location pointers, calls and lines with the code after them.
+void remove_deleted()
+{
+    long *moved = malloc(sizeof(long) * (cur_mem_loc + 1));
+    long len = 0;
+
+    if (moved == NULL)
+        error(str_new("Out of memory"));
+
+    for (long loc = 0; loc < cur_mem_loc;)
+    {
+        if (code_at[loc] != 0 && code[code_at[loc] - 1].deleted)
+        {
+            for (long end = loc + op_length[code[code_at[loc] - 1].op]; loc < end; loc++)
+                moved[loc] = -1 - len;
+
+            continue;
+        }
+
+        moved[loc] = len;
+        output_buffer[len] = output_buffer[loc];
+
+        if (write_map)
+            output_lines[len] = output_lines[loc];
+
+        len++;
+        loc++;
+    }
+
+    moved[cur_mem_loc] = len;
+
+    // Location pointers in deleted code move to what follows it
+    for (unsigned long i = 0; i < loc_ptrs_len; i++)
+        if (loc_ptrs[i].line > 0)
+            loc_ptrs[i].mem_loc = moved[loc_ptrs[i].mem_loc] < 0 ? -1 - moved[loc_ptrs[i].mem_loc] : moved[loc_ptrs[i].mem_loc];
+
+    // Calls in deleted code go with it
+    unsigned long calls_len = 0;
+
+    for (unsigned long i = 0; i < loc_ptr_calls_len; i++)
+        if (moved[loc_ptr_calls[i].mem_loc] >= 0)
+        {
+            loc_ptr_calls[calls_len] = loc_ptr_calls[i];
+            loc_ptr_calls[calls_len++].mem_loc = moved[loc_ptr_calls[i].mem_loc];
+        }
+
+    loc_ptr_calls_len = calls_len;
+    cur_mem_loc = len;
+
+    free(moved);
+}
+
+// Peephole optimizer, run with -O before the location pointer
+// calls are filled in. Deletes jumps to the next instruction,
+// SRV and SRR that don't change anything and code that jumps
+// past, and makes jumps to jumps go straight to the end.
+// Every location pointer call is still in loc_ptr_calls.
+void optimize_program()
+{
+    long old_len = cur_mem_loc, deleted = 0;
+
+    // Missing location pointers are reported when filling in
+    for (unsigned long i = 0; i < loc_ptr_calls_len; i++)
+        if (loc_ptrs[loc_ptr_calls[i].ptr].line == 0)
+            return;
+
+    if (cur_mem_loc == 0)
+        return;
+
+    code_at = calloc(cur_mem_loc + 1, sizeof(uint32_t));
+    call_at = calloc(cur_mem_loc + 1, sizeof(uint32_t));
+
+    if (code_at == NULL || call_at == NULL)
+        error(str_new("Out of memory"));
+
+    for (unsigned long i = 0; i < loc_ptr_calls_len; i++)
+        call_at[loc_ptr_calls[i].mem_loc] = i + 1;
+
+    const char *problem = find_code();
+
+    if (problem != NULL)
+        printf("Not optimized, %s\n", problem);
+    else
+    {
+        for (;;)
+        {
+            long threaded = thread_jumps();
+            long removed = delete_useless_jumps();
+
+            removed += delete_unreachable();
+            removed += delete_useless_sets();
+            deleted += removed;
+
+            if (threaded == 0 && removed == 0)
+                break;
+        }
+
+        remove_deleted();
+
+        printf("Optimized: %ld instructions and %ld bytes removed\n", deleted, old_len - cur_mem_loc);
+    }
+
+    free(code);
+    free(code_at);
+    free(call_at);
+}
+
+// Program file
+
+// Marks every byte of the instructions that can be reached from
+// the start of the program, like vm1 decodes them. Jumps go to the
+// addresses in the output, so calls have to be filled in first.
+void mark_code(unsigned char *is_code)
+{
+    long *pending = malloc(sizeof(long) * (2 * cur_mem_loc + 1));
+    long pending_len = 0;
+
+    if (pending == NULL)
+        error(str_new("Out of memory"));
+
+    pending[pending_len++] = 0;
+
+    while (pending_len > 0)
+    {
+        long loc = pending[--pending_len];
+
+        if (loc >= cur_mem_loc || is_code[loc])
+            continue;
+
+        unsigned char op = output_buffer[loc];
+        unsigned char *operands = (unsigned char *)&output_buffer[loc + 1];
+
+        // Left for vm1 to reject
+        if (op_length[op] == 0 || loc + op_length[op] > cur_mem_loc)
+            continue;
+
+        memset(&is_code[loc], TRUE, op_length[op]);
+
+        if (op == OP_JUMP)
+            pending[pending_len++] = operands[0] + (operands[1] << 8);
+        else if (op == OP_POSITIVE_BRANCH || op == OP_NEGATIVE_BRANCH)
+            pending[pending_len++] = operands[1] + (operands[2] << 8);
+
+        if (op != OP_END && op != OP_JUMP)
+            pending[pending_len++] = loc + op_length[op];
+    }
+
+    free(pending);
+}
+
+// Returns the section type every byte of the output goes to. Runs
+// of zeros that aren't code become BSS when that's shorter than
+// writing them.
+unsigned char *section_types()
+{
+    unsigned char *types = calloc(cur_mem_loc + 1, sizeof(char));
+
+    if (types == NULL)
+        error(str_new("Out of memory"));
+
+    mark_code(types);
+
+    for (long loc = 0; loc < cur_mem_loc; loc++)
+        types[loc] = types[loc] ? VBC_CODE : VBC_DATA;
+
+    for (long loc = 0; loc < cur_mem_loc;)
+    {
+        long end = loc;
+
+        while (end < cur_mem_loc && types[end] == VBC_DATA && output_buffer[end] == 0)
+            end++;
+
+        // Splitting a data section takes two more section headers
+        if (end - loc > 2 * VBC_SECTION_HEADER_LEN)
+            memset(&types[loc], VBC_BSS, end - loc);
+
+        loc = end > loc ? end : loc + 1;
+    }
+
+    return types;
+}
+
+// Returns 1 if loc to end covers a whole page of memory.
+int fills_page(long loc, long end)
+{
+    return (loc + VBC_PAGE_SIZE - 1) / VBC_PAGE_SIZE * VBC_PAGE_SIZE + VBC_PAGE_SIZE <= end;
+}
+
+void put_section(unsigned char *file, unsigned long *len, uint32_t type, uint32_t loc, uint32_t length, const void *content)
+{
+    vbc_put32(file + *len, type);
+    vbc_put32(file + *len + 4, loc);
+    vbc_put32(file + *len + 8, length);
+    *len += VBC_SECTION_HEADER_LEN;
+
+    if (content != NULL)
+    {
+        memcpy(file + *len, content, length);
+        *len += length;
+    }
+}
+
+// Writes the program, in a container unless -raw is given, see
+// vbc.h. -dump also prints every byte. Returns the length of the
+// file.
+long export(char *source_name)
+{
+    if (dump)
+    {
+        printf("Export:\n");
+
+        for (long i = 0; i < cur_mem_loc; i++)
+            printf("%d ", output_buffer[i]);
+
+        printf("\n");
+    }
+
+    if (raw_output)
+    {
+        if (cur_mem_loc > 0 && fwrite(output_buffer, sizeof(char), cur_mem_loc, output) != (size_t)cur_mem_loc)
+            error(str_new("Couldn't write the output"));
+
+        return cur_mem_loc;
+    }
+
+    unsigned char *types = section_types();
+    unsigned long sections = 0, padding = 0, map_len = 0;
+    char *map = write_map ? format_map(source_name, &map_len) : NULL;
+
+    // Every section, and padding for the ones that fill a page
+    for (long loc = 0, end; loc < cur_mem_loc; loc = end)
+    {
+        for (end = loc; end < cur_mem_loc && types[end] == types[loc];)
+            end++;
+
+        sections++;
+
+        if (fills_page(loc, end))
+            padding += VBC_SECTION_HEADER_LEN + VBC_PAGE_SIZE;
+    }
+
+    unsigned long len = VBC_HEADER_LEN;
+    unsigned char *file = malloc(len + (sections + 1) * VBC_SECTION_HEADER_LEN + padding + cur_mem_loc + map_len);
+
+    if (file == NULL)
+        error(str_new("Out of memory"));
+
+    // Execution starts from the first byte
+    memcpy(file, VBC_MAGIC, VBC_MAGIC_LEN);
+    vbc_put16(file + 4, VBC_VERSION);
+    vbc_put16(file + 6, VBC_HEADER_LEN);
+    vbc_put32(file + 8, cur_mem_loc);
+    vbc_put32(file + 12, 0);
+
+    sections = 0;
+
+    for (long loc = 0, end; loc < cur_mem_loc; loc = end)
+    {
+        for (end = loc; end < cur_mem_loc && types[end] == types[loc];)
+            end++;
+
+        // Padding, so the content starts as far from the start of a
+        // page as loc
+        if (types[loc] != VBC_BSS && fills_page(loc, end) &&
+            (len + VBC_SECTION_HEADER_LEN) % VBC_PAGE_SIZE != (unsigned long)loc % VBC_PAGE_SIZE)
+        {
+            unsigned long pad = (loc % VBC_PAGE_SIZE + 2 * VBC_PAGE_SIZE -
+                                 (len + 2 * VBC_SECTION_HEADER_LEN) % VBC_PAGE_SIZE) % VBC_PAGE_SIZE;
+
+            put_section(file, &len, VBC_PAD, 0, pad, NULL);
+            memset(file + len, 0, pad);
+            len += pad;
+            sections++;
+        }
+
+        put_section(file, &len, types[loc], loc, end - loc, types[loc] == VBC_BSS ? NULL : &output_buffer[loc]);
+        sections++;
+    }
+
+    if (map != NULL)
+        put_section(file, &len, VBC_MAP, 0, map_len, map);
+
+    vbc_put32(file + 16, vbc_crc32(file + VBC_HEADER_LEN, len - VBC_HEADER_LEN));
+
+    if (fwrite(file, sizeof(char), len, output) != len)
+        error(str_new("Couldn't write the output"));
+
+    printf("Sections: %lu, memory: %ld bytes\n", sections + (map != NULL), cur_mem_loc);
+
+    free(types);
+    free(map);
+    free(file);
+
+    return len;
+}
+
+int main(int argc, char *argv[])
+{
+    char *file_name = NULL;
+
+    // Options are given before the input file
+    for (int i = 1; i < argc; i++)
+    {
+        if (str_equals(argv[i], "-map"))
+            write_map = TRUE;
+        else if (str_equals(argv[i], "-dump"))
+            dump = TRUE;
+        else if (str_equals(argv[i], "-O"))
+            optimize = TRUE;
+        else if (str_equals(argv[i], "-raw"))
+            raw_output = TRUE;
+        else
+            file_name = argv[i];
+    }
+
+    // No input file given, exit
+    if (file_name == NULL)
+        return 0;
+
+    printf("%s Assembler %s\nFile: %s\n", PROJECT_NAME, ASM_VERSION, file_name);
+
+    // Reading input file
+    if (!read_input(file_name))
+        error(str_new("Couldn't read the input file"));
+
+    printf("Program size: %ld bytes\n", input_len);
+
+    // Creating name for the output
+    char *output_file_name = str_new("");
+
+    output_file_name = str_combine(output_file_name, file_name);
+    output_file_name = str_combine(output_file_name, FILE_FORMAT_NAME);
+
+    output_file_name[str_length(output_file_name)] = '\0';
+
+    printf("Exporting to: %s\n", output_file_name);
+
+    // Assembling
+    init_keywords();
+    get_next_char();
+
+    while (cur_char != '\0')
+    {
+        skip_blanks();
+
+        // Stated
+        switch (cur_char)
+        {
+        case S_LOCATION_POINTER_CALL:
+            get_next_char();
+
+            uint32_t ptr = intern_loc_ptr(build_word());
+
+            // The optimizer moves code, so every call is filled in
+            // after it
+            if (loc_ptrs[ptr].line > 0 && !optimize)
+            {
+                uint16_t loc = loc_ptr_address(&loc_ptrs[ptr]);
+                write(loc);
+                write(loc >> 8);
+
+                printf("Non buffered location call %s: %i\n", loc_ptrs[ptr].id, loc);
+            }
+            else
+            {
+                loc_ptr_calls = grow(loc_ptr_calls, loc_ptr_calls_len, &loc_ptr_calls_size, sizeof(loc_ptr_call));
+                loc_ptr_calls[loc_ptr_calls_len].ptr = ptr;
+                loc_ptr_calls[loc_ptr_calls_len].mem_loc = cur_mem_loc;
+                loc_ptr_calls_len++;
+
+                write(0x0);
+                write(0x0);
+            }
+            break;
+
+        case S_LOCATION_POINTER:
+            get_next_char();
+
+            long def_line = line;
+            uint32_t def = intern_loc_ptr(build_word());
+
+            if (loc_ptrs[def].line > 0)
+                error(format_message("Location pointer \"%s\" is defined twice, on lines %ld and %ld",
+                                     loc_ptrs[def].id, loc_ptrs[def].line, def_line));
+
+            loc_ptrs[def].mem_loc = cur_mem_loc;
+            loc_ptrs[def].line = def_line;
+
+            loc_ptr_defs = grow(loc_ptr_defs, loc_ptr_defs_len, &loc_ptr_defs_size, sizeof(uint32_t));
+            loc_ptr_defs[loc_ptr_defs_len++] = def;
+            break;
+
+        case S_COMMENT:
+            while (cur_char != '\n' && cur_char != '\0')
+                get_next_char();
+            break;
 
         case '\"':           // String
             get_next_char(); // for the starting '"'
@@ -430,31 +1752,32 @@ int main(int argc, char *argv[])
 
         // Keywords
         if (is_alphabet())
-        {
-            cur_word = build_word();
-            write_keyword(cur_word);
-            free(cur_word);
-        }
+            write_keyword(build_word());
 
         get_next_char();
     }
 
+    if (optimize)
+        optimize_program();
+
     // Filling missing location pointers
-    for (int i = 0; i < loc_ptr_calls_len; i++)
+    for (unsigned long i = 0; i < loc_ptr_calls_len; i++)
     {
-        if (loc_ptr_exists(loc_ptr_calls[i].id))
+        loc_ptr *called = &loc_ptrs[loc_ptr_calls[i].ptr];
+
+        if (called->line > 0)
         {
-            uint16_t loc = get_loc_ptr(loc_ptr_calls[i].id);
+            uint16_t loc = loc_ptr_address(called);
 
             output_buffer[loc_ptr_calls[i].mem_loc] = loc;
             output_buffer[loc_ptr_calls[i].mem_loc + 1] = loc >> 8;
 
-            printf("Location call %s: %i\n", loc_ptr_calls[i].id, loc);
+            printf("Location call %s: %i\n", called->id, loc);
         }
         else
         {
             char *errmsg = str_new("There isn't memory location specified for \"");
-            errmsg = str_combine(errmsg, loc_ptr_calls[i].id);
+            errmsg = str_combine(errmsg, called->id);
             errmsg = str_combine(errmsg, "\"");
             error(errmsg);
         }
@@ -462,18 +1785,64 @@ int main(int argc, char *argv[])
 
     // Exporting
 
-    output = fopen(output_file_name, "w+");
-    export();
-    fclose(output);
+    // A running vm1 maps the program file, so the old file is replaced by
+    // renaming a complete new one over it instead of being rewritten.
+    char *temp_file_name = str_new(output_file_name);
+    temp_file_name = str_combine(temp_file_name, TEMP_FORMAT_NAME);
 
-    free(input_buffer);
+    output = fopen(temp_file_name, "wb");
 
-    // Printing all location pointers
-    for (uint16_t i = 0; i < loc_ptrs_len; i++)
+    if (output == NULL)
+        error(str_new("Couldn't write the output file"));
+
+    long output_len = export(file_name);
+
+    int write_failed = fclose(output) != 0;
+
+#ifdef _WIN32
+    if (!write_failed && !MoveFileExA(temp_file_name, output_file_name, MOVEFILE_REPLACE_EXISTING))
+        write_failed = TRUE;
+#else
+    if (!write_failed && rename(temp_file_name, output_file_name) != 0)
+        write_failed = TRUE;
+#endif
+
+    if (write_failed)
     {
-        printf("Location %s: %i\n", loc_ptrs[i].id, loc_ptrs[i].mem_loc);
-        free(loc_ptrs[i].id);
+        remove(temp_file_name);
+        error(str_new("Couldn't write the output file"));
     }
 
+    free(temp_file_name);
+
+    printf("Output size: %ld bytes\n", output_len);
+
+    // Otherwise the map is in the program file
+    if (write_map && raw_output)
+    {
+        char *map_file_name = str_new(output_file_name);
+        map_file_name = str_combine(map_file_name, MAP_FORMAT_NAME);
+
+        printf("\nSource map: %s\n", map_file_name);
+        export_map(map_file_name, file_name);
+
+        free(map_file_name);
+    }
+
+    free_input();
+
+    // Printing all location pointers
+    for (unsigned long i = 0; i < loc_ptr_defs_len; i++)
+        printf("Location %s: %ld\n", loc_ptrs[loc_ptr_defs[i]].id, loc_ptrs[loc_ptr_defs[i]].mem_loc);
+
+    arena_free();
+
+    free(loc_ptrs);
+    free(loc_ptr_defs);
+    free(loc_ptr_calls);
+    free(loc_ptr_slots);
+    free(output_buffer);
+    free(output_lines);
+
     getchar();
 }